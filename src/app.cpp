@@ -1,7 +1,10 @@
 #include "app.hpp"
 #include <cassert>
+#include <cstdlib>
 #include <cstring>
 #include <stdexcept>
+#include <thread>
+#include <vector>
 
 static NnFloatType parseFloatType(char *val) {
     if (std::strcmp(val, "f32") == 0) return F_32;
@@ -11,6 +14,34 @@ static NnFloatType parseFloatType(char *val) {
     throw std::runtime_error("Invalid float type: " + std::string(val));
 }
 
+static NnLinkShaper parseLinkShaper(char *val) {
+    // Typical one-way latencies of a switched Ethernet link
+    if (std::strcmp(val, "100mb") == 0) return NnLinkShaper{100000000ull, 250};
+    if (std::strcmp(val, "1gb") == 0) return NnLinkShaper{1000000000ull, 100};
+    if (std::strcmp(val, "10gb") == 0) return NnLinkShaper{10000000000ull, 25};
+    if (std::strcmp(val, "none") == 0) return NnLinkShaper{0, 0};
+    throw std::runtime_error("Invalid link: " + std::string(val));
+}
+
+static std::vector<float> parseNodeWeights(char *val, NnSize nNodes) {
+    // Comma separated relative speeds of the root and the workers, in the order of --workers
+    std::vector<float> weights;
+    char *p = val;
+    while (true) {
+        char *end;
+        float weight = std::strtof(p, &end);
+        if (end == p || weight <= 0.0f || (*end != ',' && *end != '\0'))
+            throw std::runtime_error("Invalid node weights: " + std::string(val));
+        weights.push_back(weight);
+        if (*end == '\0')
+            break;
+        p = end + 1;
+    }
+    if (weights.size() != nNodes)
+        throw std::runtime_error("Node weights must have " + std::to_string(nNodes) + " values, one per node");
+    return weights;
+}
+
 static ChatTemplateType parseChatTemplateType(char *val) {
     if (std::strcmp(val, "llama2") == 0) return TEMPLATE_LLAMA2;
     if (std::strcmp(val, "llama3") == 0) return TEMPLATE_LLAMA3;
@@ -24,14 +55,30 @@ AppCliArgs AppCliArgs::parse(int argc, char* *argv, bool requireMode) {
     args.mode = nullptr;
     args.nBatches = 32;
     args.nThreads = 1;
+    args.spinTime = DEFAULT_SPIN_TIME;
+    args.tracePath = nullptr;
+    args.pinThreads = nullptr;
+    args.mmapWeights = false;
     args.modelPath = nullptr;
     args.tokenizerPath = nullptr;
     args.prompt = nullptr;
     args.syncType = F_32;
+    args.kvCacheType = F_32;
+    args.ringAllReduce = false;
+    args.treeBroadcast = false;
+    args.localEmbedding = false;
+    args.pipeline = false;
+    args.nodeWeights = nullptr;
+    args.netWaitType = NET_WAIT_SPIN;
+    args.useSharedMemory = true;
+    args.nLoopbackNodes = 0;
+    args.linkShaper = NnLinkShaper{0, 0};
     args.nWorkers = 0;
     args.workerHosts = nullptr;
     args.workerPorts = nullptr;
     args.port = 9990;
+    args.shardPath = nullptr;
+    args.nShardNodes = 0;
     args.temperature = 0.8f;
     args.topp = 0.9f;
     args.steps = 0;
@@ -63,6 +110,46 @@ AppCliArgs AppCliArgs::parse(int argc, char* *argv, bool requireMode) {
             args.prompt = value;
         } else if (std::strcmp(name, "--buffer-float-type") == 0) {
             args.syncType = parseFloatType(value);
+        } else if (std::strcmp(name, "--kv-cache-type") == 0) {
+            args.kvCacheType = parseFloatType(value);
+        } else if (std::strcmp(name, "--all-reduce") == 0) {
+            if (std::strcmp(value, "ring") == 0)
+                args.ringAllReduce = true;
+            else if (std::strcmp(value, "mesh") == 0)
+                args.ringAllReduce = false;
+            else
+                throw std::runtime_error("Invalid all-reduce mode: " + std::string(value));
+        } else if (std::strcmp(name, "--broadcast") == 0) {
+            if (std::strcmp(value, "tree") == 0)
+                args.treeBroadcast = true;
+            else if (std::strcmp(value, "direct") == 0)
+                args.treeBroadcast = false;
+            else
+                throw std::runtime_error("Invalid broadcast mode: " + std::string(value));
+        } else if (std::strcmp(name, "--parallelism") == 0) {
+            if (std::strcmp(value, "pipeline") == 0)
+                args.pipeline = true;
+            else if (std::strcmp(value, "tensor") == 0)
+                args.pipeline = false;
+            else
+                throw std::runtime_error("Invalid parallelism: " + std::string(value));
+        } else if (std::strcmp(name, "--node-weights") == 0) {
+            args.nodeWeights = value;
+        } else if (std::strcmp(name, "--local-embedding") == 0) {
+            args.localEmbedding = atoi(value) == 1;
+        } else if (std::strcmp(name, "--net-wait") == 0) {
+            if (std::strcmp(value, "poll") == 0)
+                args.netWaitType = NET_WAIT_POLL;
+            else if (std::strcmp(value, "spin") == 0)
+                args.netWaitType = NET_WAIT_SPIN;
+            else
+                throw std::runtime_error("Invalid network wait type: " + std::string(value));
+        } else if (std::strcmp(name, "--shared-memory") == 0) {
+            args.useSharedMemory = atoi(value) == 1;
+        } else if (std::strcmp(name, "--loopback-nodes") == 0) {
+            args.nLoopbackNodes = atoi(value);
+        } else if (std::strcmp(name, "--link") == 0) {
+            args.linkShaper = parseLinkShaper(value);
         } else if (std::strcmp(name, "--workers") == 0) {
             int j = i + 1;
             for (; j < argc && argv[j][0] != '-'; j++);
@@ -88,8 +175,20 @@ AppCliArgs AppCliArgs::parse(int argc, char* *argv, bool requireMode) {
             i += count - 1;
         } else if (std::strcmp(name, "--port") == 0) {
             args.port = atoi(value);
+        } else if (std::strcmp(name, "--shard") == 0) {
+            args.shardPath = value;
+        } else if (std::strcmp(name, "--nodes") == 0) {
+            args.nShardNodes = atoi(value);
         } else if (std::strcmp(name, "--nthreads") == 0) {
             args.nThreads = atoi(value);
+        } else if (std::strcmp(name, "--spin-time") == 0) {
+            args.spinTime = atoi(value);
+        } else if (std::strcmp(name, "--trace") == 0) {
+            args.tracePath = value;
+        } else if (std::strcmp(name, "--pin-threads") == 0) {
+            args.pinThreads = value;
+        } else if (std::strcmp(name, "--mmap-weights") == 0) {
+            args.mmapWeights = atoi(value) == 1;
         } else if (std::strcmp(name, "--steps") == 0) {
             args.steps = atoi(value);
         } else if (std::strcmp(name, "--temperature") == 0) {
@@ -137,11 +236,20 @@ RootLlmInference::RootLlmInference(LlmNet *net, NnDevice *device, NnNetExecution
     this->execution = execution;
     this->executor = executor;
     this->network = network; // May be nullptr!
+    this->sendsTokens = net->options.localEmbedding;
+    this->controlPacket.nTokens = 0;
+    this->controlBuffer.resize(sizeof(LlmControlPacket) + net->netConfig.nBatches * sizeof(float));
 }
 
 void RootLlmInference::setBatchSize(NnSize batchSize) {
     execution->setBatchSize(batchSize);
     controlPacket.batchSize = batchSize;
+    controlPacket.logitsBatchSize = batchSize;
+}
+
+void RootLlmInference::setLogitsBatchSize(NnSize logitsBatchSize) {
+    execution->setOutputBatchSize(logitsBatchSize);
+    controlPacket.logitsBatchSize = logitsBatchSize;
 }
 
 void RootLlmInference::setPosition(NnSize position) {
@@ -159,8 +267,17 @@ void RootLlmInference::setToken(NnSize batchIndex, NnSize token) {
 }
 
 void RootLlmInference::forward() {
-    if (network != nullptr) 
-        network->writeAll(&controlPacket, sizeof(LlmControlPacket));
+    if (network != nullptr) {
+        if (sendsTokens) {
+            // Workers run the embedding themselves, so the token ids are sent in the same write as the packet
+            controlPacket.nTokens = execution->batchSize;
+            std::memcpy(controlBuffer.data(), &controlPacket, sizeof(LlmControlPacket));
+            std::memcpy(&controlBuffer.data()[sizeof(LlmControlPacket)], tokenPipe, controlPacket.nTokens * sizeof(float));
+            network->writeAll(controlBuffer.data(), sizeof(LlmControlPacket) + controlPacket.nTokens * sizeof(float));
+        } else {
+            network->writeAll(&controlPacket, sizeof(LlmControlPacket));
+        }
+    }
     device->syncPointers();
     executor->forward();
 }
@@ -168,6 +285,7 @@ void RootLlmInference::forward() {
 void RootLlmInference::finish() {
     if (network != nullptr) {
         controlPacket.batchSize = 0;
+        controlPacket.nTokens = 0;
         network->writeAll(&controlPacket, sizeof(LlmControlPacket));
     }
 }
@@ -177,6 +295,7 @@ WorkerLlmInference::WorkerLlmInference(NnNetExecution *execution, NnNetwork *net
     this->execution = execution;
     this->network = network;
     this->positionPipe = (float *)execution->pipes[0];
+    this->tokenPipe = (float *)execution->pipes[1];
 }
 
 bool WorkerLlmInference::tryReadControlPacket() {
@@ -188,19 +307,58 @@ bool WorkerLlmInference::tryReadControlPacket() {
         isFinished = true;
         return true;
     }
+    if (controlPacket.nTokens > 0)
+        network->read(ROOT_SOCKET_INDEX, tokenPipe, controlPacket.nTokens * sizeof(float));
     for (NnSize i = 0; i < controlPacket.batchSize; i++)
         positionPipe[i] = (float)(controlPacket.position + i);
     execution->setBatchSize(controlPacket.batchSize);
+    execution->setOutputBatchSize(controlPacket.logitsBatchSize);
     return true;
 }
 
-void runInferenceApp(AppCliArgs *args, void (*handler)(AppInferenceContext *context)) {
-    NnSize nNodes = args->nWorkers + 1;
+class WorkerNode;
+
+static void runWorker(AppCliArgs *args, NnNetwork *network, bool isInProcess, std::unique_ptr<WorkerNode> *residentNode);
+
+class LoopbackWorkers {
+private:
+    std::vector<std::unique_ptr<NnNetwork>> networks;
+    std::vector<std::thread> threads;
+public:
+    // Runs the workers of a loopback cluster on threads, networks[0] stays with the caller
+    LoopbackWorkers(AppCliArgs *args, std::vector<std::unique_ptr<NnNetwork>> *networks) {
+        for (NnSize i = 1; i < networks->size(); i++)
+            this->networks.push_back(std::move((*networks)[i]));
+        for (NnSize i = 0; i < this->networks.size(); i++) {
+            std::unique_ptr<NnNetwork> *network = &this->networks[i];
+            threads.push_back(std::thread([args, network]() {
+                try {
+                    std::unique_ptr<WorkerNode> node(nullptr);
+                    runWorker(args, network->get(), true, &node);
+                } catch (const std::exception &e) {
+                    printf("🚨 Worker error: %s\n", e.what());
+                }
+                // Closing the sockets unblocks the nodes that still wait for this one
+                network->reset();
+            }));
+        }
+    }
+    ~LoopbackWorkers() {
+        for (std::thread &thread : threads)
+            thread.join();
+    }
+};
 
-    LlmHeader header = loadLlmHeader(args->modelPath, args->maxSeqLen, args->syncType);
-    if (nNodes > header.nKvHeads)
-        // TODO: https://github.com/b4rtaz/distributed-llama/issues/70
-        throw std::runtime_error("This version does not support more nodes than the number of KV heads in the model");
+void runInferenceApp(AppCliArgs *args, void (*handler)(AppInferenceContext *context)) {
+    if (args->nLoopbackNodes > 0 && args->nWorkers > 0)
+        throw std::runtime_error("Loopback nodes cannot be used together with workers");
+    NnSize nNodes = args->nLoopbackNodes > 0 ? args->nLoopbackNodes : args->nWorkers + 1;
+
+    LlmHeader header = loadLlmHeader(args->modelPath, args->maxSeqLen, args->syncType, args->kvCacheType);
+    if (!args->pipeline && nNodes > header.nKvHeads && nNodes % header.nKvHeads != 0)
+        throw std::runtime_error("With more nodes than KV heads, the number of nodes must be a multiple of the number of KV heads");
+    if (!args->pipeline && nNodes > header.nHeads)
+        throw std::runtime_error("This version does not support more nodes than the number of heads in the model");
     if (header.weightType == F_Q40 && header.syncType != F_Q80)
         throw std::runtime_error("This version supports only Q40 weights with Q80 sync type");
 
@@ -210,7 +368,16 @@ void runInferenceApp(AppCliArgs *args, void (*handler)(AppInferenceContext *cont
 
     Sampler sampler(header.vocabSize, args->temperature, args->topp, args->seed);
 
-    LlmNet net = buildLlmNet(&header, nNodes, args->nBatches);
+    LlmNetOptions netOptions;
+    netOptions.ringAllReduce = args->ringAllReduce;
+    netOptions.treeBroadcast = args->treeBroadcast;
+    netOptions.localEmbedding = args->localEmbedding;
+    netOptions.pipeline = args->pipeline;
+    std::vector<float> nodeWeights;
+    if (args->nodeWeights != nullptr)
+        nodeWeights = parseNodeWeights(args->nodeWeights, nNodes);
+    netOptions.nodeWeights = nodeWeights.empty() ? nullptr : nodeWeights.data();
+    LlmNet net = buildLlmNet(&header, nNodes, args->nBatches, &netOptions);
     std::unique_ptr<LlmNet, void(*)(LlmNet *)> netPtr(&net, releaseLlmNet);
 
     NnNodeConfig *rootNodeConfig = &net.nodeConfigs[0];
@@ -221,30 +388,59 @@ void runInferenceApp(AppCliArgs *args, void (*handler)(AppInferenceContext *cont
     NnNetExecution execution(args->nThreads, &net.netConfig);
 
     std::unique_ptr<NnNodeSynchronizer> synchronizer(nullptr);
+    // The workers are joined after the root network is closed, so they leave even if the root fails
+    std::unique_ptr<LoopbackWorkers> loopbackWorkers(nullptr);
     std::unique_ptr<NnNetwork> networkPtr(nullptr);
     NnNetwork *network = nullptr;
 
     if (nNodes == 1) {
         synchronizer.reset(new NnFakeNodeSynchronizer());
     } else {
-        networkPtr = NnNetwork::connect(args->nWorkers, args->workerHosts, args->workerPorts);
+        if (args->nLoopbackNodes > 0) {
+            std::vector<std::unique_ptr<NnNetwork>> networks = NnNetwork::createLoopback(nNodes);
+            networkPtr = std::move(networks[0]);
+            loopbackWorkers.reset(new LoopbackWorkers(args, &networks));
+            printf("⭕ Loopback network with %u nodes\n", nNodes);
+        } else {
+            networkPtr = NnNetwork::connect(args->nWorkers, args->workerHosts, args->workerPorts, args->useSharedMemory);
+        }
         network = networkPtr.get();
+        network->setLinkShaper(args->linkShaper);
         synchronizer.reset(new NnNetworkNodeSynchronizer(network, &execution, &net.netConfig, rootNodeConfig));
 
         NnRootConfigWriter configWriter(network);
         configWriter.writeToWorkers(&net.netConfig, net.nodeConfigs);
     }
 
+    // Mapped weights are used by the executor, so the file is unmapped after the executor is released
+    std::unique_ptr<MmapFile, void(*)(MmapFile *)> weightFilePtr(nullptr, unmapLlmNetWeight);
+
     NnCpuDevice cpu(&net.netConfig, rootNodeConfig, &execution);
+    if (args->pinThreads != nullptr) {
+        std::vector<NnSize> cores = resolveThreadCores(args->pinThreads, args->nThreads);
+        cpu.pinThreads(cores);
+    }
     NnExecutor executor(&net.netConfig, rootNodeConfig, &cpu, &execution, synchronizer.get());
+    executor.setSpinTime(args->spinTime);
+    if (args->tracePath != nullptr)
+        executor.startTrace(args->tracePath);
 
     NnRootWeightLoader weightLoader(&executor, network, nNodes);
-    loadLlmNetWeight(args->modelPath, &net, &weightLoader);
+    if (args->mmapWeights)
+        weightFilePtr.reset(mapLlmNetWeight(args->modelPath, &net, &weightLoader));
+    else
+        loadLlmNetWeight(args->modelPath, &net, &weightLoader);
 
     RootLlmInference inference(&net, &cpu, &execution, &executor, network);
 
-    if (network != nullptr)
+    if (network != nullptr) {
+        if (args->netWaitType == NET_WAIT_POLL) {
+            // Waits go through poll() only for non-blocking sockets
+            network->setTurbo(true);
+            network->setWaitType(NET_WAIT_POLL);
+        }
         network->resetStats();
+    }
 
     AppInferenceContext context;
     context.args = args;
@@ -253,69 +449,166 @@ void runInferenceApp(AppCliArgs *args, void (*handler)(AppInferenceContext *cont
     context.sampler = &sampler;
     context.tokenizer = &tokenizer;
     context.network = network;
+    context.executor = &executor;
 
     handler(&context);
 
     inference.finish();
 }
 
-void runWorkerApp(AppCliArgs *args) {
-    while (true) {
-        std::unique_ptr<NnNetwork> networkPtr = NnNetwork::serve(args->port);
-        NnNetwork *network = networkPtr.get();
+// Everything a worker builds from the configs of the root, it is kept between root connections
+class WorkerNode {
+public:
+    NnNetConfig netConfig;
+    NnNodeConfig nodeConfig;
+    std::uint64_t configFingerprint;
+    std::uint64_t modelFingerprint; // 0 until the weights are loaded
+    bool isPoisoned; // a forward was interrupted, the pipes and the KV cache are in an unknown state
+    std::unique_ptr<NnNetExecution> execution;
+    std::unique_ptr<NnNetworkNodeSynchronizer> synchronizer;
+    std::unique_ptr<NnCpuDevice> cpu;
+    std::unique_ptr<NnExecutor> executor;
+    std::unique_ptr<NnWorkerWeightReader> weightReader;
+
+    // Workers of a loopback cluster share the process with the root, so they do not pin threads or trace
+    WorkerNode(AppCliArgs *args, NnNetwork *network, NnNetConfig *netConfig, NnNodeConfig *nodeConfig, std::uint64_t configFingerprint, bool isInProcess)
+        : netConfig(*netConfig), nodeConfig(*nodeConfig), configFingerprint(configFingerprint), modelFingerprint(0), isPoisoned(false)
+    {
+        execution.reset(new NnNetExecution(args->nThreads, &this->netConfig));
+        synchronizer.reset(new NnNetworkNodeSynchronizer(network, execution.get(), &this->netConfig, &this->nodeConfig));
+        cpu.reset(new NnCpuDevice(&this->netConfig, &this->nodeConfig, execution.get()));
+        if (args->pinThreads != nullptr && !isInProcess) {
+            std::vector<NnSize> cores = resolveThreadCores(args->pinThreads, args->nThreads);
+            cpu->pinThreads(cores);
+        }
+        executor.reset(new NnExecutor(&this->netConfig, &this->nodeConfig, cpu.get(), execution.get(), synchronizer.get()));
+        executor->setSpinTime(args->spinTime);
+        if (args->tracePath != nullptr && !isInProcess)
+            executor->startTrace(args->tracePath);
+
+        weightReader.reset(new NnWorkerWeightReader(executor.get(), network));
+        if (args->shardPath != nullptr && !isInProcess)
+            weightReader->setShardPath(args->shardPath);
+    }
 
-        NnWorkerConfigReader configReader(network);
-        NnNetConfig netConfig = configReader.readNet();
-        NnNodeConfig nodeConfig = configReader.readNode();
+    ~WorkerNode() {
+        // Weights may point into the shard of the reader, and all of it points into the configs
+        executor.reset();
+        cpu.reset();
+        weightReader.reset();
+        synchronizer.reset();
+        execution.reset();
+        releaseNetConfig(&netConfig);
+        releaseNodeConfig(&nodeConfig);
+    }
+};
+
+static void runWorker(AppCliArgs *args, NnNetwork *network, bool isInProcess, std::unique_ptr<WorkerNode> *residentNode) {
+    network->setLinkShaper(args->linkShaper);
+
+    NnWorkerConfigReader configReader(network);
+    NnNetConfig netConfig = configReader.readNet();
+    NnNodeConfig nodeConfig = configReader.readNode();
+    std::uint64_t configFingerprint = getConfigFingerprint(&netConfig, &nodeConfig);
+    std::uint64_t modelFingerprint = NnWorkerWeightReader::readFingerprint(network);
+
+    // A root restarted with the same model and node layout gets the node of the previous connection
+    WorkerNode *node = residentNode->get();
+    if (node != nullptr && !node->isPoisoned && modelFingerprint != 0 &&
+        node->modelFingerprint == modelFingerprint && node->configFingerprint == configFingerprint) {
+        releaseNetConfig(&netConfig);
+        releaseNodeConfig(&nodeConfig);
+        node->synchronizer->setNetwork(network);
+        NnWorkerWeightReader::keepWeights(network);
+        printf("💿 Weights are resident, skipped loading\n");
+    } else {
+        // The previous node is released first, so the memory of both nodes is never needed at once
+        residentNode->reset();
         std::unique_ptr<NnNetConfig, void(*)(NnNetConfig *)> netConfigPtr(&netConfig, releaseNetConfig);
         std::unique_ptr<NnNodeConfig, void(*)(NnNodeConfig *)> nodeConfigPtr(&nodeConfig, releaseNodeConfig);
-
         printNodeRequiredMemory(&netConfig, &nodeConfig);
+        node = new WorkerNode(args, network, &netConfig, &nodeConfig, configFingerprint, isInProcess);
+        netConfigPtr.release();
+        nodeConfigPtr.release();
+        residentNode->reset(node);
 
-        NnNetExecution execution(args->nThreads, &netConfig);
-
-        NnNetworkNodeSynchronizer synchronizer(network, &execution, &netConfig, &nodeConfig);
-        NnCpuDevice cpu(&netConfig, &nodeConfig, &execution);
-        NnExecutor executor(&netConfig, &nodeConfig, &cpu, &execution, &synchronizer);
-
-        NnWorkerWeightReader weightReader(&executor, network);
-        weightReader.read();
-
-        WorkerLlmInference inference(&execution, network);
-        bool isFirstAttempt = true;
-        bool isTurboEnabled = false;
-        clock_t startTime;
-        while (true) {
-            try {
-                if (isFirstAttempt)
-                    startTime = clock();
-
-                if (!inference.tryReadControlPacket()) {
-                    if (isTurboEnabled && !isFirstAttempt && clock() - startTime > CLOCKS_PER_SEC) {
-                        network->setTurbo(false);
-                        isTurboEnabled = false;
-                        printf("🚁 Network is in blocking mode\n");
-                    }
-                    isFirstAttempt = false;
-                    continue;
-                }
-                if (inference.isFinished)
-                    break;
+        node->weightReader->read(modelFingerprint);
+        node->modelFingerprint = modelFingerprint;
+    }
+    network->setWaitType(args->netWaitType);
 
-                if (!isTurboEnabled) {
-                    network->setTurbo(true);
-                    isTurboEnabled = true;
-                    printf("🚁 Network is in non-blocking mode\n");
+    NnExecutor *executor = node->executor.get();
+    WorkerLlmInference inference(node->execution.get(), network);
+    bool isFirstAttempt = true;
+    bool isTurboEnabled = false;
+    clock_t startTime;
+    while (true) {
+        try {
+            if (isFirstAttempt)
+                startTime = clock();
+
+            if (!inference.tryReadControlPacket()) {
+                if (isTurboEnabled && !isFirstAttempt && clock() - startTime > CLOCKS_PER_SEC) {
+                    network->setTurbo(false);
+                    isTurboEnabled = false;
+                    printf("🚁 Network is in blocking mode\n");
                 }
-                executor.forward();
-                isFirstAttempt = true;
-            } catch (const NnReadNetworkException &e) {
-                printf("Read network exception: %s\n", e.message);
-                break;
-            } catch (const NnWriteNetworkException &e) {
-                printf("Write network exception: %s\n", e.message);
+                isFirstAttempt = false;
+                continue;
+            }
+            if (inference.isFinished)
                 break;
+
+            if (!isTurboEnabled) {
+                network->setTurbo(true);
+                isTurboEnabled = true;
+                printf("🚁 Network is in non-blocking mode\n");
+            }
+            try {
+                executor->forward();
+            } catch (...) {
+                node->isPoisoned = true;
+                throw;
             }
+            isFirstAttempt = true;
+        } catch (const NnReadNetworkException &e) {
+            printf("Read network exception: %s\n", e.message);
+            break;
+        } catch (const NnWriteNetworkException &e) {
+            printf("Write network exception: %s\n", e.message);
+            break;
         }
     }
 }
+
+void runWorkerApp(AppCliArgs *args) {
+    std::unique_ptr<WorkerNode> residentNode(nullptr);
+    while (true) {
+        std::unique_ptr<NnNetwork> networkPtr = NnNetwork::serve(args->port, args->useSharedMemory);
+        runWorker(args, networkPtr.get(), false, &residentNode);
+    }
+}
+
+void runShardApp(AppCliArgs *args) {
+    if (args->modelPath == nullptr || args->shardPath == nullptr || args->nShardNodes < 2)
+        throw std::runtime_error("The shard mode requires --model, --shard and --nodes (at least 2)");
+
+    LlmHeader header = loadLlmHeader(args->modelPath, args->maxSeqLen, args->syncType, args->kvCacheType);
+    LlmNetOptions netOptions;
+    netOptions.ringAllReduce = args->ringAllReduce;
+    netOptions.treeBroadcast = args->treeBroadcast;
+    netOptions.localEmbedding = args->localEmbedding;
+    netOptions.pipeline = args->pipeline;
+    std::vector<float> nodeWeights;
+    if (args->nodeWeights != nullptr)
+        nodeWeights = parseNodeWeights(args->nodeWeights, args->nShardNodes);
+    netOptions.nodeWeights = nodeWeights.empty() ? nullptr : nodeWeights.data();
+    LlmNet net = buildLlmNet(&header, args->nShardNodes, args->nBatches, &netOptions);
+    std::unique_ptr<LlmNet, void(*)(LlmNet *)> netPtr(&net, releaseLlmNet);
+    printLlmHeader(&header);
+
+    // The worker slices are split the same way as at startup, but written to files
+    NnRootWeightLoader weightLoader(nullptr, nullptr, args->nShardNodes);
+    weightLoader.enableShardOutput(args->shardPath, &net.netConfig, net.nodeConfigs);
+    loadLlmNetWeight(args->modelPath, &net, &weightLoader);
+}
@@ -12,6 +12,10 @@ public:
     char *mode;
     NnSize nThreads;
     NnSize nBatches;
+    NnSize spinTime;
+    char *tracePath;
+    char *pinThreads;
+    bool mmapWeights;
     bool help;
 
     // inference
@@ -19,6 +23,16 @@ public:
     char *tokenizerPath;
     char *prompt;
     NnFloatType syncType;
+    NnFloatType kvCacheType;
+    bool ringAllReduce;
+    bool treeBroadcast;
+    bool localEmbedding;
+    bool pipeline;
+    char *nodeWeights;
+    NnNetworkWaitType netWaitType;
+    bool useSharedMemory;
+    NnSize nLoopbackNodes;
+    NnLinkShaper linkShaper;
     NnSize nWorkers;
     char **workerHosts;
     NnSize *workerPorts;
@@ -32,6 +46,10 @@ public:
 
     // worker
     NnSize port;
+    char *shardPath; // shard file of the worker, or the prefix of the written shards
+
+    // shard
+    NnSize nShardNodes;
 
     static AppCliArgs parse(int argc, char **argv, bool hasMode);
     ~AppCliArgs();
@@ -50,6 +68,8 @@ public:
 typedef struct {
     NnSize position;
     NnSize batchSize; // 0 = stop signal
+    NnSize logitsBatchSize;
+    NnSize nTokens; // number of token ids that follow the packet
 } LlmControlPacket;
 
 class RootLlmInference {
@@ -64,9 +84,13 @@ private:
     NnExecutor *executor;
     NnNetwork *network;
     LlmControlPacket controlPacket;
+    bool sendsTokens;
+    std::vector<NnByte> controlBuffer;
 public:
     RootLlmInference(LlmNet *net, NnDevice *device, NnNetExecution *execution, NnExecutor *executor, NnNetwork *network);
     void setBatchSize(NnSize batchSize);
+    // Only the first logitsBatchSize rows of the logits pipe are computed, setBatchSize resets it to all rows
+    void setLogitsBatchSize(NnSize logitsBatchSize);
     void setPosition(NnSize position);
     void setToken(NnSize batchIndex, NnSize token);
     void forward();
@@ -78,6 +102,7 @@ public:
     bool isFinished;
 private:
     float *positionPipe;
+    float *tokenPipe;
     NnNetExecution *execution;
     NnNetwork *network;
     LlmControlPacket controlPacket;
@@ -93,9 +118,11 @@ typedef struct {
     Tokenizer *tokenizer;
     Sampler *sampler;
     NnNetwork *network;
+    NnExecutor *executor;
 } AppInferenceContext;
 
 void runInferenceApp(AppCliArgs *args, void (*handler)(AppInferenceContext *context));
 void runWorkerApp(AppCliArgs *args);
+void runShardApp(AppCliArgs *args);
 
 #endif
@@ -387,6 +387,7 @@ public:
                 : args->nBatches;
 
             inference->setBatchSize(batchSize);
+            inference->setLogitsBatchSize(0);
             inference->setPosition(pos);
             for (NnSize j = 0; j < batchSize; j++)
                 inference->setToken(j, promptTokens[i + j]);
@@ -547,6 +548,20 @@ void usage() {
     fprintf(stderr, "        [--weights-float-type {f32|f16|q40|q80}]\n");
     fprintf(stderr, "        [--max-seq-len <max>]\n");
     fprintf(stderr, "        [--nthreads <n>]\n");
+    fprintf(stderr, "        [--spin-time <us>]\n");
+    fprintf(stderr, "        [--net-wait <spin|poll>]\n");
+    fprintf(stderr, "        [--shared-memory <0|1>]\n");
+    fprintf(stderr, "        [--link <100mb|1gb|10gb|none>]\n");
+    fprintf(stderr, "        [--loopback-nodes <n>]\n");
+    fprintf(stderr, "        [--trace <path>]\n");
+    fprintf(stderr, "        [--pin-threads <auto|cpu list>]\n");
+    fprintf(stderr, "        [--mmap-weights <0|1>]\n");
+    fprintf(stderr, "        [--kv-cache-type <f32|f16|q80>]\n");
+    fprintf(stderr, "        [--all-reduce <mesh|ring>]\n");
+    fprintf(stderr, "        [--broadcast <direct|tree>]\n");
+    fprintf(stderr, "        [--local-embedding <0|1>]\n");
+    fprintf(stderr, "        [--parallelism <tensor|pipeline>]\n");
+    fprintf(stderr, "        [--node-weights <w0,w1,...>]\n");
     fprintf(stderr, "        [--workers <ip:port> ...]\n");
     fprintf(stderr, "        [--temperature <temp>]\n");
     fprintf(stderr, "        [--topp <t>]\n");
@@ -7,6 +7,20 @@
 #include "app.hpp"
 #include <stdexcept>
 
+static std::vector<unsigned long> getNetWaitTimes(AppInferenceContext *context) {
+    std::vector<unsigned long> waitTimes;
+    if (context->network != nullptr && context->args->netWaitType == NET_WAIT_POLL) {
+        waitTimes.resize(context->network->nSockets);
+        context->network->getWaitStats(waitTimes.data());
+    }
+    return waitTimes;
+}
+
+static void printNetWaitTimes(std::vector<unsigned long> &waitTimes) {
+    for (NnSize i = 0; i < waitTimes.size(); i++)
+        printf("   netWait: %lu ms (socket %u)\n", waitTimes[i] / 1000, i);
+}
+
 static void inference(AppInferenceContext *context) {
     if (context->args->prompt == nullptr)
         throw std::runtime_error("Prompt is required");
@@ -40,6 +54,7 @@ static void inference(AppInferenceContext *context) {
             : context->args->nBatches;
 
         context->inference->setBatchSize(batchSize);
+        context->inference->setLogitsBatchSize(0);
         context->inference->setPosition(pos);
         for (NnSize i = 0; i < batchSize; i++)
             context->inference->setToken(i, inputTokens[pos + i]);
@@ -58,6 +73,9 @@ static void inference(AppInferenceContext *context) {
             batchSize);
     }
     NnSize evalTime = evalTimer.elapsed();
+    unsigned long evalSpinTime, evalSleepTime;
+    context->executor->getBarrierStats(&evalSpinTime, &evalSleepTime);
+    std::vector<unsigned long> evalNetWaitTimes = getNetWaitTimes(context);
 
     fflush(stdout);
 
@@ -87,6 +105,9 @@ static void inference(AppInferenceContext *context) {
         fflush(stdout);
     }
     NnSize predTime = predTimer.elapsed();
+    unsigned long predSpinTime, predSleepTime;
+    context->executor->getBarrierStats(&predSpinTime, &predSleepTime);
+    std::vector<unsigned long> predNetWaitTimes = getNetWaitTimes(context);
 
     NnSize nEvalTokens = nInputTokens - 1;
     NnSize nPredTokens = pos - nEvalTokens;
@@ -97,11 +118,17 @@ static void inference(AppInferenceContext *context) {
     printf("   tokens/s: %3.2f (%3.2f ms/tok)\n",
         nEvalTokens / (evalTime / 1000.0),
         evalTime / ((float) nEvalTokens));
+    printf("   spinTime: %lu ms\n", evalSpinTime / 1000);
+    printf("  sleepTime: %lu ms\n", evalSleepTime / 1000);
+    printNetWaitTimes(evalNetWaitTimes);
     printf("Prediction\n");
     printf("    nTokens: %d\n", nPredTokens);
     printf("   tokens/s: %3.2f (%3.2f ms/tok)\n",
         nPredTokens / (predTime / 1000.0),
         predTime / ((float) nPredTokens));
+    printf("   spinTime: %lu ms\n", predSpinTime / 1000);
+    printf("  sleepTime: %lu ms\n", predSleepTime / 1000);
+    printNetWaitTimes(predNetWaitTimes);
 }
 
 static size_t readStdin(const char *guide, char *buffer, size_t size) {
@@ -159,6 +186,7 @@ static void chat(AppInferenceContext *context) {
                 : context->args->nBatches;
 
             context->inference->setBatchSize(batchSize);
+            context->inference->setLogitsBatchSize(0);
             context->inference->setPosition(pos);
             for (NnSize j = 0; j < batchSize; j++)
                 context->inference->setToken(j, inputTokens[i + j]);
@@ -217,6 +245,8 @@ int main(int argc, char **argv) {
             runInferenceApp(&args, &chat);
         else if (std::strcmp(args.mode, "worker") == 0)
             runWorkerApp(&args);
+        else if (std::strcmp(args.mode, "shard") == 0)
+            runShardApp(&args);
         else
             throw std::runtime_error("Unsupported mode");
     } catch (std::exception &e) {
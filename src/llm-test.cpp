@@ -0,0 +1,126 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+#include "llm.hpp"
+
+#define N_HEADS 8
+#define N_KV_HEADS 2
+#define HEAD_SIZE 64
+
+void printOk(const char *name) {
+    printf("✅ %24s passed\n", name);
+}
+
+void fail(const char *name, NnSize nodeIndex, const char *reason) {
+    printf("❌ %24s failed, node %u: %s\n", name, nodeIndex, reason);
+    exit(1);
+}
+
+LlmHeader buildHeader() {
+    LlmHeader header;
+    std::memset(&header, 0, sizeof(LlmHeader));
+    header.archType = LLAMA;
+    header.dim = N_HEADS * HEAD_SIZE;
+    header.nLayers = 1;
+    header.nHeads = N_HEADS;
+    header.headSize = HEAD_SIZE;
+    header.nKvHeads = N_KV_HEADS;
+    header.origSeqLen = 64;
+    header.seqLen = 64;
+    header.hiddenDim = 1024;
+    header.hiddenAct = HIDDEN_ACT_SILU;
+    header.kvDim = N_KV_HEADS * HEAD_SIZE;
+    header.vocabSize = 256;
+    header.ropeTheta = 10000.0f;
+    header.ropeType = ROPE_LLAMA;
+    header.normEpsilon = 1e-5f;
+    header.weightType = F_32;
+    header.syncType = F_32;
+    header.kvCacheType = F_32;
+    return header;
+}
+
+const NnMultiHeadAttOpConfig *findMultiHeadAtt(NnNodeConfig *nodeConfig) {
+    for (NnSize segmentIndex = 0; segmentIndex < nodeConfig->nSegments; segmentIndex++) {
+        NnSegmentConfig *segment = &nodeConfig->segments[segmentIndex];
+        for (NnSize opIndex = 0; opIndex < segment->nOps; opIndex++) {
+            if (segment->ops[opIndex].code == OP_MULTIHEAD_ATT)
+                return (NnMultiHeadAttOpConfig *)segment->ops[opIndex].config;
+        }
+    }
+    return nullptr;
+}
+
+void testKvHeadSlices(const char *name, const NnSize nNodes) {
+    LlmHeader header = buildHeader();
+    LlmNetOptions options = { false, false, false, false, nullptr };
+    LlmNet net = buildLlmNet(&header, nNodes, 1, &options);
+
+    const NnSize kvMul = N_HEADS / N_KV_HEADS;
+    const NnSize nKvReplicas = nNodes > N_KV_HEADS ? nNodes / N_KV_HEADS : 1;
+    NnSize nextHead = 0;
+    for (NnSize nodeIndex = 0; nodeIndex < nNodes; nodeIndex++) {
+        const NnRowMatmulSlice *q = &net.qSlices[nodeIndex];
+        const NnRowMatmulSlice *k = &net.kSlices[nodeIndex];
+        const NnRowMatmulSlice *v = &net.vSlices[nodeIndex];
+        const NnSize headStart = q->dStart / HEAD_SIZE;
+        const NnSize nHeads0 = q->d0 / HEAD_SIZE;
+        const NnSize kvHeadStart = k->dStart / HEAD_SIZE;
+
+        // The query heads cover all heads once, in order
+        if (headStart != nextHead || nHeads0 == 0)
+            fail(name, nodeIndex, "wrong query heads");
+        nextHead = headStart + nHeads0;
+        if (nKvReplicas > 1) {
+            if (nHeads0 != N_HEADS / nNodes)
+                fail(name, nodeIndex, "query heads are not split evenly");
+            if (kvHeadStart != nodeIndex / nKvReplicas || k->d0 != HEAD_SIZE)
+                fail(name, nodeIndex, "wrong kv slice");
+        }
+        if (v->dStart != k->dStart || v->d0 != k->d0)
+            fail(name, nodeIndex, "the key and value slices differ");
+        if (net.woSlices[nodeIndex].nStart != q->dStart || net.woSlices[nodeIndex].n0 != q->d0)
+            fail(name, nodeIndex, "the wo slice does not follow the query heads");
+
+        // The attention maps a local query head h to the local kv head h / kvMul
+        for (NnSize h = 0; h < nHeads0; h++) {
+            if ((headStart + h) / kvMul != kvHeadStart + h / kvMul)
+                fail(name, nodeIndex, "a query head is attended with a foreign kv head");
+        }
+
+        const NnMultiHeadAttOpConfig *att = findMultiHeadAtt(&net.nodeConfigs[nodeIndex]);
+        if (att == nullptr)
+            fail(name, nodeIndex, "no attention op");
+        if (att->multiHeadAttSlice.nHeads0 != nHeads0 || att->kvCacheSlice.kvDim0 != k->d0)
+            fail(name, nodeIndex, "the attention op does not match the slices");
+    }
+    if (nextHead != N_HEADS)
+        fail(name, nNodes - 1, "not all query heads are sliced");
+
+    releaseLlmNet(&net);
+    printOk(name);
+}
+
+void testKvHeadSlicesUneven() {
+    LlmHeader header = buildHeader();
+    LlmNetOptions options = { false, false, false, false, nullptr };
+    try {
+        LlmNet net = buildLlmNet(&header, 3, 1, &options);
+        releaseLlmNet(&net);
+    } catch (const std::invalid_argument &) {
+        printOk("kvHeadSlicesUneven");
+        return;
+    }
+    fail("kvHeadSlicesUneven", 0, "3 nodes accepted for 2 kv heads");
+}
+
+int main() {
+    initQuants();
+
+    testKvHeadSlices("kvHeadSlices_2", 2);
+    testKvHeadSlices("kvHeadSlicesReplicated_4", 4);
+    testKvHeadSlices("kvHeadSlicesReplicated_8", 8);
+    testKvHeadSlicesUneven();
+    return 0;
+}
@@ -4,7 +4,9 @@
 #include "nn/nn-network.hpp"
 #include "mmap.hpp"
 #include "llm.hpp"
+#include <algorithm>
 #include <stdexcept>
+#include <vector>
 
 static const char *hiddenActToString(LlmHiddenAct act) {
     if (act == HIDDEN_ACT_GELU) return "Gelu";
@@ -23,7 +25,7 @@ static const char *archTypeToString(LlmArchType type) {
     throw std::runtime_error("Unsupported architecture");
 }
 
-LlmHeader loadLlmHeader(const char *path, const NnSize maxSeqLen, NnFloatType syncType) {
+LlmHeader loadLlmHeader(const char *path, const NnSize maxSeqLen, NnFloatType syncType, NnFloatType kvCacheType) {
     LlmHeader header;
     std::memset(&header, 0, sizeof(LlmHeader));
     header.weightType = F_UNK;
@@ -93,6 +95,7 @@ LlmHeader loadLlmHeader(const char *path, const NnSize maxSeqLen, NnFloatType sy
     header.headSize = header.dim / header.nHeads;
     header.kvDim = (header.dim  *header.nKvHeads) / header.nHeads;
     header.syncType = syncType;
+    header.kvCacheType = kvCacheType;
     header.fileSize = (size_t)seekToEnd(fd);
     return header;
 }
@@ -111,6 +114,7 @@ void printLlmHeader(LlmHeader *header) {
     }
     printf("💡 SeqLen: %u\n", header->seqLen);
     printf("💡 NormEpsilon: %f\n", header->normEpsilon);
+    printf("💡 KvCacheType: %s\n", floatTypeToString(header->kvCacheType));
     printf("💡 RopeType: %s\n", ropeTypeToString(header->ropeType));
     printf("💡 RopeTheta: %.0f\n", header->ropeTheta);
     if (header->ropeType == ROPE_LLAMA3_1) {
@@ -122,38 +126,139 @@ void printLlmHeader(LlmHeader *header) {
     }
 }
 
-LlmNet buildLlmNet(LlmHeader *h, NnSize nNodes, NnSize nBatches) {
+static NnSize getPipelineLayerStart(NnSize nLayers, NnSize nNodes, NnSize nodeIndex) {
+    return (nLayers * nodeIndex) / nNodes;
+}
+
+NnSize getLlmLayerNode(LlmNet *net, NnSize layerIndex) {
+    if (!net->options.pipeline)
+        return 0;
+    NnSize nNodes = net->netConfig.nNodes;
+    NnSize nodeIndex = nNodes - 1;
+    while (getPipelineLayerStart(net->header->nLayers, nNodes, nodeIndex) > layerIndex)
+        nodeIndex--;
+    return nodeIndex;
+}
+
+LlmNet buildLlmNet(LlmHeader *h, NnSize nNodes, NnSize nBatches, LlmNetOptions *options) {
     LlmNet n;
     n.tokenEmbeddingSize = size2D(F_32, h->vocabSize, h->dim);
     n.rmsNormSize = size1D(F_32, h->dim);
 
-    NnKvCacheSlice kvCacheSlice = sliceKvCache(h->kvDim, h->seqLen, nNodes);
-    NnMultiHeadAttSlice multiHeadAttSlice = sliceMultiHeadAtt(h->nHeads, h->seqLen, nNodes);
-
-    n.qSlice = sliceRowMatmul(h->weightType, nNodes, h->dim, h->dim);
-    n.kSlice = sliceRowMatmul(h->weightType, nNodes, h->dim, h->kvDim);
-    n.vSlice = sliceRowMatmul(h->weightType, nNodes, h->dim, h->kvDim);
-    n.woSlice = sliceColMatmul(h->weightType, nNodes, h->dim, h->dim);
-
-    n.w1Slice = sliceRowMatmul(h->weightType, nNodes, h->dim, h->hiddenDim);
-    n.w2Slice = sliceColMatmul(h->weightType, nNodes, h->hiddenDim, h->dim);
-    n.w3Slice = sliceRowMatmul(h->weightType, nNodes, h->dim, h->hiddenDim);
-    n.wclsSlice = sliceRowMatmul(h->weightType, nNodes, h->dim, h->vocabSize);
+    if (h->kvCacheType != F_32 && h->kvCacheType != F_16 && h->kvCacheType != F_Q80)
+        throw std::invalid_argument("Unsupported kv cache type");
+    if (h->kvCacheType == F_Q80 && h->headSize % Q80_BLOCK_SIZE != 0)
+        throw std::invalid_argument("Q80 kv cache requires the head size to be a multiple of 32");
+
+    // In the pipeline mode every node holds whole layers, so the layer ops are built as for a single node
+    const bool isPipeline = options->pipeline && nNodes > 1;
+    if (isPipeline && (options->ringAllReduce || options->treeBroadcast || options->localEmbedding))
+        throw std::invalid_argument("The pipeline mode does not support ring all-reduce, tree broadcast and local embedding");
+    if (isPipeline && nNodes > h->nLayers)
+        throw std::invalid_argument("The pipeline mode requires at most one node per layer");
+    if (isPipeline && options->nodeWeights != nullptr)
+        throw std::invalid_argument("Node weights are supported only by the tensor parallelism");
+    const NnSize nSlices = isPipeline ? 1 : nNodes;
+    const float *nodeWeights = options->nodeWeights;
+
+    // Sliced columns of the wo and w2 matrices are split in whole blocks of the weights and of the synced buffers,
+    // and in multiples of 8 for the F32 matmul
+    const NnSize colUnit = std::max(std::max(getBlockSize(h->weightType), getBlockSize(h->syncType)), (NnSize)8);
+
+    // Heads are split in whole KV groups, so the query heads of a node use only its own KV heads. With more nodes
+    // than KV heads, nodes that share a KV head compute it redundantly and split its query heads evenly.
+    const NnSize nKvReplicas = getKvHeadReplicas(h->nKvHeads, nSlices);
+    const NnSize kvMul = h->nHeads / h->nKvHeads;
+    std::vector<NnSize> kvHeadStarts(nSlices + 1);
+    std::vector<NnSize> headStarts(nSlices + 1);
+    if (nKvReplicas == 1) {
+        NnSize kvHeadUnit = 1;
+        while ((kvHeadUnit * kvMul * h->headSize) % colUnit != 0)
+            kvHeadUnit++;
+        splitNodeRanges(h->nKvHeads, kvHeadUnit, nSlices, nodeWeights, kvHeadStarts.data());
+        for (NnSize sliceIndex = 0; sliceIndex <= nSlices; sliceIndex++)
+            headStarts[sliceIndex] = kvHeadStarts[sliceIndex] * kvMul;
+    } else {
+        if (kvMul % nKvReplicas != 0)
+            throw std::invalid_argument("The query heads of a KV head must split evenly across its nodes");
+        for (NnSize sliceIndex = 0; sliceIndex <= nSlices; sliceIndex++)
+            headStarts[sliceIndex] = (h->nHeads / nSlices) * sliceIndex;
+    }
+    std::vector<NnSize> hiddenStarts(nSlices + 1);
+    std::vector<NnSize> vocabStarts(nSlices + 1);
+    splitNodeRanges(h->hiddenDim, colUnit, nSlices, nodeWeights, hiddenStarts.data());
+    splitNodeRanges(h->vocabSize, 1, nSlices, nodeWeights, vocabStarts.data());
+
+    n.qSlices = new NnRowMatmulSlice[nNodes];
+    n.kSlices = new NnRowMatmulSlice[nNodes];
+    n.vSlices = new NnRowMatmulSlice[nNodes];
+    n.woSlices = new NnColMatmulSlice[nNodes];
+    n.w1Slices = new NnRowMatmulSlice[nNodes];
+    n.w2Slices = new NnColMatmulSlice[nNodes];
+    n.w3Slices = new NnRowMatmulSlice[nNodes];
+    n.wclsSlices = new NnRowMatmulSlice[nNodes];
+    for (NnSize nodeIndex = 0; nodeIndex < nNodes; nodeIndex++) {
+        const NnSize sliceIndex = isPipeline ? 0 : nodeIndex;
+        const NnSize qDimStart = headStarts[sliceIndex] * h->headSize;
+        const NnSize qDim0 = headStarts[sliceIndex + 1] * h->headSize - qDimStart;
+        const NnSize kvDimStart = nKvReplicas == 1
+            ? kvHeadStarts[sliceIndex] * h->headSize
+            : (sliceIndex / nKvReplicas) * h->headSize;
+        const NnSize kvDim0 = nKvReplicas == 1
+            ? kvHeadStarts[sliceIndex + 1] * h->headSize - kvDimStart
+            : h->headSize;
+        const NnSize hiddenStart = hiddenStarts[sliceIndex];
+        const NnSize hidden0 = hiddenStarts[sliceIndex + 1] - hiddenStart;
+
+        n.qSlices[nodeIndex] = sliceRowMatmul(h->weightType, h->dim, h->dim, qDimStart, qDim0);
+        n.kSlices[nodeIndex] = sliceRowMatmul(h->weightType, h->dim, h->kvDim, kvDimStart, kvDim0);
+        n.vSlices[nodeIndex] = sliceRowMatmul(h->weightType, h->dim, h->kvDim, kvDimStart, kvDim0);
+        n.woSlices[nodeIndex] = sliceColMatmul(h->weightType, h->dim, h->dim, qDimStart, qDim0);
+
+        n.w1Slices[nodeIndex] = sliceRowMatmul(h->weightType, h->dim, h->hiddenDim, hiddenStart, hidden0);
+        n.w2Slices[nodeIndex] = sliceColMatmul(h->weightType, h->hiddenDim, h->dim, hiddenStart, hidden0);
+        n.w3Slices[nodeIndex] = sliceRowMatmul(h->weightType, h->dim, h->hiddenDim, hiddenStart, hidden0);
+        n.wclsSlices[nodeIndex] = sliceRowMatmul(h->weightType, h->dim, h->vocabSize,
+            vocabStarts[sliceIndex], vocabStarts[sliceIndex + 1] - vocabStarts[sliceIndex]);
+    }
 
     NnNetConfigBuilder netBuilder(nNodes, nBatches);
 
     n.positionPipeIndex = netBuilder.addPipe("POS", size2D(F_32, nBatches, 1));
     n.tokenPipeIndex = netBuilder.addPipe("TOK", size2D(F_32, nBatches, 1));
     n.xPipeIndex = netBuilder.addPipe("X", size2D(F_32, nBatches, h->dim));
-    n.logitsPipeIndex = netBuilder.addPipe("LG", size2D(F_32, nBatches, h->vocabSize));
-    const NnSize zqPipeIndex = netBuilder.addPipe("ZQ", size2D(h->syncType, nBatches, h->dim * nNodes));
+    n.logitsPipeIndex = isPipeline
+        ? netBuilder.addPipe("LG", size2D(F_32, nBatches, h->vocabSize))
+        : netBuilder.addSlicedPipe("LG", size2D(F_32, nBatches, h->vocabSize), vocabStarts.data());
+    // With the ring all-reduce the ZQ pipe holds the summed output, otherwise it holds one partial output per node.
+    // Stages of the pipeline mode do not sync block outputs, the output stays in the y buffer.
+    const NnSize zqPipeIndex = isPipeline
+        ? 0
+        : netBuilder.addPipe("ZQ", size2D(h->syncType, nBatches, options->ringAllReduce ? h->dim : h->dim * nNodes));
+    const NnSyncType zqSyncType = options->ringAllReduce ? SYNC_RING_ALL_REDUCE : SYNC_NODE_SLICES;
 
     n.header = h;
+    n.options = *options;
     n.netConfig = netBuilder.build();
     n.nodeConfigs = new NnNodeConfig[nNodes];
 
     for (NnSize nodeIndex = 0; nodeIndex < nNodes; nodeIndex++) {
-        NnRopeSlice ropeSlice = sliceRope(h->dim, h->kvDim, h->nKvHeads, nNodes, h->seqLen, h->headSize, h->ropeTheta, nodeIndex);
+        const NnRowMatmulSlice *qSlice = &n.qSlices[nodeIndex];
+        const NnRowMatmulSlice *kSlice = &n.kSlices[nodeIndex];
+        const NnRowMatmulSlice *vSlice = &n.vSlices[nodeIndex];
+        const NnColMatmulSlice *woSlice = &n.woSlices[nodeIndex];
+        const NnRowMatmulSlice *w1Slice = &n.w1Slices[nodeIndex];
+        const NnColMatmulSlice *w2Slice = &n.w2Slices[nodeIndex];
+        const NnRowMatmulSlice *w3Slice = &n.w3Slices[nodeIndex];
+        const NnRowMatmulSlice *wclsSlice = &n.wclsSlices[nodeIndex];
+        const NnSize layerStart = isPipeline ? getPipelineLayerStart(h->nLayers, nNodes, nodeIndex) : 0;
+        const NnSize layerEnd = isPipeline ? getPipelineLayerStart(h->nLayers, nNodes, nodeIndex + 1) : h->nLayers;
+        const bool isLastStage = !isPipeline || nodeIndex == nNodes - 1;
+
+        NnRopeSlice ropeSlice = sliceRope(h->dim, h->kvDim, h->nKvHeads, h->seqLen, h->headSize, h->ropeTheta,
+            qSlice->dStart, qSlice->d0, kSlice->dStart, kSlice->d0);
+        NnKvCacheSlice kvCacheSlice = sliceKvCache(h->kvCacheType, h->seqLen, kSlice->d0);
+        NnMultiHeadAttSlice multiHeadAttSlice = sliceMultiHeadAtt(h->nHeads, h->seqLen, h->headSize, qSlice->d0 / h->headSize);
         NnNodeConfigBuilder nodeBuilder(nodeIndex);
 
         const NnSize xBufferIndex = nodeBuilder.addBuffer("x", size2D(F_32, nBatches, h->dim));
@@ -162,24 +267,30 @@ LlmNet buildLlmNet(LlmHeader *h, NnSize nNodes, NnSize nBatches) {
         const NnSize yqBufferIndex = h->syncType == F_32
             ? yBufferIndex
             : nodeBuilder.addBuffer("yq", size2D(h->syncType, nBatches, h->dim));
-        const NnSize yqSliceIndex = nodeBuilder.addBuffer("yq_slice", size2D(h->syncType, nBatches, h->dim / nNodes));
+        // The attention output of the heads of this node
+        const NnSize zBufferIndex = nodeBuilder.addBuffer("z", size2D(F_32, nBatches, qSlice->d0));
+        const NnSize yqSliceIndex = nodeBuilder.addBuffer("yq_slice", size2D(h->syncType, nBatches, qSlice->d0));
 
-        const NnSize qBufferIndex = nodeBuilder.addBuffer("q", size2D(F_32, nBatches, n.qSlice.d0));
-        const NnSize kTempBufferIndex = nodeBuilder.addBuffer("k_temp", size2D(F_32, nBatches, n.kSlice.d0));
-        const NnSize vTempBufferIndex = nodeBuilder.addBuffer("v_temp", size2D(F_32, nBatches, n.vSlice.d0));
+        const NnSize qBufferIndex = nodeBuilder.addBuffer("q", size2D(F_32, nBatches, qSlice->d0));
+        const NnSize kTempBufferIndex = nodeBuilder.addBuffer("k_temp", size2D(F_32, nBatches, kSlice->d0));
+        const NnSize vTempBufferIndex = nodeBuilder.addBuffer("v_temp", size2D(F_32, nBatches, vSlice->d0));
 
-        const NnSize dBufferIndex = nodeBuilder.addBuffer("d", size2D(F_32, nBatches, n.w1Slice.d0));
+        const NnSize dBufferIndex = nodeBuilder.addBuffer("d", size2D(F_32, nBatches, w1Slice->d0));
         const NnSize dqBufferIndex = h->syncType == F_32
             ? dBufferIndex
-            : nodeBuilder.addBuffer("d", size2D(h->syncType, nBatches, n.w1Slice.d0));
-        const NnSize lBufferIndex = nodeBuilder.addBuffer("l", size2D(F_32, nBatches, n.w3Slice.d0));
+            : nodeBuilder.addBuffer("d", size2D(h->syncType, nBatches, w1Slice->d0));
+        const NnSize lBufferIndex = nodeBuilder.addBuffer("l", size2D(F_32, nBatches, w3Slice->d0));
         const NnSize invRmsBufferIndex = nodeBuilder.addBuffer("inv_rms", size2D(F_32, nBatches, 1));
         const NnSize ropeCacheBufferIndex = nodeBuilder.addBuffer("rope_cache", ropeSlice.cacheSize);
         const NnSize attBufferIndex = nodeBuilder.addBuffer("att", multiHeadAttSlice.attSize);
-        const NnSize logitsSliceBufferIndex = nodeBuilder.addBuffer("lg", size2D(F_32, nBatches, h->vocabSize / nNodes));
+        const NnSize logitsSliceBufferIndex = nodeBuilder.addBuffer("lg", size2D(F_32, nBatches, wclsSlice->d0));
+
+        const NnPointerConfig blockOutputPointer = isPipeline
+            ? pointerConfig(PNTR_BUFFER, yBufferIndex)
+            : pointerConfig(PNTR_PIPE, zqPipeIndex);
 
         NnSegmentConfigBuilder start;
-        if (nodeIndex == 0) {
+        if (nodeIndex == 0 || options->localEmbedding) {
             start.addOp(
                 OP_EMBEDDING, "embedding", 0,
                 pointerConfig(PNTR_PIPE, n.tokenPipeIndex),
@@ -187,11 +298,16 @@ LlmNet buildLlmNet(LlmHeader *h, NnSize nNodes, NnSize nBatches) {
                 n.tokenEmbeddingSize,
                 NnEmbeddingOpConfig{});
         }
-        start.addSync(n.xPipeIndex, SYNC_WITH_ROOT);
+        if (isPipeline) {
+            if (nodeIndex != 0)
+                start.addSync(n.xPipeIndex, SYNC_PIPELINE_RECV);
+        } else if (!options->localEmbedding) {
+            start.addSync(n.xPipeIndex, options->treeBroadcast ? SYNC_TREE_FROM_ROOT : SYNC_WITH_ROOT);
+        }
         start.setSyncPointers(true);
         nodeBuilder.addSegment(start.build());
 
-        for (NnSize layerIndex = 0; layerIndex < h->nLayers; layerIndex++) {
+        for (NnSize layerIndex = layerStart; layerIndex < layerEnd; layerIndex++) {
             const NnSize kBufferIndex = nodeBuilder.addBuffer("k", kvCacheSlice.keySize);
             const NnSize vBufferIndex = nodeBuilder.addBuffer("v", kvCacheSlice.valueSize);
 
@@ -199,7 +315,7 @@ LlmNet buildLlmNet(LlmHeader *h, NnSize nNodes, NnSize nBatches) {
             NnSegmentConfigBuilder ff;
 
             // att
-            if (layerIndex == 0) {
+            if (layerIndex == layerStart) {
                 att.addOp(
                     OP_CAST, "block_cast_x", layerIndex,
                     pointerConfig(PNTR_PIPE, n.xPipeIndex),
@@ -209,7 +325,7 @@ LlmNet buildLlmNet(LlmHeader *h, NnSize nNodes, NnSize nBatches) {
             } else {
                 att.addOp(
                     OP_MERGE_ADD, "block_merge_add", layerIndex,
-                    pointerConfig(PNTR_PIPE, zqPipeIndex),
+                    blockOutputPointer,
                     pointerConfig(PNTR_BUFFER, xBufferIndex),
                     size0(),
                     NnMergeAddOpCodeConfig{});
@@ -239,19 +355,19 @@ LlmNet buildLlmNet(LlmHeader *h, NnSize nNodes, NnSize nBatches) {
                 OP_MATMUL, "block_matmul_q", layerIndex,
                 pointerConfig(PNTR_BUFFER, yqBufferIndex),
                 pointerConfig(PNTR_BUFFER, qBufferIndex),
-                size2D(h->weightType, n.qSlice.n, n.qSlice.d0),
+                size2D(h->weightType, qSlice->n, qSlice->d0),
                 NnMatmulOpConfig{});
             att.addOp(
                 OP_MATMUL, "block_matmul_k", layerIndex,
                 pointerConfig(PNTR_BUFFER, yqBufferIndex),
                 pointerConfig(PNTR_BUFFER, kTempBufferIndex),
-                size2D(h->weightType, n.kSlice.n, n.kSlice.d0),
+                size2D(h->weightType, kSlice->n, kSlice->d0),
                 NnMatmulOpConfig{});
             att.addOp(
                 OP_MATMUL, "block_matmul_v", layerIndex,
                 pointerConfig(PNTR_BUFFER, yqBufferIndex),
                 pointerConfig(PNTR_BUFFER, vTempBufferIndex),
-                size2D(h->weightType, n.vSlice.n, n.vSlice.d0),
+                size2D(h->weightType, vSlice->n, vSlice->d0),
                 NnMatmulOpConfig{});
 
             att.addOp(
@@ -284,16 +400,25 @@ LlmNet buildLlmNet(LlmHeader *h, NnSize nNodes, NnSize nBatches) {
                 NnCastOpCodeConfig{});
             att.addOp(
                 OP_MULTIHEAD_ATT, "block_multihead_att", layerIndex,
-                slicedPointerConfig(PNTR_BUFFER, yBufferIndex),
-                slicedPointerConfig(PNTR_BUFFER, yBufferIndex),
+                pointerConfig(PNTR_BUFFER, zBufferIndex),
+                pointerConfig(PNTR_BUFFER, zBufferIndex),
+                size0(),
+                NnMultiHeadAttOpConfig{
+                    h->nKvHeads, h->headSize, h->seqLen,
+                    n.positionPipeIndex, qBufferIndex, kBufferIndex, vBufferIndex, attBufferIndex,
+                    *qSlice, kvCacheSlice, multiHeadAttSlice});
+            att.addOp(
+                OP_MULTIHEAD_ATT_MERGE, "block_multihead_att_merge", layerIndex,
+                pointerConfig(PNTR_BUFFER, zBufferIndex),
+                pointerConfig(PNTR_BUFFER, zBufferIndex),
                 size0(),
                 NnMultiHeadAttOpConfig{
                     h->nKvHeads, h->headSize, h->seqLen,
                     n.positionPipeIndex, qBufferIndex, kBufferIndex, vBufferIndex, attBufferIndex,
-                    n.qSlice, kvCacheSlice, multiHeadAttSlice});
+                    *qSlice, kvCacheSlice, multiHeadAttSlice});
             att.addOp(
                 OP_CAST, "block_cast_y2", layerIndex,
-                slicedPointerConfig(PNTR_BUFFER, yBufferIndex),
+                pointerConfig(PNTR_BUFFER, zBufferIndex),
                 pointerConfig(PNTR_BUFFER, yqSliceIndex),
                 size0(),
                 NnCastOpCodeConfig{});
@@ -301,20 +426,22 @@ LlmNet buildLlmNet(LlmHeader *h, NnSize nNodes, NnSize nBatches) {
                 OP_MATMUL, "block_matmul_wo", layerIndex,
                 pointerConfig(PNTR_BUFFER, yqSliceIndex),
                 pointerConfig(PNTR_BUFFER, yBufferIndex),
-                size2D(h->weightType, n.woSlice.n0, n.woSlice.d),
+                size2D(h->weightType, woSlice->n0, woSlice->d),
                 NnMatmulOpConfig{});
-            att.addOp(
-                OP_CAST, "block_cast_d", layerIndex,
-                pointerConfig(PNTR_BUFFER, yBufferIndex),
-                slicedPointerConfig(PNTR_PIPE, zqPipeIndex),
-                size0(),
-                NnCastOpCodeConfig{});
-            att.addSync(zqPipeIndex, SYNC_NODE_SLICES);
+            if (!isPipeline) {
+                att.addOp(
+                    OP_CAST, "block_cast_d", layerIndex,
+                    pointerConfig(PNTR_BUFFER, yBufferIndex),
+                    options->ringAllReduce ? pointerConfig(PNTR_PIPE, zqPipeIndex) : slicedPointerConfig(PNTR_PIPE, zqPipeIndex),
+                    size0(),
+                    NnCastOpCodeConfig{});
+                att.addSync(zqPipeIndex, zqSyncType);
+            }
 
             // ff
             ff.addOp(
                 OP_MERGE_ADD, "block_merge_add2", layerIndex,
-                pointerConfig(PNTR_PIPE, zqPipeIndex),
+                blockOutputPointer,
                 pointerConfig(PNTR_BUFFER, xBufferIndex),
                 size0(),
                 NnMergeAddOpCodeConfig{});
@@ -342,13 +469,13 @@ LlmNet buildLlmNet(LlmHeader *h, NnSize nNodes, NnSize nBatches) {
                 OP_MATMUL, "block_matmul_w1", layerIndex,
                 pointerConfig(PNTR_BUFFER, yqBufferIndex),
                 pointerConfig(PNTR_BUFFER, dBufferIndex),
-                size2D(h->weightType, n.w1Slice.n, n.w1Slice.d0),
+                size2D(h->weightType, w1Slice->n, w1Slice->d0),
                 NnMatmulOpConfig{});
             ff.addOp(
                 OP_MATMUL, "block_matmul_w3", layerIndex,
                 pointerConfig(PNTR_BUFFER, yqBufferIndex),
                 pointerConfig(PNTR_BUFFER, lBufferIndex),
-                size2D(h->weightType, n.w3Slice.n, n.w3Slice.d0),
+                size2D(h->weightType, w3Slice->n, w3Slice->d0),
                 NnMatmulOpConfig{});
             ff.addOp(
                 OP_SILU, "block_act", layerIndex,
@@ -374,24 +501,55 @@ LlmNet buildLlmNet(LlmHeader *h, NnSize nNodes, NnSize nBatches) {
                 OP_MATMUL, "block_matmul_w2", layerIndex,
                 pointerConfig(PNTR_BUFFER, dqBufferIndex),
                 pointerConfig(PNTR_BUFFER, yBufferIndex),
-                size2D(h->weightType, n.w2Slice.n0, n.w2Slice.d),
+                size2D(h->weightType, w2Slice->n0, w2Slice->d),
                 NnMatmulOpConfig{});
-            ff.addOp(
-                OP_CAST, "block_cast_d3", layerIndex,
-                pointerConfig(PNTR_BUFFER, yBufferIndex),
-                slicedPointerConfig(PNTR_PIPE, zqPipeIndex),
-                size0(),
-                NnCastOpCodeConfig{});
-            ff.addSync(zqPipeIndex, SYNC_NODE_SLICES);
+            if (!isPipeline) {
+                ff.addOp(
+                    OP_CAST, "block_cast_d3", layerIndex,
+                    pointerConfig(PNTR_BUFFER, yBufferIndex),
+                    options->ringAllReduce ? pointerConfig(PNTR_PIPE, zqPipeIndex) : slicedPointerConfig(PNTR_PIPE, zqPipeIndex),
+                    size0(),
+                    NnCastOpCodeConfig{});
+                ff.addSync(zqPipeIndex, zqSyncType);
+            }
 
             nodeBuilder.addSegment(att.build());
             nodeBuilder.addSegment(ff.build());
         }
 
+        if (!isLastStage) {
+            // The residual stream goes to the next stage, the logits come back from the last one
+            NnSegmentConfigBuilder stageEnd;
+            stageEnd.addOp(
+                OP_MERGE_ADD, "stage_merge_add", 0,
+                blockOutputPointer,
+                pointerConfig(PNTR_BUFFER, xBufferIndex),
+                size0(),
+                NnMergeAddOpCodeConfig{});
+            stageEnd.addOp(
+                OP_CAST, "stage_cast_x", 0,
+                pointerConfig(PNTR_BUFFER, xBufferIndex),
+                pointerConfig(PNTR_PIPE, n.xPipeIndex),
+                size0(),
+                NnCastOpCodeConfig{});
+            stageEnd.addSync(n.xPipeIndex, SYNC_PIPELINE_SEND);
+            nodeBuilder.addSegment(stageEnd.build());
+
+            if (nodeIndex == 0) {
+                NnSegmentConfigBuilder logits;
+                logits.setOutput(true);
+                logits.addSync(n.logitsPipeIndex, SYNC_PIPELINE_RECV);
+                nodeBuilder.addSegment(logits.build());
+            }
+            n.nodeConfigs[nodeIndex] = nodeBuilder.build();
+            continue;
+        }
+
         NnSegmentConfigBuilder end;
+        end.setOutput(true);
         end.addOp(
             OP_MERGE_ADD, "final_merge_add", 0,
-            pointerConfig(PNTR_PIPE, zqPipeIndex),
+            blockOutputPointer,
             pointerConfig(PNTR_BUFFER, xBufferIndex),
             size0(),
             NnMergeAddOpCodeConfig{});
@@ -419,15 +577,15 @@ LlmNet buildLlmNet(LlmHeader *h, NnSize nNodes, NnSize nBatches) {
             OP_MATMUL, "final_matmul_logits", 0,
             pointerConfig(PNTR_BUFFER, yqBufferIndex),
             pointerConfig(PNTR_BUFFER, logitsSliceBufferIndex),
-            size2D(h->weightType, n.wclsSlice.n, n.wclsSlice.d0),
+            size2D(h->weightType, wclsSlice->n, wclsSlice->d0),
             NnMatmulOpConfig{});
         end.addOp(
             OP_CAST, "final_cast_logits", 0,
             pointerConfig(PNTR_BUFFER, logitsSliceBufferIndex),
-            slicedPointerConfig(PNTR_PIPE, n.logitsPipeIndex),
+            isPipeline ? pointerConfig(PNTR_PIPE, n.logitsPipeIndex) : slicedPointerConfig(PNTR_PIPE, n.logitsPipeIndex),
             size0(),
             NnCastOpCodeConfig{});
-        end.addSync(n.logitsPipeIndex, SYNC_NODE_SLICES_EXCEPT_ROOT);
+        end.addSync(n.logitsPipeIndex, isPipeline ? SYNC_PIPELINE_SEND : SYNC_NODE_SLICES_EXCEPT_ROOT);
 
         nodeBuilder.addSegment(end.build());
         n.nodeConfigs[nodeIndex] = nodeBuilder.build();
@@ -440,32 +598,102 @@ void releaseLlmNet(LlmNet *net) {
         releaseNodeConfig(&net->nodeConfigs[nodeIndex]);
     releaseNetConfig(&net->netConfig);
     delete[] net->nodeConfigs;
+    delete[] net->qSlices;
+    delete[] net->kSlices;
+    delete[] net->vSlices;
+    delete[] net->woSlices;
+    delete[] net->w1Slices;
+    delete[] net->w2Slices;
+    delete[] net->w3Slices;
+    delete[] net->wclsSlices;
 }
 
-void loadLlmNetWeight(const char *path, LlmNet *net, NnRootWeightLoader *loader) {
-    MmapFile file;
-    openMmapFile(&file, path, net->header->fileSize);
-    std::unique_ptr<MmapFile, void(*)(MmapFile *)> fdPtr(&file, closeMmapFile);
+static std::uint64_t hashTensorSamples(std::uint64_t hash, const NnByte *tensor, size_t nBytes) {
+    const size_t sampleSize = 4096;
+    if (nBytes <= 3 * sampleSize)
+        return hashBytes(hash, tensor, nBytes);
+    hash = hashBytes(hash, tensor, sampleSize);
+    hash = hashBytes(hash, &tensor[nBytes / 2 - sampleSize / 2], sampleSize);
+    return hashBytes(hash, &tensor[nBytes - sampleSize], sampleSize);
+}
 
-    NnByte *data = (NnByte *)file.data;
-    NnByte *b = &data[net->header->headerSize];
-    NnSize nodeIndex = 0;
-    b += loader->loadRoot("embedding", 0, net->tokenEmbeddingSize.nBytes, b);
-
-    for (NnSize layerIndex = 0; layerIndex < net->header->nLayers; layerIndex++) {
-        b += loader->loadRowMatmulSlices("block_matmul_q", layerIndex, &net->qSlice, b);
-        b += loader->loadRowMatmulSlices("block_matmul_k", layerIndex, &net->kSlice, b);
-        b += loader->loadRowMatmulSlices("block_matmul_v", layerIndex, &net->vSlice, b);
-        b += loader->loadColMatmulSlices("block_matmul_wo", layerIndex, &net->woSlice, b);
-        b += loader->loadRowMatmulSlices("block_matmul_w1", layerIndex, &net->w1Slice, b);
-        b += loader->loadColMatmulSlices("block_matmul_w2", layerIndex, &net->w2Slice, b);
-        b += loader->loadRowMatmulSlices("block_matmul_w3", layerIndex, &net->w3Slice, b);
-        b += loader->loadAll("block_rms_norm_0", layerIndex, net->rmsNormSize.nBytes, b);
-        b += loader->loadAll("block_rms_norm_1", layerIndex, net->rmsNormSize.nBytes, b);
+static std::uint64_t getLlmModelFingerprint(MmapFile *file, LlmNet *net) {
+    // The header, the file size and the start, the middle and the end of every tensor. Hashing the whole file
+    // would read all weights on every start, which the shards and resident weights are meant to avoid,
+    // so an edit that misses all samples of the changed tensors is not detected
+    LlmHeader *header = net->header;
+    std::vector<NnSize> tensorSizes;
+    tensorSizes.push_back(net->tokenEmbeddingSize.nBytes);
+    for (NnSize layerIndex = 0; layerIndex < header->nLayers; layerIndex++) {
+        tensorSizes.push_back(net->qSlices[0].size.nBytes);
+        tensorSizes.push_back(net->kSlices[0].size.nBytes);
+        tensorSizes.push_back(net->vSlices[0].size.nBytes);
+        tensorSizes.push_back(net->woSlices[0].size.nBytes);
+        tensorSizes.push_back(net->w1Slices[0].size.nBytes);
+        tensorSizes.push_back(net->w2Slices[0].size.nBytes);
+        tensorSizes.push_back(net->w3Slices[0].size.nBytes);
+        tensorSizes.push_back(net->rmsNormSize.nBytes);
+        tensorSizes.push_back(net->rmsNormSize.nBytes);
+    }
+    tensorSizes.push_back(net->rmsNormSize.nBytes);
+    tensorSizes.push_back(net->wclsSlices[0].size.nBytes);
+
+    NnByte *data = (NnByte *)file->data;
+    std::uint64_t hash = hashBytes(HASH_SEED, data, header->headerSize);
+    std::uint64_t fileSize = header->fileSize;
+    hash = hashBytes(hash, &fileSize, sizeof(fileSize));
+    size_t offset = header->headerSize;
+    for (NnSize nBytes : tensorSizes) {
+        if (offset + nBytes > header->fileSize)
+            throw std::runtime_error("The model file is truncated");
+        hash = hashTensorSamples(hash, &data[offset], nBytes);
+        offset += nBytes;
     }
+    return hash == 0 ? 1 : hash; // 0 means no fingerprint
+}
+
+static void loadLlmNetWeightFromFile(MmapFile *file, LlmNet *net, NnRootWeightLoader *loader) {
+    NnByte *data = (NnByte *)file->data;
+    NnByte *b = &data[net->header->headerSize];
+    loader->setModelFingerprint(getLlmModelFingerprint(file, net));
+    if (net->options.localEmbedding)
+        b += loader->loadAll("embedding", 0, net->tokenEmbeddingSize.nBytes, b);
+    else
+        b += loader->loadRoot("embedding", 0, net->tokenEmbeddingSize.nBytes, b);
+
+    if (net->options.pipeline && net->netConfig.nNodes > 1) {
+        // Whole layers go to the node of their stage, the last stage computes the logits
+        for (NnSize layerIndex = 0; layerIndex < net->header->nLayers; layerIndex++) {
+            NnSize nodeIndex = getLlmLayerNode(net, layerIndex);
+            b += loader->loadNode(nodeIndex, "block_matmul_q", layerIndex, net->qSlices[0].size.nBytes, b);
+            b += loader->loadNode(nodeIndex, "block_matmul_k", layerIndex, net->kSlices[0].size.nBytes, b);
+            b += loader->loadNode(nodeIndex, "block_matmul_v", layerIndex, net->vSlices[0].size.nBytes, b);
+            b += loader->loadNode(nodeIndex, "block_matmul_wo", layerIndex, net->woSlices[0].size.nBytes, b);
+            b += loader->loadNode(nodeIndex, "block_matmul_w1", layerIndex, net->w1Slices[0].size.nBytes, b);
+            b += loader->loadNode(nodeIndex, "block_matmul_w2", layerIndex, net->w2Slices[0].size.nBytes, b);
+            b += loader->loadNode(nodeIndex, "block_matmul_w3", layerIndex, net->w3Slices[0].size.nBytes, b);
+            b += loader->loadNode(nodeIndex, "block_rms_norm_0", layerIndex, net->rmsNormSize.nBytes, b);
+            b += loader->loadNode(nodeIndex, "block_rms_norm_1", layerIndex, net->rmsNormSize.nBytes, b);
+        }
+        NnSize lastNodeIndex = net->netConfig.nNodes - 1;
+        b += loader->loadNode(lastNodeIndex, "final_rms_norm", 0, net->rmsNormSize.nBytes, b);
+        b += loader->loadNode(lastNodeIndex, "final_matmul_logits", 0, net->wclsSlices[0].size.nBytes, b);
+    } else {
+        for (NnSize layerIndex = 0; layerIndex < net->header->nLayers; layerIndex++) {
+            b += loader->loadRowMatmulSlices("block_matmul_q", layerIndex, net->qSlices, b);
+            b += loader->loadRowMatmulSlices("block_matmul_k", layerIndex, net->kSlices, b);
+            b += loader->loadRowMatmulSlices("block_matmul_v", layerIndex, net->vSlices, b);
+            b += loader->loadColMatmulSlices("block_matmul_wo", layerIndex, net->woSlices, b);
+            b += loader->loadRowMatmulSlices("block_matmul_w1", layerIndex, net->w1Slices, b);
+            b += loader->loadColMatmulSlices("block_matmul_w2", layerIndex, net->w2Slices, b);
+            b += loader->loadRowMatmulSlices("block_matmul_w3", layerIndex, net->w3Slices, b);
+            b += loader->loadAll("block_rms_norm_0", layerIndex, net->rmsNormSize.nBytes, b);
+            b += loader->loadAll("block_rms_norm_1", layerIndex, net->rmsNormSize.nBytes, b);
+        }
 
-    b += loader->loadAll("final_rms_norm", 0, net->rmsNormSize.nBytes, b);
-    b += loader->loadRowMatmulSlices("final_matmul_logits", 0, &net->wclsSlice, b);
+        b += loader->loadAll("final_rms_norm", 0, net->rmsNormSize.nBytes, b);
+        b += loader->loadRowMatmulSlices("final_matmul_logits", 0, net->wclsSlices, b);
+    }
 
     loader->finish();
 
@@ -473,3 +701,25 @@ void loadLlmNetWeight(const char *path, LlmNet *net, NnRootWeightLoader *loader)
     assert(missingBytes == 0);
     printf("💿 Weights loaded\n");
 }
+
+void loadLlmNetWeight(const char *path, LlmNet *net, NnRootWeightLoader *loader) {
+    MmapFile file;
+    openMmapFile(&file, path, net->header->fileSize);
+    std::unique_ptr<MmapFile, void(*)(MmapFile *)> fdPtr(&file, closeMmapFile);
+    loadLlmNetWeightFromFile(&file, net, loader);
+}
+
+MmapFile *mapLlmNetWeight(const char *path, LlmNet *net, NnRootWeightLoader *loader) {
+    std::unique_ptr<MmapFile> file(new MmapFile);
+    openMmapFile(file.get(), path, net->header->fileSize);
+    std::unique_ptr<MmapFile, void(*)(MmapFile *)> filePtr(file.release(), unmapLlmNetWeight);
+    loader->enableMapping();
+    loadLlmNetWeightFromFile(filePtr.get(), net, loader);
+    printf("💿 Mapped weights: %lu kB\n", (unsigned long)(loader->getMappedBytes() / 1024));
+    return filePtr.release();
+}
+
+void unmapLlmNetWeight(MmapFile *file) {
+    closeMmapFile(file);
+    delete file;
+}
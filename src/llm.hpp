@@ -5,6 +5,8 @@
 #include "nn/nn-executor.hpp"
 #include "nn/nn-network.hpp"
 
+struct MmapFile;
+
 enum LlmHeaderKey {
     VERSION = 0,
     ARCH_TYPE = 1,
@@ -64,20 +66,31 @@ typedef struct {
 
     NnFloatType weightType;
     NnFloatType syncType;
+    NnFloatType kvCacheType;
 } LlmHeader;
 
+typedef struct {
+    bool ringAllReduce; // block outputs are summed by a ring all-reduce instead of the all-to-all mesh
+    bool treeBroadcast; // workers relay X to each other instead of receiving it from the root
+    bool localEmbedding; // every node holds the embedding table, only token ids are sent
+    bool pipeline; // every node holds a contiguous range of whole layers instead of a slice of every layer
+    const float *nodeWeights; // relative speed of every node, sizes its slices; nullptr gives all nodes equal slices
+} LlmNetOptions;
+
 typedef struct {
     LlmHeader *header;
+    LlmNetOptions options;
     NnNetConfig netConfig;
     NnNodeConfig *nodeConfigs;
-    NnRowMatmulSlice qSlice;
-    NnRowMatmulSlice kSlice;
-    NnRowMatmulSlice vSlice;
-    NnColMatmulSlice woSlice;
-    NnRowMatmulSlice w1Slice;
-    NnColMatmulSlice w2Slice;
-    NnRowMatmulSlice w3Slice;
-    NnRowMatmulSlice wclsSlice;
+    // One slice per node
+    NnRowMatmulSlice *qSlices;
+    NnRowMatmulSlice *kSlices;
+    NnRowMatmulSlice *vSlices;
+    NnColMatmulSlice *woSlices;
+    NnRowMatmulSlice *w1Slices;
+    NnColMatmulSlice *w2Slices;
+    NnRowMatmulSlice *w3Slices;
+    NnRowMatmulSlice *wclsSlices;
     NnSize positionPipeIndex;
     NnSize tokenPipeIndex;
     NnSize xPipeIndex;
@@ -86,10 +99,15 @@ typedef struct {
     NnSize2D rmsNormSize;
 } LlmNet;
 
-LlmHeader loadLlmHeader(const char* path, const unsigned int maxSeqLen, NnFloatType syncType);
+LlmHeader loadLlmHeader(const char* path, const unsigned int maxSeqLen, NnFloatType syncType, NnFloatType kvCacheType);
 void printLlmHeader(LlmHeader *header);
-LlmNet buildLlmNet(LlmHeader *h, NnSize nNodes, NnSize nBatches);
+LlmNet buildLlmNet(LlmHeader *h, NnSize nNodes, NnSize nBatches, LlmNetOptions *options);
+// The node that holds the layer in the pipeline mode, the root otherwise
+NnSize getLlmLayerNode(LlmNet *net, NnSize layerIndex);
 void releaseLlmNet(LlmNet *net);
 void loadLlmNetWeight(const char* path, LlmNet *net, NnRootWeightLoader *loader);
+// Root weights may point directly into the mapped file, so it must be unmapped after the executor is released
+MmapFile *mapLlmNetWeight(const char* path, LlmNet *net, NnRootWeightLoader *loader);
+void unmapLlmNetWeight(MmapFile *file);
 
 #endif
\ No newline at end of file
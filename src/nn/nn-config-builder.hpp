@@ -25,7 +25,17 @@ public:
 
     NnSize addPipe(const char *name, NnSize2D size) {
         NnSize pipeIndex = pipes.size();
-        pipes.push_back({ cloneString(name), size });
+        pipes.push_back({ cloneString(name), size, nullptr });
+        return pipeIndex;
+    }
+
+    // The node slices of the pipe have unequal widths, node i holds the columns [sliceStarts[i], sliceStarts[i + 1])
+    NnSize addSlicedPipe(const char *name, NnSize2D size, const NnSize *sliceStarts) {
+        assert(sliceStarts[0] == 0 && sliceStarts[nNodes] == size.x);
+        NnSize pipeIndex = pipes.size();
+        NnSize *starts = new NnSize[nNodes + 1];
+        std::memcpy(starts, sliceStarts, (nNodes + 1) * sizeof(NnSize));
+        pipes.push_back({ cloneString(name), size, starts });
         return pipeIndex;
     }
 
@@ -81,6 +91,7 @@ private:
     std::list<NnOpConfig> ops;
     std::list<NnSyncConfig> syncs;
     bool syncPointers = false;
+    bool isOutput = false;
 
 public:
     template <typename T>
@@ -108,6 +119,10 @@ public:
         this->syncPointers = syncPointers;
     }
 
+    void setOutput(bool isOutput) {
+        this->isOutput = isOutput;
+    }
+
     NnSegmentConfig build() {
         NnSegmentConfig segment;
         segment.nOps = ops.size();
@@ -121,6 +136,7 @@ public:
             std::copy(syncs.begin(), syncs.end(), segment.syncs);
         }
         segment.syncPointers = syncPointers;
+        segment.isOutput = isOutput;
         return segment;
     }
 };
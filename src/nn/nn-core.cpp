@@ -1,7 +1,12 @@
 #include "nn-core.hpp"
+#include <algorithm>
 #include <cassert>
+#include <cmath>
+#include <cstddef>
 #include <cstring>
 #include <stdexcept>
+#include <string>
+#include <vector>
 
 // utility functions
 
@@ -48,6 +53,10 @@ NnOpQuantType getOpQuantType(NnFloatType input, NnFloatType weight, NnFloatType
         if (weight == F_Q40)
             return F32_Q40_Q80;
     }
+    if (input == F_32 && output == F_16) {
+        if (weight == F_UNK || weight == F_32)
+            return F32_F32_F16;
+    }
     if (input == F_Q80 && output == F_32) {
         if (weight == F_UNK || weight == F_Q80)
             return Q80_Q80_F32;
@@ -74,6 +83,7 @@ const char *opCodeToString(NnOpCode code) {
     if (code == OP_MATMUL) return "MATMUL";
     if (code == OP_ROPE_LLAMA) return "ROPE_LLAMA";
     if (code == OP_MULTIHEAD_ATT) return "MULTIHEAD_ATT";
+    if (code == OP_MULTIHEAD_ATT_MERGE) return "MULTIHEAD_ATT_MERGE";
     if (code == OP_GELU) return "GELU";
     if (code == OP_SILU) return "SILU";
     if (code == OP_MUL) return "MUL";
@@ -90,6 +100,7 @@ const char *opQuantTypeToString(NnOpQuantType type) {
     if (type == Q80_Q80_F32) return "Q80_Q80_F32";
     if (type == Q80_Q40_F32) return "Q80_Q40_F32";
     if (type == Q80_F32_F32) return "Q80_F32_F32";
+    if (type == F32_F32_F16) return "F32_F32_F16";
     throw std::invalid_argument("Unknown op quant type");
 }
 
@@ -122,9 +133,18 @@ bool hasPointerContinuousMemory(NnPointerConfig *config) {
     return config->batchType == PNTR_BATCH_DEFAULT && config->sliceType == SLICE_NONE;
 }
 
+NnSize getPipeSliceStart(NnPipeConfig *pipeConfig, NnSize nNodes, NnSize nodeIndex) {
+    if (pipeConfig->sliceStarts != nullptr)
+        return pipeConfig->sliceStarts[nodeIndex];
+    assert(pipeConfig->size.x % nNodes == 0);
+    return (pipeConfig->size.x / nNodes) * nodeIndex;
+}
+
 void releaseNetConfig(NnNetConfig *netConfig) {
     for (NnSize pipeIndex = 0; pipeIndex < netConfig->nPipes; pipeIndex++) {
         delete[] netConfig->pipes[pipeIndex].name;
+        if (netConfig->pipes[pipeIndex].sliceStarts != nullptr)
+            delete[] netConfig->pipes[pipeIndex].sliceStarts;
     }
     delete[] netConfig->pipes;
 }
@@ -153,67 +173,211 @@ void printNodeRequiredMemory(NnNetConfig *netConfig, NnNodeConfig *nodeConfig) {
     unsigned long total = 0;
     for (NnSize pipeIndex = 0; pipeIndex < netConfig->nPipes; pipeIndex++)
         total += netConfig->pipes[pipeIndex].size.nBytes;
-    for (NnSize bufferIndex = 0; bufferIndex < nodeConfig->nBuffers; bufferIndex++)
-        total += nodeConfig->buffers[bufferIndex].size.nBytes;
+    std::vector<bool> isKvCache(nodeConfig->nBuffers, false);
     for (NnSize segmentIndex = 0; segmentIndex < nodeConfig->nSegments; segmentIndex++) {
         NnSegmentConfig *segment = &nodeConfig->segments[segmentIndex];
         for (NnSize opIndex = 0; opIndex < segment->nOps; opIndex++) {
             total += segment->ops[opIndex].weightSize.nBytes;
             total += segment->ops[opIndex].configSize;
+            if (segment->ops[opIndex].code == OP_MULTIHEAD_ATT) {
+                NnMultiHeadAttOpConfig *config = (NnMultiHeadAttOpConfig *)segment->ops[opIndex].config;
+                isKvCache[config->keyCacheBufferIndex] = true;
+                isKvCache[config->valueCacheBufferIndex] = true;
+            }
+        }
+    }
+    // The KV cache starts with one page per buffer and grows up to the full sequence length
+    unsigned long kvCacheInitial = 0;
+    unsigned long kvCacheMax = 0;
+    for (NnSize bufferIndex = 0; bufferIndex < nodeConfig->nBuffers; bufferIndex++) {
+        NnSize2D *size = &nodeConfig->buffers[bufferIndex].size;
+        if (isKvCache[bufferIndex]) {
+            NnSize initialRows = size->y < KV_CACHE_PAGE_ROWS ? size->y : KV_CACHE_PAGE_ROWS;
+            kvCacheInitial += (unsigned long)(size->nBytes / size->y) * initialRows;
+            kvCacheMax += size->nBytes;
+        } else {
+            total += size->nBytes;
+        }
+    }
+    printf("📀 RequiredMemory: %lu kB, KV cache: %lu kB initially, up to %lu kB\n",
+        (total + kvCacheInitial) / 1024, kvCacheInitial / 1024, kvCacheMax / 1024);
+}
+
+std::uint64_t hashBytes(std::uint64_t hash, const void *data, size_t size) {
+    const NnByte *bytes = (const NnByte *)data;
+    for (size_t i = 0; i < size; i++) {
+        hash ^= bytes[i];
+        hash *= 0x100000001B3ull;
+    }
+    return hash;
+}
+
+static std::uint64_t hashSize(std::uint64_t hash, NnSize value) {
+    return hashBytes(hash, &value, sizeof(value));
+}
+
+static std::uint64_t hashSize2D(std::uint64_t hash, NnSize2D *size) {
+    hash = hashSize(hash, (NnSize)size->floatType);
+    hash = hashSize(hash, size->y);
+    hash = hashSize(hash, size->x);
+    return hashSize(hash, size->nBytes);
+}
+
+static std::uint64_t hashPointerConfig(std::uint64_t hash, NnPointerConfig *config) {
+    hash = hashSize(hash, (NnSize)config->pointerType);
+    hash = hashSize(hash, config->pointerIndex);
+    hash = hashSize(hash, (NnSize)config->sliceType);
+    hash = hashSize(hash, (NnSize)config->batchType);
+    return hashSize(hash, config->batchArg0);
+}
+
+std::uint64_t getConfigFingerprint(NnNetConfig *netConfig, NnNodeConfig *nodeConfig) {
+    // Field by field, so padding bytes of the structs do not change the result
+    std::uint64_t hash = HASH_SEED;
+    hash = hashSize(hash, netConfig->nBatches);
+    hash = hashSize(hash, netConfig->nNodes);
+    hash = hashSize(hash, netConfig->nPipes);
+    for (NnSize pipeIndex = 0; pipeIndex < netConfig->nPipes; pipeIndex++) {
+        NnPipeConfig *pipe = &netConfig->pipes[pipeIndex];
+        hash = hashBytes(hash, pipe->name, std::strlen(pipe->name) + 1);
+        hash = hashSize2D(hash, &pipe->size);
+        if (pipe->sliceStarts != nullptr) {
+            for (NnSize nodeIndex = 0; nodeIndex <= netConfig->nNodes; nodeIndex++)
+                hash = hashSize(hash, pipe->sliceStarts[nodeIndex]);
+        }
+    }
+    hash = hashSize(hash, nodeConfig->nodeIndex);
+    hash = hashSize(hash, nodeConfig->nBuffers);
+    for (NnSize bufferIndex = 0; bufferIndex < nodeConfig->nBuffers; bufferIndex++) {
+        NnBufferConfig *buffer = &nodeConfig->buffers[bufferIndex];
+        hash = hashBytes(hash, buffer->name, std::strlen(buffer->name) + 1);
+        hash = hashSize2D(hash, &buffer->size);
+    }
+    hash = hashSize(hash, nodeConfig->nSegments);
+    for (NnSize segmentIndex = 0; segmentIndex < nodeConfig->nSegments; segmentIndex++) {
+        NnSegmentConfig *segment = &nodeConfig->segments[segmentIndex];
+        hash = hashSize(hash, segment->nOps);
+        for (NnSize opIndex = 0; opIndex < segment->nOps; opIndex++) {
+            NnOpConfig *op = &segment->ops[opIndex];
+            hash = hashSize(hash, (NnSize)op->code);
+            hash = hashBytes(hash, op->name, std::strlen(op->name) + 1);
+            hash = hashSize(hash, op->index);
+            hash = hashPointerConfig(hash, &op->input);
+            hash = hashPointerConfig(hash, &op->output);
+            hash = hashSize2D(hash, &op->weightSize);
+            hash = hashSize(hash, op->configSize);
+            if (op->code == OP_ROPE_LLAMA) {
+                // The padding after isQ is not initialized by the root
+                NnRopeLlamaOpConfig *config = (NnRopeLlamaOpConfig *)op->config;
+                size_t offset = offsetof(NnRopeLlamaOpConfig, positionPipeIndex);
+                hash = hashSize(hash, config->isQ ? 1 : 0);
+                hash = hashBytes(hash, &op->config[offset], op->configSize - offset);
+            } else {
+                hash = hashBytes(hash, op->config, op->configSize);
+            }
+        }
+        hash = hashSize(hash, segment->nSyncs);
+        for (NnSize syncIndex = 0; syncIndex < segment->nSyncs; syncIndex++) {
+            hash = hashSize(hash, segment->syncs[syncIndex].pipeIndex);
+            hash = hashSize(hash, (NnSize)segment->syncs[syncIndex].syncType);
         }
+        hash = hashSize(hash, segment->syncPointers ? 1 : 0);
+        hash = hashSize(hash, segment->isOutput ? 1 : 0);
     }
-    printf("📀 RequiredMemory: %lu kB\n", total / 1024);
+    return hash == 0 ? 1 : hash;
 }
 
 // slicers
 
-NnKvCacheSlice sliceKvCache(NnSize kvDim, NnSize seqLen, NnSize nNodes) {
+NnSize getKvHeadReplicas(NnSize nKvHeads, NnSize nNodes) {
+    if (nNodes <= nKvHeads)
+        return 1;
+    if (nNodes % nKvHeads != 0)
+        throw std::invalid_argument("The number of nodes must be a multiple of the number of KV heads");
+    return nNodes / nKvHeads;
+}
+
+void splitNodeRanges(NnSize n, NnSize unit, NnSize nNodes, const float *weights, NnSize *starts) {
+    if (n % unit != 0)
+        throw std::invalid_argument("The sliced dimension must be a multiple of " + std::to_string(unit));
+    NnSize nUnits = n / unit;
+    if (nUnits < nNodes)
+        throw std::invalid_argument("The sliced dimension is too small for " + std::to_string(nNodes) + " nodes");
+    double totalWeight = 0.0;
+    if (weights != nullptr) {
+        for (NnSize nodeIndex = 0; nodeIndex < nNodes; nodeIndex++)
+            totalWeight += weights[nodeIndex];
+    }
+
+    starts[0] = 0;
+    double weightSum = 0.0;
+    for (NnSize nodeIndex = 1; nodeIndex < nNodes; nodeIndex++) {
+        NnSize start;
+        if (weights == nullptr) {
+            start = (nUnits * nodeIndex) / nNodes;
+        } else {
+            weightSum += weights[nodeIndex - 1];
+            start = (NnSize)llround(nUnits * (weightSum / totalWeight));
+        }
+        // Every node keeps at least one unit
+        start = std::max(start, starts[nodeIndex - 1] + 1);
+        start = std::min(start, nUnits - (nNodes - nodeIndex));
+        starts[nodeIndex] = start;
+    }
+    starts[nNodes] = nUnits;
+    for (NnSize i = 0; i <= nNodes; i++)
+        starts[i] *= unit;
+}
+
+NnKvCacheSlice sliceKvCache(NnFloatType type, NnSize seqLen, NnSize kvDim0) {
     NnKvCacheSlice s;
-    assert(kvDim % nNodes == 0);
-    s.kvDim0 = kvDim / nNodes;
-    s.keySize = size2D(F_32, seqLen, s.kvDim0);
-    s.valueSize = size2D(F_32, seqLen, s.kvDim0);
+    s.kvDim0 = kvDim0;
+    s.keySize = size2D(type, seqLen, s.kvDim0);
+    s.valueSize = size2D(type, seqLen, s.kvDim0);
     return s;
 }
 
-NnRowMatmulSlice sliceRowMatmul(NnFloatType type, NnSize nNodes, NnSize n, NnSize d) {
+NnRowMatmulSlice sliceRowMatmul(NnFloatType type, NnSize n, NnSize d, NnSize dStart, NnSize d0) {
     NnRowMatmulSlice s;
-    assert(d % nNodes == 0);
+    assert(dStart + d0 <= d);
     s.type = type;
-    s.nNodes = nNodes;
-    s.d0 = d / nNodes;
+    s.dStart = dStart;
+    s.d0 = d0;
     s.n = n;
     s.size = size2D(type, s.n, d);
     s.sliceSize = size2D(type, s.n, s.d0);
     return s;
 }
 
-NnColMatmulSlice sliceColMatmul(NnFloatType type, NnSize nNodes, NnSize n, NnSize d) {
+NnColMatmulSlice sliceColMatmul(NnFloatType type, NnSize n, NnSize d, NnSize nStart, NnSize n0) {
     NnColMatmulSlice s;
-    assert(n % nNodes == 0);
+    assert(nStart + n0 <= n);
     s.type = type;
-    s.nNodes = nNodes;
     s.n = n;
-    s.n0 = n / nNodes;
+    s.nStart = nStart;
+    s.n0 = n0;
     s.d = d;
     s.size = size2D(type, n, d);
     s.sliceSize = size2D(type, s.n0, d);
     return s;
 }
 
-NnRopeSlice sliceRope(NnSize dim, NnSize kvDim, NnSize nKvHeads, NnSize nNodes, NnSize seqLen, NnSize headSize, float ropeTheta, NnSize nodeIndex) {
+NnRopeSlice sliceRope(NnSize dim, NnSize kvDim, NnSize nKvHeads, NnSize seqLen, NnSize headSize, float ropeTheta,
+    NnSize qDimStart, NnSize qDim0, NnSize kvDimStart, NnSize kvDim0) {
     NnRopeSlice s;
+    // The KV dims of a node start at or before its query dims, a replicated KV head covers the query heads of its nodes
     assert(dim >= kvDim);
-    assert(dim % nNodes == 0);
-    assert(kvDim % nNodes == 0);
+    assert(qDimStart + qDim0 <= dim);
+    assert(kvDimStart + kvDim0 <= kvDim);
+    assert(kvDimStart <= qDimStart);
 
-    s.qDim0 = dim / nNodes;
-    s.kvDim0 = kvDim / nNodes;
+    s.qDim0 = qDim0;
+    s.kvDim0 = kvDim0;
     assert(s.qDim0 % 2 == 0);
     assert(s.kvDim0 % 2 == 0);
 
-    s.kvDimStart = s.kvDim0 * nodeIndex;
-    s.qDimStart = s.qDim0 * nodeIndex;
+    s.kvDimStart = kvDimStart;
+    s.qDimStart = qDimStart;
     s.qDimEnd = s.qDimStart + s.qDim0;
     s.qShift = s.qDimStart - s.kvDimStart;
     s.sliceDim = s.qDimEnd - s.kvDimStart;
@@ -228,24 +392,27 @@ NnRopeSlice sliceRope(NnSize dim, NnSize kvDim, NnSize nKvHeads, NnSize nNodes,
     return s;
 }
 
-NnMultiHeadAttSlice sliceMultiHeadAtt(NnSize nHeads, NnSize seqLen, NnSize nNodes) {
+NnMultiHeadAttSlice sliceMultiHeadAtt(NnSize nHeads, NnSize seqLen, NnSize headSize, NnSize nHeads0) {
     NnMultiHeadAttSlice s;
-    assert(nHeads % nNodes == 0);
+    assert(nHeads0 <= nHeads);
     s.nHeads = nHeads;
-    s.nHeads0 = nHeads / nNodes;
-    s.attSize = size2D(F_32, seqLen, s.nHeads0);
+    s.nHeads0 = nHeads0;
+    s.headSize = headSize;
+    s.nMaxChunks = std::min((NnSize)ATT_MAX_CHUNKS, (seqLen + ATT_MIN_CHUNK_LEN - 1) / ATT_MIN_CHUNK_LEN);
+    // Scores are never materialized, the buffer holds the partial state (max, sum, output) of every chunk
+    s.attSize = size2D(F_32, s.nMaxChunks * (headSize + 2), s.nHeads0);
     return s;
 }
 
 // splitters
 
-NnSize splitRowMatmulWeight(NnRowMatmulSlice *slice, NnSize nodeIndex, NnByte *weight, NnByte *weight0) {
+NnSize splitRowMatmulWeight(NnRowMatmulSlice *slice, NnByte *weight, NnByte *weight0) {
     NnSize blockSize = getBlockSize(slice->type);
     NnSize batchBytes = getBytes(slice->type, blockSize);
     assert(slice->n % blockSize == 0);
 
     NnSize n = slice->n / blockSize;
-    NnSize offset = slice->d0 * nodeIndex * n * batchBytes;
+    NnSize offset = slice->dStart * n * batchBytes;
     NnSize copiedBytes = 0;
     for (NnSize d = 0; d < slice->d0; d++) {
         for (NnSize j = 0; j < n; j++) {
@@ -257,15 +424,16 @@ NnSize splitRowMatmulWeight(NnRowMatmulSlice *slice, NnSize nodeIndex, NnByte *w
     return copiedBytes;
 }
 
-NnSize splitColMatmulWeight(NnColMatmulSlice *slice, NnSize nodeIndex, NnByte *weight, NnByte *weight0) {
+NnSize splitColMatmulWeight(NnColMatmulSlice *slice, NnByte *weight, NnByte *weight0) {
     NnSize blockSize = getBlockSize(slice->type);
     NnSize batchBytes = getBytes(slice->type, blockSize);
     assert(slice->n0 % blockSize == 0);
+    assert(slice->nStart % blockSize == 0);
 
     NnSize n = slice->n / blockSize;
     NnSize rowBytes = n * batchBytes;
     NnSize row0Bytes = (slice->n0 / blockSize) * batchBytes;
-    NnSize rowOffsetBytes = nodeIndex * row0Bytes;
+    NnSize rowOffsetBytes = (slice->nStart / blockSize) * batchBytes;
     NnSize copiedBytes = 0;
     for (NnSize d = 0; d < slice->d; d++) {
         std::memcpy(&weight0[row0Bytes * d], &weight[rowBytes * d + rowOffsetBytes], row0Bytes);
@@ -26,7 +26,7 @@ typedef struct {
 
 typedef struct {
     NnFloatType type;
-    NnSize nNodes;
+    NnSize dStart;
     NnSize d0;
     NnSize n;
     NnSize2D size;
@@ -35,8 +35,8 @@ typedef struct {
 
 typedef struct {
     NnFloatType type;
-    NnSize nNodes;
     NnSize n;
+    NnSize nStart;
     NnSize n0;
     NnSize d;
     NnSize2D size;
@@ -59,9 +59,19 @@ typedef struct {
     NnSize2D cacheSize;
 } NnRopeSlice;
 
+// During the decode the attention of a head may be split over time into chunks, every chunk
+// is processed by a different thread and the partial results are merged by OP_MULTIHEAD_ATT_MERGE
+#define ATT_MIN_CHUNK_LEN 64
+#define ATT_MAX_CHUNKS 32
+
+// The KV cache is allocated in pages of this many positions when the positions are written
+#define KV_CACHE_PAGE_ROWS 64
+
 typedef struct {
     NnSize nHeads;
     NnSize nHeads0;
+    NnSize headSize;
+    NnSize nMaxChunks;
     NnSize2D attSize;
 } NnMultiHeadAttSlice;
 
@@ -79,6 +89,7 @@ enum NnOpCode {
     OP_SILU,
     OP_MUL,
     OP_CAST,
+    OP_MULTIHEAD_ATT_MERGE,
 };
 
 enum NnOpQuantType {
@@ -91,10 +102,11 @@ enum NnOpQuantType {
     Q80_Q80_F32,
     Q80_Q40_F32,
     Q80_F32_F32,
+    F32_F32_F16,
 };
 
-#define N_OP_CODES (OP_CAST + 1)
-#define N_OP_QUANTS (Q80_F32_F32 + 1)
+#define N_OP_CODES (OP_MULTIHEAD_ATT_MERGE + 1)
+#define N_OP_QUANTS (F32_F32_F16 + 1)
 
 enum NnPointerType {
     PNTR_PIPE,
@@ -115,6 +127,10 @@ enum NnSyncType {
     SYNC_WITH_ROOT, // whole pipe to all nodes
     SYNC_NODE_SLICES, // my slice of pipe to all nodes
     SYNC_NODE_SLICES_EXCEPT_ROOT, // only workers send slices to root, root does not send
+    SYNC_TREE_FROM_ROOT, // whole pipe to all nodes, workers relay it along a binomial tree
+    SYNC_RING_ALL_REDUCE, // pipe is summed across all nodes by a ring reduce-scatter and all-gather
+    SYNC_PIPELINE_SEND, // whole pipe to the next node, the last node sends it to the root
+    SYNC_PIPELINE_RECV, // whole pipe from the previous node, the root receives it from the last node
 };
 
 enum NnRopeType {
@@ -128,6 +144,7 @@ enum NnRopeType {
 typedef struct {
     char *name;
     NnSize2D size;
+    NnSize *sliceStarts; // nNodes + 1 column offsets of the node slices, nullptr splits the columns evenly
 } NnPipeConfig;
 
 typedef struct {
@@ -165,6 +182,7 @@ typedef struct  {
     NnSize nSyncs;
     NnSyncConfig *syncs;
     bool syncPointers;
+    bool isOutput; // ops and syncs process only the first outputBatchSize rows
 } NnSegmentConfig;
 
 typedef struct {
@@ -257,22 +275,40 @@ NnPointerConfig pointerConfigWithPipedBatch(NnPointerType type, NnSize index, Nn
 NnPointerConfig slicedPointerConfig(NnPointerType type, NnSize index);
 bool hasPointerContinuousMemory(NnPointerConfig *config);
 
+// The first column of the node slice, the slice ends where the slice of the next node starts
+NnSize getPipeSliceStart(NnPipeConfig *pipeConfig, NnSize nNodes, NnSize nodeIndex);
+
 void releaseNetConfig(NnNetConfig *netConfig);
 void releaseNodeConfig(NnNodeConfig *nodeConfig);
 
 void printNodeRequiredMemory(NnNetConfig *netConfig, NnNodeConfig *nodeConfig);
 
+// FNV-1a, the first call takes HASH_SEED
+#define HASH_SEED 0xCBF29CE484222325ull
+std::uint64_t hashBytes(std::uint64_t hash, const void *data, size_t size);
+// The same configs give the same fingerprint, it is never 0
+std::uint64_t getConfigFingerprint(NnNetConfig *netConfig, NnNodeConfig *nodeConfig);
+
 // slicers
 
-NnKvCacheSlice sliceKvCache(NnSize kvDim, NnSize seqLen, NnSize nNodes);
-NnRowMatmulSlice sliceRowMatmul(NnFloatType type, NnSize nNodes, NnSize n, NnSize d);
-NnColMatmulSlice sliceColMatmul(NnFloatType type, NnSize nNodes, NnSize n, NnSize d);
-NnRopeSlice sliceRope(NnSize dim, NnSize kvDim, NnSize nKvHeads, NnSize nNodes, NnSize seqLen, NnSize headSize, float ropeTheta, NnSize nodeIndex);
-NnMultiHeadAttSlice sliceMultiHeadAtt(NnSize nHeads, NnSize seqLen, NnSize nNodes);
+// With more nodes than KV heads, every KV head is held and computed by this many consecutive nodes
+NnSize getKvHeadReplicas(NnSize nKvHeads, NnSize nNodes);
+// Splits n into ranges of whole units, node i gets [starts[i], starts[i + 1]). The ranges follow the weights
+// of the nodes, nullptr weights give every node the same number of units.
+void splitNodeRanges(NnSize n, NnSize unit, NnSize nNodes, const float *weights, NnSize *starts);
+NnKvCacheSlice sliceKvCache(NnFloatType type, NnSize seqLen, NnSize kvDim0);
+// Rows [dStart, dStart + d0) of the d x n matrix
+NnRowMatmulSlice sliceRowMatmul(NnFloatType type, NnSize n, NnSize d, NnSize dStart, NnSize d0);
+// Columns [nStart, nStart + n0) of the d x n matrix
+NnColMatmulSlice sliceColMatmul(NnFloatType type, NnSize n, NnSize d, NnSize nStart, NnSize n0);
+// Query dims [qDimStart, qDimStart + qDim0) and KV dims [kvDimStart, kvDimStart + kvDim0) of a node
+NnRopeSlice sliceRope(NnSize dim, NnSize kvDim, NnSize nKvHeads, NnSize seqLen, NnSize headSize, float ropeTheta,
+    NnSize qDimStart, NnSize qDim0, NnSize kvDimStart, NnSize kvDim0);
+NnMultiHeadAttSlice sliceMultiHeadAtt(NnSize nHeads, NnSize seqLen, NnSize headSize, NnSize nHeads0);
 
 // splitters
 
-NnSize splitRowMatmulWeight(NnRowMatmulSlice *slice, NnSize nodeIndex, NnByte *weight, NnByte *weight0);
-NnSize splitColMatmulWeight(NnColMatmulSlice *slice, NnSize nodeIndex, NnByte *weight, NnByte *weight0);
+NnSize splitRowMatmulWeight(NnRowMatmulSlice *slice, NnByte *weight, NnByte *weight0);
+NnSize splitColMatmulWeight(NnColMatmulSlice *slice, NnByte *weight, NnByte *weight0);
 
 #endif
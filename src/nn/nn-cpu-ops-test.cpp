@@ -168,26 +168,6 @@ void testAdd(const NnSize m) {
     compare_F32("add_Q80_F32", y.data(), yTemp.data(), n, 0.01);
 }
 
-void testSoftmax() {
-    std::vector<float> y(8);
-    for (NnSize i = 0; i < 8; i++)
-        y[i] = i / 8.0f;
-
-    softmax_F32(y.data(), 8);
-
-    float expectedOutput[8] = {
-        0.077399f,
-        0.087780f,
-        0.099500f,
-        0.112761f,
-        0.127778f,
-        0.144793f,
-        0.164072f,
-        0.185917f
-    };
-    compare_F32("softmax_F32", y.data(), expectedOutput, 8, 0.001);
-}
-
 void testSilu() {
     std::vector<float> y(8);
     for (NnSize i = 0; i < 8; i++)
@@ -208,6 +188,178 @@ void testSilu() {
     compare_F32("silu_F32", y.data(), expectedOutput, 8, 0.001);
 }
 
+NnCpuPagedBuffer pagedBuffer(NnByte *data, std::vector<NnByte *> &pages, const NnSize rowBytes, const NnSize pageRows, const NnSize nRows) {
+    pages.resize(nRows / pageRows);
+    for (NnSize pageIndex = 0; pageIndex < pages.size(); pageIndex++)
+        pages[pageIndex] = &data[pageIndex * pageRows * rowBytes];
+    return NnCpuPagedBuffer{ rowBytes, pageRows, (NnSize)pages.size(), pages.data() };
+}
+
+void initAttInputs(std::vector<float> &q, std::vector<float> &k, std::vector<float> &v) {
+    for (NnSize i = 0; i < q.size(); i++)
+        q[i] = sinf(i * 0.37f);
+    for (NnSize i = 0; i < k.size(); i++) {
+        k[i] = cosf(i * 0.11f);
+        v[i] = sinf(i * 0.23f + 1.0f);
+    }
+}
+
+NnCpuPagedBuffer kvCache(const std::vector<float> &x, std::vector<NnByte> &data, std::vector<NnByte *> &pages,
+    const NnFloatType floatType, const NnSize kvDim, const NnSize pageRows) {
+    data.resize(getBytes(floatType, x.size()));
+    if (floatType == F_16)
+        quantizeF32toF16(x.data(), (NnFp16 *)data.data(), x.size(), 1, 0);
+    else if (floatType == F_Q80)
+        quantizeF32toQ80(x.data(), (NnBlockQ80 *)data.data(), x.size(), 1, 0);
+    else
+        std::memcpy(data.data(), x.data(), data.size());
+    return pagedBuffer(data.data(), pages, getBytes(floatType, kvDim), pageRows, x.size() / kvDim);
+}
+
+void testMultiheadAtt(const NnFloatType kvCacheType) {
+    const NnSize nHeads = 4;
+    const NnSize nKvHeads = 2;
+    const NnSize headSize = 64;
+    const NnSize seqLen = 8;
+    const NnSize kvDim = nKvHeads * headSize;
+    const NnSize pos = seqLen - 1;
+
+    std::vector<float> q(nHeads * headSize);
+    std::vector<float> k(seqLen * kvDim);
+    std::vector<float> v(seqLen * kvDim);
+    initAttInputs(q, k, v);
+
+    std::vector<float> y(nHeads * headSize);
+    std::vector<float> yTemp(nHeads * headSize);
+    NnByte *yRow = (NnByte *)y.data();
+    NnByte *yTempRow = (NnByte *)yTemp.data();
+    const float position = pos;
+    std::vector<NnByte *> kPages, vPages;
+    NnCpuPagedBuffer kCache = pagedBuffer((NnByte *)k.data(), kPages, getBytes(F_32, kvDim), seqLen, seqLen);
+    NnCpuPagedBuffer vCache = pagedBuffer((NnByte *)v.data(), vPages, getBytes(F_32, kvDim), seqLen, seqLen);
+    multiheadAtt(&yRow, q.data(), &position, 1, &kCache, &vCache, F_32,
+        nHeads, nHeads, nKvHeads, headSize, 1, 0);
+
+    std::vector<NnByte> kQ, vQ;
+    // Small pages, so rows are read through several block table entries
+    NnCpuPagedBuffer kQCache = kvCache(k, kQ, kPages, kvCacheType, kvDim, 2);
+    NnCpuPagedBuffer vQCache = kvCache(v, vQ, vPages, kvCacheType, kvDim, 2);
+    multiheadAtt(&yTempRow, q.data(), &position, 1, &kQCache, &vQCache, kvCacheType,
+        nHeads, nHeads, nKvHeads, headSize, 1, 0);
+
+    const char *name = kvCacheType == F_16 ? "multiheadAtt_F16" : "multiheadAtt_Q80";
+    compare_F32(name, y.data(), yTemp.data(), y.size(), kvCacheType == F_16 ? 0.001f : 0.02f);
+}
+
+// Reference for the single pass attention
+void softmax(float *x, const NnSize size) {
+    float maxVal = x[0];
+    for (NnSize i = 1; i < size; i++)
+        maxVal = std::max(maxVal, x[i]);
+    float sum = 0.0f;
+    for (NnSize i = 0; i < size; i++) {
+        x[i] = expf(x[i] - maxVal);
+        sum += x[i];
+    }
+    for (NnSize i = 0; i < size; i++)
+        x[i] /= sum;
+}
+
+void testMultiheadAttChunks() {
+    const NnSize nHeads = 2;
+    const NnSize nKvHeads = 1;
+    const NnSize headSize = 64;
+    const NnSize seqLen = 256;
+    const NnSize kvDim = nKvHeads * headSize;
+    const NnSize pos = 200;
+    const NnSize nThreads = 8;
+
+    std::vector<float> q(nHeads * headSize);
+    std::vector<float> k(seqLen * kvDim);
+    std::vector<float> v(seqLen * kvDim);
+    initAttInputs(q, k, v);
+
+    NnMultiHeadAttSlice slice = sliceMultiHeadAtt(nHeads, seqLen, headSize, nHeads);
+    std::vector<float> att(slice.attSize.length);
+    std::vector<float> y(nHeads * headSize);
+    std::vector<float> yTemp(nHeads * headSize);
+    NnByte *yTempRow = (NnByte *)yTemp.data();
+    const float position = pos;
+    std::vector<NnByte *> kPages, vPages;
+    NnCpuPagedBuffer kCache = pagedBuffer((NnByte *)k.data(), kPages, getBytes(F_32, kvDim), 16, seqLen);
+    NnCpuPagedBuffer vCache = pagedBuffer((NnByte *)v.data(), vPages, getBytes(F_32, kvDim), 16, seqLen);
+    multiheadAtt(&yTempRow, q.data(), &position, 1, &kCache, &vCache, F_32,
+        nHeads, nHeads, nKvHeads, headSize, 1, 0);
+
+    // The tiled single pass must match a softmax over the full score row
+    std::vector<float> scores(pos + 1);
+    for (NnSize h = 0; h < nHeads; h++) {
+        const NnSize kvOffset = (h / (nHeads / nKvHeads)) * headSize;
+        for (NnSize t = 0; t <= pos; t++)
+            scores[t] = dotProduct_F32(&q[h * headSize], &k[t * kvDim + kvOffset], headSize) / sqrtf(headSize);
+        softmax(scores.data(), pos + 1);
+        for (NnSize i = 0; i < headSize; i++) {
+            float sum = 0.0f;
+            for (NnSize t = 0; t <= pos; t++)
+                sum += scores[t] * v[t * kvDim + kvOffset + i];
+            y[h * headSize + i] = sum;
+        }
+    }
+    compare_F32("multiheadAtt_tiled", y.data(), yTemp.data(), y.size(), 0.0001f);
+
+    const NnSize nChunks = getAttChunks(1, pos, nHeads, slice.nMaxChunks, nThreads);
+    assert(nChunks == 4);
+    for (NnSize threadIndex = 0; threadIndex < nThreads; threadIndex++)
+        multiheadAttChunks(att.data(), q.data(), &kCache, &vCache, F_32,
+            pos, nHeads, nHeads, nKvHeads, headSize, nChunks, nThreads, threadIndex);
+    for (NnSize threadIndex = 0; threadIndex < nThreads; threadIndex++)
+        mergeAttChunks(yTemp.data(), att.data(), nHeads, headSize, nChunks, nThreads, threadIndex);
+
+    compare_F32("multiheadAttChunks", y.data(), yTemp.data(), y.size(), 0.0001f);
+}
+
+void testMultiheadAttBatch(const NnFloatType kvCacheType, const NnSize startPos, const char *name) {
+    const NnSize nHeads = 4;
+    const NnSize nKvHeads = 2;
+    const NnSize headSize = 64;
+    const NnSize seqLen = 128;
+    const NnSize kvDim = nKvHeads * headSize;
+    const NnSize qDim = nHeads * headSize;
+    const NnSize batchSize = 11;
+    const NnSize nThreads = 3;
+
+    std::vector<float> q(batchSize * qDim);
+    std::vector<float> k(seqLen * kvDim);
+    std::vector<float> v(seqLen * kvDim);
+    initAttInputs(q, k, v);
+    std::vector<NnByte> kQ, vQ;
+    std::vector<NnByte *> kPages, vPages;
+    NnCpuPagedBuffer kCache = kvCache(k, kQ, kPages, kvCacheType, kvDim, 16);
+    NnCpuPagedBuffer vCache = kvCache(v, vQ, vPages, kvCacheType, kvDim, 16);
+
+    // The batch spans two query tiles. From position 0 the rows end at different positions of the first key tile
+    std::vector<float> positions(batchSize);
+    for (NnSize b = 0; b < batchSize; b++)
+        positions[b] = startPos + b;
+
+    std::vector<float> y(batchSize * qDim);
+    std::vector<float> yTemp(batchSize * qDim);
+    std::vector<NnByte *> yRows(batchSize);
+    for (NnSize b = 0; b < batchSize; b++) {
+        yRows[b] = (NnByte *)&y[b * qDim];
+        multiheadAtt(&yRows[b], &q[b * qDim], &positions[b], 1, &kCache, &vCache, kvCacheType,
+            nHeads, nHeads, nKvHeads, headSize, 1, 0);
+    }
+
+    for (NnSize b = 0; b < batchSize; b++)
+        yRows[b] = (NnByte *)&yTemp[b * qDim];
+    for (NnSize threadIndex = 0; threadIndex < nThreads; threadIndex++)
+        multiheadAtt(yRows.data(), q.data(), positions.data(), batchSize, &kCache, &vCache, kvCacheType,
+            nHeads, nHeads, nKvHeads, headSize, nThreads, threadIndex);
+
+    compare_F32(name, y.data(), yTemp.data(), y.size(), 0.00001f);
+}
+
 // matmul
 void testMatmul_F32_Q40_F32(const NnSize m = 2) {
     const NnSize n = Q80_BLOCK_SIZE * m;
@@ -296,8 +448,14 @@ int main() {
     testAdd(32);
     testAdd(2);
     testAdd(1);
-    testSoftmax();
     testSilu();
+    testMultiheadAtt(F_16);
+    testMultiheadAtt(F_Q80);
+    testMultiheadAttChunks();
+    testMultiheadAttBatch(F_32, 90, "multiheadAttBatch_F32");
+    testMultiheadAttBatch(F_16, 90, "multiheadAttBatch_F16");
+    testMultiheadAttBatch(F_Q80, 90, "multiheadAttBatch_Q80");
+    testMultiheadAttBatch(F_32, 0, "multiheadAttBatch_F32_pos0");
     testMatmul_F32_Q40_F32(32);
     testMatmul_F32_Q40_F32(2);
     testMatmul_F32_Q40_F32(1);
@@ -1,10 +1,12 @@
 #ifdef _WIN32
     #define _USE_MATH_DEFINES
 #endif
+#include <algorithm>
 #include <cmath>
 #include <cassert>
 #include <cstring>
 #include <cstdio>
+#include <stdexcept>
 #if defined(__ARM_NEON)
     #include <arm_neon.h>
 #elif defined(__AVX2__) || defined(__AVX512F__)
@@ -16,6 +18,11 @@
 
 #define DEBUG_OP_INPUT_OUTPUT false
 
+// Positions whose scores are kept at once by the single pass attention
+#define ATT_TILE_LEN 32
+// Batch rows whose queries are attended together during the prefill
+#define ATT_QUERY_TILE_LEN 8
+
 #if DEBUG_OP_INPUT_OUTPUT
     #define DEBUG_VECTOR(context, suffix, vec) \
         if (threadIndex == 0) \
@@ -73,15 +80,6 @@ static inline float horizontalSum_avx2(const __m256 x) {
     return _mm_cvtss_f32(res);
 }
 
-static inline float horizontalMax_avx2(__m256 v) {
-    __m128 v_low = _mm256_castps256_ps128(v);
-    __m128 v_high = _mm256_extractf128_ps(v, 1);
-    __m128 max128 = _mm_max_ps(v_low, v_high);
-    __m128 max64 = _mm_max_ps(max128, _mm_movehl_ps(max128, max128));
-    __m128 max32 = _mm_max_ss(max64, _mm_shuffle_ps(max64, max64, _MM_SHUFFLE(1, 1, 1, 1)));
-    return _mm_cvtss_f32(max32);
-}
-
 static inline __m256 expf_avx2(__m256 x) {
     const __m256 log2e = _mm256_set1_ps(1.4426950408889634f);
     const __m256 c0 = _mm256_set1_ps(1.0f);
@@ -586,138 +584,6 @@ static void add_Q80_F32(float *y, const NnBlockQ80 *x, const NnSize n, const NnS
 #endif
 }
 
-static void softmax_F32(float *x, const NnSize size) {
-    if (size == 0)
-        return;
-
-#if defined(__ARM_NEON)
-    NnSize j;
-    float maxVal;
-    if (size >= 4) {
-        float32x4_t fs;
-        float32x4_t fmaxv = vld1q_f32(&x[0]);
-        j = size - (size % 4);
-        for (NnSize i = 4; i < j; i += 4) {
-            fs = vld1q_f32(&x[i]);
-            fmaxv = vmaxq_f32(fmaxv, fs);
-        }
-        maxVal = vmaxvq_f32(fmaxv);
-    } else {
-        maxVal = x[0];
-        j = 1;
-    }
-    for (; j < size; j++)
-        maxVal = fmaxf(maxVal, x[j]);
-
-    const float32x4_t maxVal_vec = vdupq_n_f32(maxVal);
-    float32x4_t sumv = vdupq_n_f32(0.0f);
-    NnSize i = 0;
-    for (; i + 4 <= size; i += 4) {
-        float32x4_t val = vld1q_f32(x + i);
-        val = vsubq_f32(val, maxVal_vec);
-        val = expf_neon(val);
-        vst1q_f32(x + i, val);
-        sumv = vaddq_f32(sumv, val);
-    }
-
-    float32x2_t sum_lo = vadd_f32(vget_low_f32(sumv), vget_high_f32(sumv));
-    float sum = vget_lane_f32(sum_lo, 0) + vget_lane_f32(sum_lo, 1);
-
-    for (; i < size; i++) {
-        x[i] = expf(x[i] - maxVal);
-        sum += x[i];
-    }
-
-    if (sum == 0.0f)
-        sum = 0.000001f;
-
-    const float inv_sum = 1.0f / sum;
-    const float32x4_t inv_sum_vec = vdupq_n_f32(inv_sum);
-
-    i = 0;
-    for (; i + 4 <= size; i += 4) {
-        float32x4_t val = vld1q_f32(x + i);
-        val = vmulq_f32(val, inv_sum_vec);
-        vst1q_f32(x + i, val);
-    }
-    for (; i < size; ++i)
-        x[i] /= sum;
-#elif defined(__AVX2__)
-    float maxVal;
-    const unsigned avxEnd = size - (size % 8);
-    NnSize i = 0;
-
-    if (avxEnd >= 8) {
-        __m256 max_vec = _mm256_loadu_ps(x);
-        for (; i < avxEnd; i += 8) {
-            __m256 vec = _mm256_loadu_ps(&x[i]);
-            max_vec = _mm256_max_ps(max_vec, vec);
-        }
-        maxVal = horizontalMax_avx2(max_vec);
-
-        for (; i < size; ++i) {
-            if (x[i] > maxVal)
-                maxVal = x[i];
-        }
-    } else {
-        maxVal = x[0];
-        i = 1;
-    }
-    for (; i < size; ++i) {
-        if (x[i] > maxVal)
-            maxVal = x[i];
-    }
-
-    __m256 max_val_vec = _mm256_set1_ps(maxVal);
-    __m256 sum_vec = _mm256_setzero_ps();
-    float sum = 0.0f;
-    
-    i = 0;
-    for (; i < avxEnd; i += 8) {
-        __m256 vec = _mm256_loadu_ps(&x[i]);
-        vec = _mm256_sub_ps(vec, max_val_vec);
-        vec = expf_avx2(vec);
-        _mm256_storeu_ps(&x[i], vec);
-        sum_vec = _mm256_add_ps(sum_vec, vec);
-    }
-    sum = horizontalSum_avx2(sum_vec);
-    for (; i < size; ++i) {
-        x[i] = expf(x[i] - maxVal);
-        sum += x[i];
-    }
-
-    if (sum == 0.0)
-        sum = 0.000001;
-
-    const float inv_sum = 1.0f / sum;
-    const __m256 inv_sum_vec = _mm256_set1_ps(inv_sum);
-
-    i = 0;
-    for (; i < avxEnd; i += 8) {
-        __m256 vec = _mm256_loadu_ps(x + i);
-        vec = _mm256_mul_ps(vec, inv_sum_vec);
-        _mm256_storeu_ps(x + i, vec);
-    }
-    for (; i < size; i++)
-        x[i] *= inv_sum;
-#else
-    float maxVal = x[0];
-    for (NnSize i = 1; i < size; i++) {
-        if (x[i] > maxVal)
-            maxVal = x[i];
-    }
-    float sum = 0.0f;
-    for (NnSize i = 0; i < size; i++) {
-        x[i] = expf(x[i] - maxVal);
-        sum += x[i];
-    }
-    if (sum == 0.0)
-        sum = 0.000001;
-    for (NnSize i = 0; i < size; i++)
-        x[i] /= sum;
-#endif
-}
-
 static float dotProduct_F32(const float *a, const float *b, const unsigned int size) {
 #if defined(__ARM_NEON)
     assert(size % 4 == 0);
@@ -749,39 +615,333 @@ static float dotProduct_F32(const float *a, const float *b, const unsigned int s
 #endif
 }
 
-static void multiheadAtt_F32(
-    float *x, const float *q, float *att, float *keyCache, float *valueCache,
-    const unsigned pos, const NnSize nHeads, const NnSize nHeads0, const NnSize nKvHeads, const NnSize kvDim0, const NnSize headSize, const NnSize seqLen,
-    const NnSize nThreads, const NnSize threadIndex) 
+static float dotProduct_F32_F16(const float *a, const NnFp16 *b, const NnSize size) {
+    NnSize i = 0;
+    float sum = 0.0f;
+#if defined(__AVX2__) && defined(__F16C__)
+    __m256 u = _mm256_setzero_ps();
+    for (; i + 8 <= size; i += 8) {
+        const __m256 a0 = _mm256_loadu_ps(&a[i]);
+        const __m256 b0 = _mm256_cvtph_ps(_mm_loadu_si128((const __m128i *)&b[i]));
+        u = _mm256_fmadd_ps(a0, b0, u);
+    }
+    sum = horizontalSum_avx2(u);
+#endif
+    for (; i < size; i++)
+        sum += a[i] * CONVERT_F16_TO_F32(b[i]);
+    return sum;
+}
+
+static float dotProduct_F32_Q80(const float *a, const NnBlockQ80 *b, const NnSize size) {
+    assert(size % Q80_BLOCK_SIZE == 0);
+    const NnSize nBlocks = size / Q80_BLOCK_SIZE;
+#if defined(__AVX2__)
+    __m256 u = _mm256_setzero_ps();
+    for (NnSize i = 0; i < nBlocks; i++) {
+        const NnBlockQ80 *block = &b[i];
+        const float *ai = &a[i * Q80_BLOCK_SIZE];
+        __m256 s = _mm256_setzero_ps();
+        for (NnSize j = 0; j < Q80_BLOCK_SIZE; j += 8) {
+            const __m256 b0 = _mm256_cvtepi32_ps(_mm256_cvtepi8_epi32(_mm_loadl_epi64((const __m128i *)&block->qs[j])));
+            s = _mm256_fmadd_ps(_mm256_loadu_ps(&ai[j]), b0, s);
+        }
+        u = _mm256_fmadd_ps(s, _mm256_set1_ps(CONVERT_F16_TO_F32(block->d)), u);
+    }
+    return horizontalSum_avx2(u);
+#else
+    float sum = 0.0f;
+    for (NnSize i = 0; i < nBlocks; i++) {
+        const NnBlockQ80 *block = &b[i];
+        const float *ai = &a[i * Q80_BLOCK_SIZE];
+        float s = 0.0f;
+        for (NnSize j = 0; j < Q80_BLOCK_SIZE; j++)
+            s += ai[j] * block->qs[j];
+        sum += s * CONVERT_F16_TO_F32(block->d);
+    }
+    return sum;
+#endif
+}
+
+static void addScaled_F32(float *y, const float *x, const float a, const NnSize size) {
+    NnSize i = 0;
+#if defined(__ARM_NEON)
+    const float32x4_t a0 = vdupq_n_f32(a);
+    for (; i + 4 <= size; i += 4)
+        vst1q_f32(&y[i], vfmaq_f32(vld1q_f32(&y[i]), a0, vld1q_f32(&x[i])));
+#elif defined(__AVX2__)
+    const __m256 a0 = _mm256_set1_ps(a);
+    for (; i + 8 <= size; i += 8)
+        _mm256_storeu_ps(&y[i], _mm256_fmadd_ps(a0, _mm256_loadu_ps(&x[i]), _mm256_loadu_ps(&y[i])));
+#endif
+    for (; i < size; i++)
+        y[i] += a * x[i];
+}
+
+static void addScaled_F16(float *y, const NnFp16 *x, const float a, const NnSize size) {
+    NnSize i = 0;
+#if defined(__ARM_NEON) && defined(__ARM_FP16_FORMAT_IEEE)
+    const float32x4_t a0 = vdupq_n_f32(a);
+    for (; i + 4 <= size; i += 4) {
+        const float32x4_t x0 = vcvt_f32_f16(vreinterpret_f16_u16(vld1_u16(&x[i])));
+        vst1q_f32(&y[i], vfmaq_f32(vld1q_f32(&y[i]), a0, x0));
+    }
+#elif defined(__AVX2__) && defined(__F16C__)
+    const __m256 a0 = _mm256_set1_ps(a);
+    for (; i + 8 <= size; i += 8) {
+        const __m256 x0 = _mm256_cvtph_ps(_mm_loadu_si128((const __m128i *)&x[i]));
+        _mm256_storeu_ps(&y[i], _mm256_fmadd_ps(a0, x0, _mm256_loadu_ps(&y[i])));
+    }
+#endif
+    for (; i < size; i++)
+        y[i] += a * CONVERT_F16_TO_F32(x[i]);
+}
+
+static void addScaled_Q80(float *y, const NnBlockQ80 *x, const float a, const NnSize size) {
+    assert(size % Q80_BLOCK_SIZE == 0);
+    const NnSize nBlocks = size / Q80_BLOCK_SIZE;
+    for (NnSize i = 0; i < nBlocks; i++) {
+        const NnBlockQ80 *block = &x[i];
+        float *yi = &y[i * Q80_BLOCK_SIZE];
+        const float ad = a * CONVERT_F16_TO_F32(block->d);
+#if defined(__ARM_NEON)
+        const float32x4_t ad0 = vdupq_n_f32(ad);
+        for (NnSize j = 0; j < Q80_BLOCK_SIZE; j += 8) {
+            const int16x8_t q16 = vmovl_s8(vld1_s8(&block->qs[j]));
+            const float32x4_t x0 = vcvtq_f32_s32(vmovl_s16(vget_low_s16(q16)));
+            const float32x4_t x1 = vcvtq_f32_s32(vmovl_s16(vget_high_s16(q16)));
+            vst1q_f32(&yi[j], vfmaq_f32(vld1q_f32(&yi[j]), ad0, x0));
+            vst1q_f32(&yi[j + 4], vfmaq_f32(vld1q_f32(&yi[j + 4]), ad0, x1));
+        }
+#elif defined(__AVX2__)
+        const __m256 ad0 = _mm256_set1_ps(ad);
+        for (NnSize j = 0; j < Q80_BLOCK_SIZE; j += 8) {
+            const __m256 x0 = _mm256_cvtepi32_ps(_mm256_cvtepi8_epi32(_mm_loadl_epi64((const __m128i *)&block->qs[j])));
+            _mm256_storeu_ps(&yi[j], _mm256_fmadd_ps(ad0, x0, _mm256_loadu_ps(&yi[j])));
+        }
+#else
+        for (NnSize j = 0; j < Q80_BLOCK_SIZE; j++)
+            yi[j] += ad * block->qs[j];
+#endif
+    }
+}
+
+static void scale_F32(float *y, const float a, const NnSize size) {
+    NnSize i = 0;
+#if defined(__ARM_NEON)
+    const float32x4_t a0 = vdupq_n_f32(a);
+    for (; i + 4 <= size; i += 4)
+        vst1q_f32(&y[i], vmulq_f32(vld1q_f32(&y[i]), a0));
+#elif defined(__AVX2__)
+    const __m256 a0 = _mm256_set1_ps(a);
+    for (; i + 8 <= size; i += 8)
+        _mm256_storeu_ps(&y[i], _mm256_mul_ps(_mm256_loadu_ps(&y[i]), a0));
+#endif
+    for (; i < size; i++)
+        y[i] *= a;
+}
+
+// Replaces x by exp(x - maxVal) and returns the sum
+static float expSum_F32(float *x, const NnSize size, const float maxVal) {
+    NnSize i = 0;
+    float sum = 0.0f;
+#if defined(__ARM_NEON)
+    const float32x4_t max0 = vdupq_n_f32(maxVal);
+    float32x4_t sum0 = vdupq_n_f32(0.0f);
+    for (; i + 4 <= size; i += 4) {
+        const float32x4_t e = expf_neon(vsubq_f32(vld1q_f32(&x[i]), max0));
+        vst1q_f32(&x[i], e);
+        sum0 = vaddq_f32(sum0, e);
+    }
+    sum = vaddvq_f32(sum0);
+#elif defined(__AVX2__)
+    const __m256 max0 = _mm256_set1_ps(maxVal);
+    __m256 sum0 = _mm256_setzero_ps();
+    for (; i + 8 <= size; i += 8) {
+        const __m256 e = expf_avx2(_mm256_sub_ps(_mm256_loadu_ps(&x[i]), max0));
+        _mm256_storeu_ps(&x[i], e);
+        sum0 = _mm256_add_ps(sum0, e);
+    }
+    sum = horizontalSum_avx2(sum0);
+#endif
+    for (; i < size; i++) {
+        x[i] = expf(x[i] - maxVal);
+        sum += x[i];
+    }
+    return sum;
+}
+
+// Attends one head of up to ATT_QUERY_TILE_LEN query rows to the positions [tStart, tEnds[r]) in a single pass.
+// Scores are computed for a tile of ATT_TILE_LEN positions at a time, so every key and value row is loaded
+// once for all query rows, positions after the end of a row are masked out (causal mask). The running max
+// rescales what was accumulated so far (online softmax). hX receives the output not divided by the sum of
+// exponents, maxScores and sums the max score and the sum of every row.
+static void attendHeadRows(
+    float *const *hX, float *maxScores, float *sums, const float *const *hQ, const NnSize *tEnds, const NnSize nRows,
+    const NnCpuPagedBuffer *keyCache, const NnCpuPagedBuffer *valueCache, const NnFloatType kvCacheType,
+    const NnSize headBytes, const NnSize headSize, const NnSize tStart)
 {
-    SPLIT_THREADS(h0Start, h0End, nHeads0, nThreads, threadIndex);
-    const NnSize kvMul = nHeads / nKvHeads;
+    assert(nRows <= ATT_QUERY_TILE_LEN);
     const float headSizeRoot = sqrtf(headSize);
+    float scores[ATT_QUERY_TILE_LEN][ATT_TILE_LEN];
+    NnSize tEnd = tStart;
+    for (NnSize r = 0; r < nRows; r++) {
+        maxScores[r] = -INFINITY;
+        sums[r] = 0.0f;
+        std::memset(hX[r], 0, headSize * sizeof(float));
+        tEnd = std::max(tEnd, tEnds[r]);
+    }
+
+    for (NnSize tileStart = tStart; tileStart < tEnd; tileStart += ATT_TILE_LEN) {
+        const NnSize tileLen = std::min((NnSize)ATT_TILE_LEN, tEnd - tileStart);
+
+        // Q·Kᵀ
+        for (NnSize i = 0; i < tileLen; i++) {
+            const NnSize t = tileStart + i;
+            const NnByte *posK = &getPagedRow(keyCache, t)[headBytes];
+            for (NnSize r = 0; r < nRows; r++) {
+                if (t >= tEnds[r])
+                    continue;
+                float score;
+                if (kvCacheType == F_16)
+                    score = dotProduct_F32_F16(hQ[r], (const NnFp16 *)posK, headSize);
+                else if (kvCacheType == F_Q80)
+                    score = dotProduct_F32_Q80(hQ[r], (const NnBlockQ80 *)posK, headSize);
+                else
+                    score = dotProduct_F32(hQ[r], (const float *)posK, headSize);
+                scores[r][i] = score / headSizeRoot;
+            }
+        }
 
-    for (NnSize h0 = h0Start; h0 < h0End; h0++) {
-        const float *hQ = &q[h0 * headSize];
+        for (NnSize r = 0; r < nRows; r++) {
+            if (tileStart >= tEnds[r])
+                continue;
+            const NnSize rowLen = std::min(tileLen, tEnds[r] - tileStart);
+            float tileMax = maxScores[r];
+            for (NnSize i = 0; i < rowLen; i++) {
+                if (scores[r][i] > tileMax)
+                    tileMax = scores[r][i];
+            }
+            if (tileMax > maxScores[r]) {
+                if (tileStart != tStart) {
+                    const float correction = expf(maxScores[r] - tileMax);
+                    sums[r] *= correction;
+                    scale_F32(hX[r], correction, headSize);
+                }
+                maxScores[r] = tileMax;
+            }
+            sums[r] += expSum_F32(scores[r], rowLen, maxScores[r]);
+        }
+
+        // P·V
+        for (NnSize i = 0; i < tileLen; i++) {
+            const NnSize t = tileStart + i;
+            const NnByte *posV = &getPagedRow(valueCache, t)[headBytes];
+            for (NnSize r = 0; r < nRows; r++) {
+                if (t >= tEnds[r])
+                    continue;
+                if (kvCacheType == F_16)
+                    addScaled_F16(hX[r], (const NnFp16 *)posV, scores[r][i], headSize);
+                else if (kvCacheType == F_Q80)
+                    addScaled_Q80(hX[r], (const NnBlockQ80 *)posV, scores[r][i], headSize);
+                else
+                    addScaled_F32(hX[r], (const float *)posV, scores[r][i], headSize);
+            }
+        }
+    }
+}
+
+static void multiheadAtt(
+    NnByte **x, const float *q, const float *positions, const NnSize batchSize,
+    const NnCpuPagedBuffer *keyCache, const NnCpuPagedBuffer *valueCache, const NnFloatType kvCacheType,
+    const NnSize nHeads, const NnSize nHeads0, const NnSize nKvHeads, const NnSize headSize,
+    const NnSize nThreads, const NnSize threadIndex) 
+{
+    // During the prefill the rows of the batch are processed in query tiles, every item is a (head, query tile) pair
+    const NnSize nQueryTiles = (batchSize + ATT_QUERY_TILE_LEN - 1) / ATT_QUERY_TILE_LEN;
+    SPLIT_THREADS(itemStart, itemEnd, nHeads0 * nQueryTiles, nThreads, threadIndex);
+    const NnSize kvMul = nHeads / nKvHeads;
+    const NnSize qDim0 = nHeads0 * headSize;
+    float *hX[ATT_QUERY_TILE_LEN];
+    const float *hQ[ATT_QUERY_TILE_LEN];
+    NnSize tEnds[ATT_QUERY_TILE_LEN];
+    float maxScores[ATT_QUERY_TILE_LEN];
+    float sums[ATT_QUERY_TILE_LEN];
+
+    for (NnSize item = itemStart; item < itemEnd; item++) {
+        const NnSize h0 = item / nQueryTiles;
+        const NnSize rowStart = (item % nQueryTiles) * ATT_QUERY_TILE_LEN;
+        const NnSize nRows = std::min((NnSize)ATT_QUERY_TILE_LEN, batchSize - rowStart);
         const NnSize headIndex = h0 / kvMul;
-        const float *hKc = &keyCache[headIndex * headSize];
-        const float *hVc = &valueCache[headIndex * headSize];
-        float *hAtt = &att[h0 * seqLen];
-
-        for (NnSize t = 0; t <= pos; t++) {
-            const float *posK = &hKc[t * kvDim0];
-            const float score = dotProduct_F32(hQ, posK, headSize) / headSizeRoot;
-            hAtt[t] = score;
+        const NnSize headBytes = getBytes(kvCacheType, headIndex * headSize);
+        for (NnSize r = 0; r < nRows; r++) {
+            const NnSize batchIndex = rowStart + r;
+            hX[r] = &((float *)x[batchIndex])[h0 * headSize];
+            hQ[r] = &q[batchIndex * qDim0 + h0 * headSize];
+            tEnds[r] = (NnSize)positions[batchIndex] + 1;
         }
 
-        softmax_F32(hAtt, pos + 1);
+        attendHeadRows(hX, maxScores, sums, hQ, tEnds, nRows, keyCache, valueCache, kvCacheType, headBytes, headSize, 0);
+        for (NnSize r = 0; r < nRows; r++)
+            scale_F32(hX[r], 1.0f / sums[r], headSize);
+    }
+}
+
+static NnSize getAttChunks(const NnSize batchSize, const unsigned pos, const NnSize nHeads0, const NnSize nMaxChunks, const NnSize nThreads) {
+    // Only the decode (a single token) leaves threads idle, a batch keeps them busy anyway
+    if (batchSize != 1 || nHeads0 >= nThreads)
+        return 1;
+    const NnSize nThreadChunks = (nThreads + nHeads0 - 1) / nHeads0;
+    const NnSize nPosChunks = (pos + ATT_MIN_CHUNK_LEN) / ATT_MIN_CHUNK_LEN;
+    return std::min(std::min(nThreadChunks, nPosChunks), nMaxChunks);
+}
+
+static void multiheadAttChunks(
+    float *att, const float *q, const NnCpuPagedBuffer *keyCache, const NnCpuPagedBuffer *valueCache, const NnFloatType kvCacheType,
+    const unsigned pos, const NnSize nHeads, const NnSize nHeads0, const NnSize nKvHeads, const NnSize headSize,
+    const NnSize nChunks, const NnSize nThreads, const NnSize threadIndex)
+{
+    // Every (head, chunk) item produces the max score, the sum of exponents and the unnormalized output
+    // of its position range, the final softmax is applied by mergeAttChunks
+    SPLIT_THREADS(itemStart, itemEnd, nHeads0 * nChunks, nThreads, threadIndex);
+    const NnSize kvMul = nHeads / nKvHeads;
+    const NnSize nPos = pos + 1;
+
+    for (NnSize item = itemStart; item < itemEnd; item++) {
+        const NnSize h0 = item / nChunks;
+        const NnSize chunkIndex = item % nChunks;
+        const NnSize headIndex = h0 / kvMul;
+        const NnSize headBytes = getBytes(kvCacheType, headIndex * headSize);
+        float *partial = &att[item * (headSize + 2)];
+        float *hX = &partial[2];
+        const float *hQ = &q[h0 * headSize];
+        const NnSize tEnd = (nPos * (chunkIndex + 1)) / nChunks;
+        attendHeadRows(&hX, &partial[0], &partial[1], &hQ, &tEnd, 1, keyCache, valueCache, kvCacheType,
+            headBytes, headSize, (nPos * chunkIndex) / nChunks);
+    }
+}
+
+static void mergeAttChunks(
+    float *x, const float *att, const NnSize nHeads0, const NnSize headSize,
+    const NnSize nChunks, const NnSize nThreads, const NnSize threadIndex)
+{
+    SPLIT_THREADS(h0Start, h0End, nHeads0, nThreads, threadIndex);
+
+    for (NnSize h0 = h0Start; h0 < h0End; h0++) {
+        const float *hPartials = &att[h0 * nChunks * (headSize + 2)];
+        float maxScore = -INFINITY;
+        for (NnSize chunkIndex = 0; chunkIndex < nChunks; chunkIndex++)
+            maxScore = std::max(maxScore, hPartials[chunkIndex * (headSize + 2)]);
+        float sum = 0.0f;
+        for (NnSize chunkIndex = 0; chunkIndex < nChunks; chunkIndex++) {
+            const float *partial = &hPartials[chunkIndex * (headSize + 2)];
+            sum += partial[1] * expf(partial[0] - maxScore);
+        }
 
         float *hX = &x[h0 * headSize];
         std::memset(hX, 0, headSize * sizeof(float));
-
-        for (NnSize t = 0; t <= pos; t++) {
-            const float *posV = &hVc[t * kvDim0];
-            const float posA = hAtt[t];
-            for (int i = 0; i < headSize; i++) {
-                hX[i] += posA * posV[i];
-            }
+        for (NnSize chunkIndex = 0; chunkIndex < nChunks; chunkIndex++) {
+            const float *partial = &hPartials[chunkIndex * (headSize + 2)];
+            addScaled_F32(hX, &partial[2], expf(partial[0] - maxScore) / sum, headSize);
         }
     }
 }
@@ -1165,30 +1325,62 @@ static void initMultiHeadAttForward(NnCpuOpContext *context) {
     NnSize2D *posSize = &context->pipeConfigs[config->positionPipeIndex].size;
     ASSERT_EQ(posSize->x, 1);
     ASSERT_EQ(posSize->y, context->nBatches);
+    assert(context->pagedBuffers[config->keyCacheBufferIndex] != nullptr);
+    assert(context->pagedBuffers[config->valueCacheBufferIndex] != nullptr);
+    NnSize2D *keySize = &context->bufferConfigs[config->keyCacheBufferIndex].size;
+    NnSize2D *valueSize = &context->bufferConfigs[config->valueCacheBufferIndex].size;
+    ASSERT_EQ(keySize->floatType, valueSize->floatType);
+    if (keySize->floatType != F_32 && keySize->floatType != F_16 && keySize->floatType != F_Q80)
+        throw std::invalid_argument("Unsupported kv cache type");
+    if (keySize->floatType == F_Q80) {
+        ASSERT_EQ(config->headSize % Q80_BLOCK_SIZE, 0);
+    }
 }
 
 static void multiHeadAttForward_F32_F32(NnSize nThreads, NnSize threadIndex, NnSize batchSize, NnCpuOpContext *context) {
     const NnMultiHeadAttOpConfig *config = (NnMultiHeadAttOpConfig *)context->opConfig;
 
     float *query = (float *)context->buffers[config->queryBufferIndex];
-    float *keyCache = (float *)context->buffers[config->keyCacheBufferIndex];
-    float *valueCache = (float *)context->buffers[config->valueCacheBufferIndex];
+    const NnCpuPagedBuffer *keyCache = context->pagedBuffers[config->keyCacheBufferIndex];
+    const NnCpuPagedBuffer *valueCache = context->pagedBuffers[config->valueCacheBufferIndex];
+    const NnFloatType kvCacheType = context->bufferConfigs[config->keyCacheBufferIndex].size.floatType;
     float *att = (float *)context->buffers[config->attBufferIndex];
     const float *positions = (float *)context->pipes[config->positionPipeIndex];
+    const NnMultiHeadAttSlice *slice = &config->multiHeadAttSlice;
+
+    const NnSize nChunks = getAttChunks(batchSize, (NnSize)positions[0], slice->nHeads0, slice->nMaxChunks, nThreads);
+    if (nChunks > 1) {
+        assert((NnSize)positions[0] < config->seqLen);
+        // Split-K: the position range is split over threads, OP_MULTIHEAD_ATT_MERGE produces the output
+        multiheadAttChunks(att, query, keyCache, valueCache, kvCacheType, (NnSize)positions[0],
+            slice->nHeads, slice->nHeads0, config->nKvHeads, config->headSize, nChunks, nThreads, threadIndex);
+        return;
+    }
 
     for (NnSize batchIndex = 0; batchIndex < batchSize; batchIndex++) {
-        float *i = (float *)context->input[batchIndex];
-        float *q = &query[batchIndex * config->qSlice.d0];
-        NnSize pos = (NnSize)positions[batchIndex];
-        assert(pos < config->seqLen);
+        assert((NnSize)positions[batchIndex] < config->seqLen);
+        #if DEBUG_OP_INPUT_OUTPUT
+            float *i = (float *)context->input[batchIndex];
+            float *q = &query[batchIndex * config->qSlice.d0];
+            DEBUG_VECTOR(context, "input", i);
+            DEBUG_VECTOR(context, "q", q);
+        #endif
+    }
+
+    multiheadAtt(context->input, query, positions, batchSize, keyCache, valueCache, kvCacheType,
+        slice->nHeads, slice->nHeads0, config->nKvHeads, config->headSize, nThreads, threadIndex);
+}
 
-        DEBUG_VECTOR(context, "input", i);
-        DEBUG_VECTOR(context, "q", q);
+static void multiHeadAttMergeForward_F32_F32(NnSize nThreads, NnSize threadIndex, NnSize batchSize, NnCpuOpContext *context) {
+    const NnMultiHeadAttOpConfig *config = (NnMultiHeadAttOpConfig *)context->opConfig;
+    const NnMultiHeadAttSlice *slice = &config->multiHeadAttSlice;
+    const float *att = (float *)context->buffers[config->attBufferIndex];
+    const float *positions = (float *)context->pipes[config->positionPipeIndex];
 
-        multiheadAtt_F32(i, q, att, keyCache, valueCache, pos,
-            config->multiHeadAttSlice.nHeads, config->multiHeadAttSlice.nHeads0,
-            config->nKvHeads, config->kvCacheSlice.kvDim0, config->headSize, config->seqLen, nThreads, threadIndex);
-    }
+    const NnSize nChunks = getAttChunks(batchSize, (NnSize)positions[0], slice->nHeads0, slice->nMaxChunks, nThreads);
+    if (nChunks == 1)
+        return; // OP_MULTIHEAD_ATT has already written the output
+    mergeAttChunks((float *)context->output[0], att, slice->nHeads0, config->headSize, nChunks, nThreads, threadIndex);
 }
 
 static void mulForward_F32_F32(NnSize nThreads, NnSize threadIndex, NnSize batchSize, NnCpuOpContext *context) {
@@ -1255,6 +1447,22 @@ static void castForward_F32_Q80(NnSize nThreads, NnSize threadIndex, NnSize batc
     }
 }
 
+static void castForward_F32_F16(NnSize nThreads, NnSize threadIndex, NnSize batchSize, NnCpuOpContext *context) {
+    ASSERT_EQ(context->inputSize.floatType, F_32);
+    ASSERT_EQ(context->outputSize.floatType, F_16);
+
+    for (NnSize batchIndex = 0; batchIndex < batchSize; batchIndex++) {
+        float *input = (float *)context->input[batchIndex];
+        NnFp16 *output = (NnFp16 *)context->output[batchIndex];
+        quantizeF32toF16(
+            input,
+            output,
+            context->outputSize.x,
+            nThreads,
+            threadIndex);
+    }
+}
+
 static void castForward_Q80_F32(NnSize nThreads, NnSize threadIndex, NnSize batchSize, NnCpuOpContext *context) {
     ASSERT_EQ(context->inputSize.floatType, F_Q80);
     ASSERT_EQ(context->outputSize.floatType, F_32);
@@ -1300,7 +1508,7 @@ NnCpuOpForwardInit getCpuOpForwardInit(NnOpCode code, NnOpQuantType quantType) {
         return initRmsNormForward_ANY_F32_F32;
     if (code == OP_ROPE_LLAMA)
         return initRopeLlama31Forward;
-    if (code == OP_MULTIHEAD_ATT)
+    if (code == OP_MULTIHEAD_ATT || code == OP_MULTIHEAD_ATT_MERGE)
         return initMultiHeadAttForward;
     if (code == OP_MATMUL)
         return initMatmulForward;
@@ -1335,6 +1543,9 @@ NnCpuOpForward getCpuOpForward(NnOpCode code, NnOpQuantType quantType) {
     if (code == OP_MULTIHEAD_ATT) {
         if (quantType == F32_F32_F32) return multiHeadAttForward_F32_F32;
     }
+    if (code == OP_MULTIHEAD_ATT_MERGE) {
+        if (quantType == F32_F32_F32) return multiHeadAttMergeForward_F32_F32;
+    }
     if (code == OP_GELU) {
         if (quantType == F32_F32_F32) return geluForward_F32_F32_F32;
     }
@@ -1348,6 +1559,7 @@ NnCpuOpForward getCpuOpForward(NnOpCode code, NnOpQuantType quantType) {
     if (code == OP_CAST) {
         if (quantType == F32_F32_F32) return castForward_ANY;
         if (quantType == F32_F32_Q80) return castForward_F32_Q80;
+        if (quantType == F32_F32_F16) return castForward_F32_F16;
         if (quantType == Q80_Q80_Q80) return castForward_ANY;
         if (quantType == Q80_Q80_F32) return castForward_Q80_F32;
     }
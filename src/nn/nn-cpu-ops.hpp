@@ -9,11 +9,23 @@
         exit(-1); \
     }
 
+typedef struct {
+    NnSize rowBytes;
+    NnSize pageRows;
+    NnSize nPages;
+    NnByte **pages; // block table, a page is nullptr until a row inside it is written
+} NnCpuPagedBuffer;
+
+inline NnByte *getPagedRow(const NnCpuPagedBuffer *buffer, const NnSize row) {
+    return &buffer->pages[row / buffer->pageRows][(row % buffer->pageRows) * buffer->rowBytes];
+}
+
 typedef struct {
     const char *name;
     NnByte nBatches;
     NnByte *bufferFlags;
-    NnByte **buffers;
+    NnByte **buffers; // nullptr for paged buffers
+    NnCpuPagedBuffer **pagedBuffers; // nullptr for contiguous buffers
     NnBufferConfig *bufferConfigs;
     NnByte **pipes;
     NnPipeConfig *pipeConfigs;
@@ -1,8 +1,12 @@
 #include "nn-cpu.hpp"
 #include "nn-cpu-ops.hpp"
+#include <algorithm>
 #include <cassert>
+#include <cstdint>
+#include <cstdio>
 #include <cstring>
 #include <stdexcept>
+#include <string>
 #include <thread>
 #ifdef _WIN32
 #include <windows.h>
@@ -11,25 +15,129 @@
 #include <fcntl.h>
 #include <unistd.h>
 #endif
+#ifdef __linux__
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#endif
 
 #define DEBUG_CPU_OP_QUANTS false
 
 #define BUFFER_ALIGNMENT 64
+#define PAGE_ALIGNMENT 4096
+#define MPOL_PREFERRED_MODE 1
 
-static NnByte *allocAlignedBuffer(size_t size) {
+static NnByte *allocAlignedBuffer(size_t size, size_t alignment, bool lock) {
     NnByte *buffer;
 #ifdef _WIN32
-    buffer = (NnByte *)_aligned_malloc(size, BUFFER_ALIGNMENT);
+    buffer = (NnByte *)_aligned_malloc(size, alignment);
     if (buffer == NULL)
         throw std::runtime_error("_aligned_malloc failed");
 #else
-    if (posix_memalign((void **)&buffer, BUFFER_ALIGNMENT, size) != 0)
+    if (posix_memalign((void **)&buffer, alignment, size) != 0)
         throw std::runtime_error("posix_memalign failed");
-    mlock(buffer, size);
+    if (lock)
+        mlock(buffer, size);
 #endif
     return buffer;
 }
 
+static NnByte *allocAlignedBuffer(size_t size) {
+    return allocAlignedBuffer(size, BUFFER_ALIGNMENT, true);
+}
+
+static std::vector<NnSize> parseCpuList(const char *list) {
+    // Format: "0-3,8,10-11"
+    std::vector<NnSize> cpus;
+    const char *p = list;
+    while (*p != '\0' && *p != '\n') {
+        char *end;
+        unsigned long first = std::strtoul(p, &end, 10);
+        if (end == p)
+            throw std::invalid_argument("Invalid cpu list: " + std::string(list));
+        unsigned long last = first;
+        p = end;
+        if (*p == '-') {
+            p++;
+            last = std::strtoul(p, &end, 10);
+            if (end == p || last < first)
+                throw std::invalid_argument("Invalid cpu list: " + std::string(list));
+            p = end;
+        }
+        for (unsigned long cpu = first; cpu <= last; cpu++)
+            cpus.push_back((NnSize)cpu);
+        if (*p == ',')
+            p++;
+    }
+    return cpus;
+}
+
+#ifdef __linux__
+static int getCpuNumaNode(NnSize cpu) {
+    char path[64];
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%u", cpu);
+    DIR *dir = opendir(path);
+    if (dir == nullptr)
+        return 0;
+    int node = 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != nullptr) {
+        if (std::strncmp(entry->d_name, "node", 4) == 0 && entry->d_name[4] >= '0' && entry->d_name[4] <= '9') {
+            node = std::atoi(&entry->d_name[4]);
+            break;
+        }
+    }
+    closedir(dir);
+    return node;
+}
+
+static NnSize getCpuSmtRank(NnSize cpu) {
+    // 0 for the first hardware thread of a physical core, 1 for its first SMT sibling, ...
+    char path[96];
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%u/topology/thread_siblings_list", cpu);
+    FILE *file = fopen(path, "r");
+    if (file == nullptr)
+        return 0;
+    char line[256];
+    std::vector<NnSize> siblings;
+    if (fgets(line, sizeof(line), file) != nullptr)
+        siblings = parseCpuList(line);
+    fclose(file);
+    std::vector<NnSize>::iterator it = std::find(siblings.begin(), siblings.end(), cpu);
+    return it == siblings.end() ? 0 : (NnSize)(it - siblings.begin());
+}
+#endif
+
+std::vector<NnSize> resolveThreadCores(const char *value, NnSize nThreads) {
+#ifdef __linux__
+    std::vector<NnSize> cores;
+    if (std::strcmp(value, "auto") == 0) {
+        // Physical cores first, SMT siblings last. Within the same SMT rank cores are grouped by
+        // NUMA node, so neighbouring threads (which own neighbouring weight rows) share a node
+        cpu_set_t set;
+        if (sched_getaffinity(0, sizeof(set), &set) != 0)
+            throw std::runtime_error("sched_getaffinity failed");
+        std::vector<std::pair<std::pair<NnSize, int>, NnSize>> order;
+        for (NnSize cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+            if (CPU_ISSET(cpu, &set))
+                order.push_back({{ getCpuSmtRank(cpu), getCpuNumaNode(cpu) }, cpu });
+        }
+        std::sort(order.begin(), order.end());
+        for (auto &o : order)
+            cores.push_back(o.second);
+    } else {
+        cores = parseCpuList(value);
+    }
+    if (cores.size() < nThreads)
+        throw std::invalid_argument("Not enough cores to pin " + std::to_string(nThreads) + " threads");
+    cores.resize(nThreads);
+    return cores;
+#else
+    throw std::runtime_error("Thread pinning is supported only on Linux");
+#endif
+}
+
 static void releaseAlignedBuffer(NnByte *buffer) {
 #ifdef _WIN32
     _aligned_free(buffer);
@@ -47,10 +155,40 @@ NnCpuDevice::NnCpuDevice(NnNetConfig *netConfig, NnNodeConfig *nodeConfig, NnNet
 
     nBuffers = nodeConfig->nBuffers;
     buffers = new NnByte *[nBuffers];
+    pagedBuffers = new NnCpuPagedBuffer *[nBuffers];
+    std::memset(pagedBuffers, 0, nBuffers * sizeof(NnCpuPagedBuffer *));
+
+    // The KV cache is paged, pages are allocated when positions are written, so the memory usage
+    // follows the current context length instead of the maximum sequence length
+    for (NnSize segmentIndex = 0; segmentIndex < nodeConfig->nSegments; segmentIndex++) {
+        NnSegmentConfig *segmentConfig = &nodeConfig->segments[segmentIndex];
+        for (NnSize opIndex = 0; opIndex < segmentConfig->nOps; opIndex++) {
+            NnOpConfig *opConfig = &segmentConfig->ops[opIndex];
+            if (opConfig->code != OP_MULTIHEAD_ATT)
+                continue;
+            NnMultiHeadAttOpConfig *config = (NnMultiHeadAttOpConfig *)opConfig->config;
+            NnSize kvBufferIndexes[2] = { config->keyCacheBufferIndex, config->valueCacheBufferIndex };
+            for (NnSize bufferIndex : kvBufferIndexes) {
+                if (pagedBuffers[bufferIndex] != nullptr)
+                    continue;
+                NnSize2D *size = &nodeConfig->buffers[bufferIndex].size;
+                NnCpuPagedBuffer *buffer = new NnCpuPagedBuffer;
+                buffer->rowBytes = size->nBytes / size->y;
+                buffer->pageRows = KV_CACHE_PAGE_ROWS;
+                buffer->nPages = (size->y + KV_CACHE_PAGE_ROWS - 1) / KV_CACHE_PAGE_ROWS;
+                buffer->pages = new NnByte *[buffer->nPages];
+                std::memset(buffer->pages, 0, buffer->nPages * sizeof(NnByte *));
+                pagedBuffers[bufferIndex] = buffer;
+            }
+        }
+    }
+
     for (NnSize bufferIndex = 0; bufferIndex < nBuffers; bufferIndex++) {
         NnBufferConfig *config = &nodeConfig->buffers[bufferIndex];
-        NnByte *buffer = allocAlignedBuffer(config->size.nBytes);
-        buffers[bufferIndex] = buffer;
+        if (pagedBuffers[bufferIndex] != nullptr)
+            buffers[bufferIndex] = nullptr;
+        else
+            buffers[bufferIndex] = allocAlignedBuffer(config->size.nBytes);
     }
 
     bufferFlags = new NnByte[nBuffers];
@@ -58,9 +196,21 @@ NnCpuDevice::NnCpuDevice(NnNetConfig *netConfig, NnNodeConfig *nodeConfig, NnNet
 }
 
 NnCpuDevice::~NnCpuDevice() {
-    for (NnSize bufferIndex = 0; bufferIndex < nBuffers; bufferIndex++)
-        releaseAlignedBuffer(buffers[bufferIndex]);
+    for (NnSize bufferIndex = 0; bufferIndex < nBuffers; bufferIndex++) {
+        NnCpuPagedBuffer *buffer = pagedBuffers[bufferIndex];
+        if (buffer != nullptr) {
+            for (NnSize pageIndex = 0; pageIndex < buffer->nPages; pageIndex++) {
+                if (buffer->pages[pageIndex] != nullptr)
+                    releaseAlignedBuffer(buffer->pages[pageIndex]);
+            }
+            delete[] buffer->pages;
+            delete buffer;
+        } else {
+            releaseAlignedBuffer(buffers[bufferIndex]);
+        }
+    }
     delete[] buffers;
+    delete[] pagedBuffers;
     delete[] bufferFlags;
 }
 
@@ -68,6 +218,65 @@ NnSize NnCpuDevice::maxNThreads() {
     return std::thread::hardware_concurrency();
 }
 
+void NnCpuDevice::pinThreads(std::vector<NnSize> &cores) {
+#ifdef __linux__
+    if (cores.size() != netExecution->nThreads)
+        throw std::invalid_argument("The number of cores must be equal to the number of threads");
+    threadCores = cores;
+    threadNumaNodes.resize(cores.size());
+    printf("📌 Pinned threads:");
+    for (NnSize threadIndex = 0; threadIndex < cores.size(); threadIndex++) {
+        threadNumaNodes[threadIndex] = getCpuNumaNode(cores[threadIndex]);
+        printf(" %u (cpu%u, node%d)", threadIndex, cores[threadIndex], threadNumaNodes[threadIndex]);
+    }
+    printf("\n");
+#else
+    throw std::runtime_error("Thread pinning is supported only on Linux");
+#endif
+}
+
+void NnCpuDevice::bindThread(NnSize threadIndex) {
+#ifdef __linux__
+    if (threadCores.empty())
+        return;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(threadCores[threadIndex], &set);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0)
+        printf("🚧 Cannot pin thread %u to cpu%u\n", threadIndex, threadCores[threadIndex]);
+#endif
+}
+
+bool NnCpuDevice::hasWeightPlacement() {
+    return !threadNumaNodes.empty();
+}
+
+NnByte *NnCpuDevice::allocWeight(NnSize2D *weightSize) {
+#ifdef __linux__
+    // Ops split the weight by rows (weightSize.x) between threads in the same way as SPLIT_THREADS does,
+    // so each range is bound to the NUMA node of the thread that will read it. The policy must be set
+    // before the first touch, so the buffer is locked after binding
+    if (!threadNumaNodes.empty() && weightSize->x > 0 && weightSize->nBytes % weightSize->x == 0) {
+        NnByte *weight = allocAlignedBuffer(weightSize->nBytes, PAGE_ALIGNMENT, false);
+        const NnSize rowBytes = weightSize->nBytes / weightSize->x;
+        const NnSize nThreads = (NnSize)threadNumaNodes.size();
+        for (NnSize threadIndex = 0; threadIndex < nThreads; threadIndex++) {
+            SPLIT_THREADS(start, end, weightSize->x, nThreads, threadIndex);
+            // Only whole pages inside the range, a page shared by two threads keeps the default policy
+            size_t rangeStart = ((size_t)start * rowBytes + PAGE_ALIGNMENT - 1) / PAGE_ALIGNMENT * PAGE_ALIGNMENT;
+            size_t rangeEnd = (size_t)end * rowBytes / PAGE_ALIGNMENT * PAGE_ALIGNMENT;
+            if (rangeEnd <= rangeStart || threadNumaNodes[threadIndex] >= (int)(sizeof(unsigned long) * 8))
+                continue;
+            unsigned long nodeMask = 1ul << threadNumaNodes[threadIndex];
+            syscall(SYS_mbind, &weight[rangeStart], rangeEnd - rangeStart, MPOL_PREFERRED_MODE, &nodeMask, sizeof(nodeMask) * 8, 0);
+        }
+        mlock(weight, weightSize->nBytes);
+        return weight;
+    }
+#endif
+    return allocAlignedBuffer(weightSize->nBytes);
+}
+
 NnDeviceSegment *NnCpuDevice::createSegment(NnSize segmentIndex) {
     NnSegmentConfig *segmentConfig = &nodeConfig->segments[segmentIndex];
     assert(segmentConfig->nOps > 0);
@@ -125,6 +334,7 @@ NnDeviceSegment *NnCpuDevice::createSegment(NnSize segmentIndex) {
         opContext->pipes = netExecution->pipes;
         opContext->pipeConfigs = netConfig->pipes;
         opContext->buffers = buffers;
+        opContext->pagedBuffers = pagedBuffers;
         opContext->bufferConfigs = nodeConfig->buffers;
         opContext->bufferFlags = bufferFlags;
 
@@ -136,16 +346,14 @@ NnDeviceSegment *NnCpuDevice::createSegment(NnSize segmentIndex) {
         opContext->outputSize = outputSizes[opIndex];
         opContext->hasOutputContinuousMemory = hasPointerContinuousMemory(&opConfig->output);
 
-        if (opContext->weightSize.nBytes > 0)
-            opContext->weight = allocAlignedBuffer(opContext->weightSize.nBytes);
-        else
-            opContext->weight = nullptr;
+        // The weight is allocated when it's loaded, a mapped weight doesn't need any allocation
+        opContext->weight = nullptr;
 
         if (opInit != nullptr)
             opInit(opContext);
         opForward[opIndex] = opForwardLocal[opIndex];
     }
-    return new NnCpuDeviceSegment(opForward, opContexts, segmentConfig->nOps);
+    return new NnCpuDeviceSegment(opForward, opContexts, segmentConfig->nOps, this);
 }
 
 NnCpuDeviceSegment::~NnCpuDeviceSegment() {
@@ -155,7 +363,7 @@ NnCpuDeviceSegment::~NnCpuDeviceSegment() {
             delete[] context->input;
             delete[] context->output;
         }
-        if (context->weightSize.nBytes > 0)
+        if (context->weight != nullptr && !isWeightMapped[opIndex])
             releaseAlignedBuffer(context->weight);
     }
     delete[] opForward;
@@ -164,9 +372,11 @@ NnCpuDeviceSegment::~NnCpuDeviceSegment() {
 
 void NnCpuDevice::resolvePointer(NnByte **pntr, NnSize2D *pntrSize, NnPointerConfig *pointerConfig) {
     NnByte *source;
+    NnCpuPagedBuffer *pagedSource = nullptr;
     NnSize2D *sourceSize;
     if (pointerConfig->pointerType == PNTR_BUFFER) {
         source = buffers[pointerConfig->pointerIndex];
+        pagedSource = pagedBuffers[pointerConfig->pointerIndex];
         sourceSize = &nodeConfig->buffers[pointerConfig->pointerIndex].size;
     } else if (pointerConfig->pointerType == PNTR_PIPE) {
         source = netExecution->pipes[pointerConfig->pointerIndex];
@@ -176,6 +386,8 @@ void NnCpuDevice::resolvePointer(NnByte **pntr, NnSize2D *pntrSize, NnPointerCon
     }
 
     if (pointerConfig->batchType == PNTR_BATCH_DEFAULT) {
+        if (pagedSource != nullptr)
+            throw std::invalid_argument("Paged buffer supports only piped batch pointers");
         ASSERT_EQ(sourceSize->y, netConfig->nBatches);
 
         NnSize batchBytes = getBytes(sourceSize->floatType, sourceSize->x);
@@ -186,18 +398,27 @@ void NnCpuDevice::resolvePointer(NnByte **pntr, NnSize2D *pntrSize, NnPointerCon
         if (pointerConfig->sliceType == SLICE_NONE)
             return;
         if (pointerConfig->sliceType == SLICE_NODE_PART) {
-            assert(sourceSize->x % netConfig->nNodes == 0);
-            NnSize xSlice = sourceSize->x / netConfig->nNodes;
-            NnSize xSliceBytes = getBytes(sourceSize->floatType, xSlice);
+            NnSize xStart;
+            NnSize xSlice;
+            if (pointerConfig->pointerType == PNTR_PIPE) {
+                NnPipeConfig *pipeConfig = &netConfig->pipes[pointerConfig->pointerIndex];
+                xStart = getPipeSliceStart(pipeConfig, netConfig->nNodes, nodeConfig->nodeIndex);
+                xSlice = getPipeSliceStart(pipeConfig, netConfig->nNodes, nodeConfig->nodeIndex + 1) - xStart;
+            } else {
+                assert(sourceSize->x % netConfig->nNodes == 0);
+                xSlice = sourceSize->x / netConfig->nNodes;
+                xStart = xSlice * nodeConfig->nodeIndex;
+            }
+            NnSize xStartBytes = getBytes(sourceSize->floatType, xStart);
             for (NnSize batchIndex = 0; batchIndex < netConfig->nBatches; batchIndex++)
-                pntr[batchIndex] = &pntr[batchIndex][xSliceBytes * nodeConfig->nodeIndex];
+                pntr[batchIndex] = &pntr[batchIndex][xStartBytes];
             *pntrSize = size2D(sourceSize->floatType, sourceSize->y, xSlice);
             return;
         }
     }
     if (pointerConfig->batchType == PNTR_BATCH_PIPE) {
         if (pointerConfig->sliceType == SLICE_NONE) {
-            dynamicPointers.push_back({ source, sourceSize, pntr, pointerConfig });
+            dynamicPointers.push_back({ source, pagedSource, sourceSize, pntr, pointerConfig });
             *pntrSize = size2D(sourceSize->floatType, netConfig->nBatches, sourceSize->x);
             return;
         }
@@ -215,20 +436,54 @@ void NnCpuDevice::syncPointers() {
         for (NnSize batchIndex = 0; batchIndex < netExecution->batchSize; batchIndex++) {
             NnSize index = (NnSize)pipe[batchIndex];
             assert(index < dp->sourceSize->y);
+            if (dp->pagedSource != nullptr) {
+                dp->pntr[batchIndex] = allocPagedRow(dp->pagedSource, index);
+                continue;
+            }
             NnSize nBytes = dp->sourceSize->nBytes / dp->sourceSize->y;
             dp->pntr[batchIndex] = &dp->source[index * nBytes];
         }
     }
 }
 
+NnByte *NnCpuDevice::allocPagedRow(NnCpuPagedBuffer *buffer, NnSize row) {
+    // Called only from syncPointers, which runs on a single thread between barriers
+    NnByte **page = &buffer->pages[row / buffer->pageRows];
+    if (*page == nullptr)
+        *page = allocAlignedBuffer(buffer->pageRows * buffer->rowBytes);
+    return getPagedRow(buffer, row);
+}
+
 void NnCpuDeviceSegment::loadWeight(NnSize opIndex, NnSize nBytes, NnByte *weight) {
     assert(opIndex >= 0);
     assert(opIndex < nOps);
     NnCpuOpContext *context = &opContexts[opIndex];
     ASSERT_EQ(context->weightSize.nBytes, nBytes);
+    if (context->weight == nullptr)
+        context->weight = device->allocWeight(&context->weightSize);
     std::memcpy(context->weight, weight, nBytes);
 }
 
+static size_t getWeightAlignment(NnFloatType floatType) {
+    if (floatType == F_32)
+        return sizeof(float);
+    // F16 values and Q40/Q80 blocks (they start with a F16 scale)
+    return sizeof(std::uint16_t);
+}
+
+bool NnCpuDeviceSegment::mapWeight(NnSize opIndex, NnSize nBytes, NnByte *weight) {
+    assert(opIndex < nOps);
+    NnCpuOpContext *context = &opContexts[opIndex];
+    ASSERT_EQ(context->weightSize.nBytes, nBytes);
+    if (context->weight != nullptr || device->hasWeightPlacement())
+        return false;
+    if ((std::uintptr_t)weight % getWeightAlignment(context->weightSize.floatType) != 0)
+        return false;
+    context->weight = weight;
+    isWeightMapped[opIndex] = true;
+    return true;
+}
+
 void NnCpuDeviceSegment::forward(NnSize opIndex, NnSize nThreads, NnSize threadIndex, NnSize batchSize) {
     NnCpuOpContext *context = &opContexts[opIndex];
     // printf("forward: %d %s (%d/%d)\n", opIndex, context->name, threadIndex + 1, nThreads); fflush(stdout);
@@ -7,6 +7,7 @@
 
 typedef struct {
     NnByte *source;
+    NnCpuPagedBuffer *pagedSource;
     NnSize2D *sourceSize;
     NnByte **pntr;
     NnPointerConfig *pointerConfig;
@@ -15,6 +16,7 @@ typedef struct {
 class NnCpuDevice : public NnDevice {
 public:
     NnByte **buffers;
+    NnCpuPagedBuffer **pagedBuffers;
 private:
     NnNetConfig *netConfig;
     NnNodeConfig *nodeConfig;
@@ -22,13 +24,22 @@ private:
     NnSize nBuffers;
     NnByte *bufferFlags;
     std::vector<NnCpuDynamicPointer> dynamicPointers;
+    std::vector<NnSize> threadCores;
+    std::vector<int> threadNumaNodes;
 public:
     NnCpuDevice(NnNetConfig *netConfig, NnNodeConfig *nodeConfig, NnNetExecution *netExecution);
     ~NnCpuDevice();
     NnSize maxNThreads() override;
     NnDeviceSegment *createSegment(NnSize segmentIndex) override;
     void syncPointers() override;
+    void bindThread(NnSize threadIndex) override;
     void resolvePointer(NnByte **pntr, NnSize2D *pntrSize, NnPointerConfig *pointerConfig);
+    // Must be called before the executor is created, weights are placed on the NUMA node of the owning thread
+    void pinThreads(std::vector<NnSize> &cores);
+    bool hasWeightPlacement();
+    NnByte *allocWeight(NnSize2D *weightSize);
+private:
+    NnByte *allocPagedRow(NnCpuPagedBuffer *buffer, NnSize row);
 };
 
 class NnCpuDeviceSegment : public NnDeviceSegment {
@@ -36,11 +47,16 @@ public:
     NnSize nOps;
     NnCpuOpForward *opForward;
     NnCpuOpContext *opContexts;
-    NnCpuDeviceSegment(NnCpuOpForward *opForward, NnCpuOpContext *opContexts, NnSize nOps)
-        : opForward(opForward), opContexts(opContexts), nOps(nOps) {}
+    NnCpuDevice *device;
+    std::vector<bool> isWeightMapped;
+    NnCpuDeviceSegment(NnCpuOpForward *opForward, NnCpuOpContext *opContexts, NnSize nOps, NnCpuDevice *device)
+        : opForward(opForward), opContexts(opContexts), nOps(nOps), device(device), isWeightMapped(nOps, false) {}
     ~NnCpuDeviceSegment() override;
     void loadWeight(NnSize opIndex, NnSize nBytes, NnByte *weight) override;
+    bool mapWeight(NnSize opIndex, NnSize nBytes, NnByte *weight) override;
     void forward(NnSize opIndex, NnSize nThreads, NnSize threadIndex, NnSize batchSize) override;
 };
 
+std::vector<NnSize> resolveThreadCores(const char *value, NnSize nThreads);
+
 #endif
\ No newline at end of file
@@ -1,10 +1,104 @@
+#include <algorithm>
 #include <cassert>
 #include <chrono>
 #include <cstring>
 #include <stdexcept>
 #include "nn-executor.hpp"
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#include <immintrin.h>
+#define SPIN_PAUSE() _mm_pause()
+#elif defined(__aarch64__) || defined(__arm__)
+#define SPIN_PAUSE() __asm__ __volatile__("yield")
+#else
+#define SPIN_PAUSE()
+#endif
 
-#define DEBUG_BENCHMARK false
+#define SPIN_CLOCK_CHECK_INTERVAL 64
+
+static void *executorPoolHandler(void *arg);
+
+static NnSize getPointerResource(NnNetConfig *netConfig, NnPointerType pointerType, NnSize pointerIndex) {
+    if (pointerType == PNTR_PIPE)
+        return pointerIndex;
+    if (pointerType == PNTR_BUFFER)
+        return netConfig->nPipes + pointerIndex;
+    throw std::invalid_argument("Unsupported pointer type");
+}
+
+static void getOpResources(NnNetConfig *netConfig, NnOpConfig *opConfig, std::vector<NnSize> *reads, std::vector<NnSize> *writes) {
+    const NnSize nPipes = netConfig->nPipes;
+    reads->clear();
+    writes->clear();
+    reads->push_back(getPointerResource(netConfig, opConfig->input.pointerType, opConfig->input.pointerIndex));
+    if (opConfig->input.batchType == PNTR_BATCH_PIPE)
+        reads->push_back(opConfig->input.batchArg0);
+    if (opConfig->output.batchType == PNTR_BATCH_PIPE)
+        reads->push_back(opConfig->output.batchArg0);
+    // Some ops update the output in place (merge add, mul, silu...), so the output is also treated as read
+    NnSize output = getPointerResource(netConfig, opConfig->output.pointerType, opConfig->output.pointerIndex);
+    reads->push_back(output);
+    writes->push_back(output);
+
+    if (opConfig->code == OP_RMS_NORM) {
+        NnRmsNormOpConfig *config = (NnRmsNormOpConfig *)opConfig->config;
+        reads->push_back(nPipes + config->invRmsBufferIndex);
+    } else if (opConfig->code == OP_ROPE_LLAMA) {
+        NnRopeLlamaOpConfig *config = (NnRopeLlamaOpConfig *)opConfig->config;
+        reads->push_back(config->positionPipeIndex);
+        reads->push_back(nPipes + config->ropeCacheBufferIndex);
+    } else if (opConfig->code == OP_MULTIHEAD_ATT) {
+        NnMultiHeadAttOpConfig *config = (NnMultiHeadAttOpConfig *)opConfig->config;
+        reads->push_back(config->positionPipeIndex);
+        reads->push_back(nPipes + config->queryBufferIndex);
+        reads->push_back(nPipes + config->keyCacheBufferIndex);
+        reads->push_back(nPipes + config->valueCacheBufferIndex);
+        reads->push_back(nPipes + config->attBufferIndex);
+        writes->push_back(nPipes + config->attBufferIndex);
+    } else if (opConfig->code == OP_MULTIHEAD_ATT_MERGE) {
+        NnMultiHeadAttOpConfig *config = (NnMultiHeadAttOpConfig *)opConfig->config;
+        reads->push_back(config->positionPipeIndex);
+        reads->push_back(nPipes + config->attBufferIndex);
+    }
+}
+
+static void resolveBarriers(NnNetConfig *netConfig, NnNodeConfig *nodeConfig, std::vector<NnExecutorStep> *steps) {
+    // Consecutive ops may run without a barrier between them if none of them writes
+    // a pipe or a buffer that another op in the same group reads or writes
+    const NnSize nResources = netConfig->nPipes + nodeConfig->nBuffers;
+    std::vector<bool> groupReads(nResources, false);
+    std::vector<bool> groupWrites(nResources, false);
+    std::vector<NnSize> reads;
+    std::vector<NnSize> writes;
+    NnExecutorStep *prevStep = nullptr;
+
+    for (NnExecutorStep &step : *steps) {
+        step.hasBarrier = true;
+        if (step.type != STEP_EXECUTE_OP) {
+            // Syncs exchange data with other nodes, so they are always separated from ops
+            prevStep = nullptr;
+            continue;
+        }
+
+        getOpResources(netConfig, step.opConfig, &reads, &writes);
+        bool hasConflict = prevStep == nullptr;
+        for (NnSize r : reads)
+            hasConflict |= groupWrites[r];
+        for (NnSize w : writes)
+            hasConflict |= groupReads[w] || groupWrites[w];
+
+        if (hasConflict) {
+            std::fill(groupReads.begin(), groupReads.end(), false);
+            std::fill(groupWrites.begin(), groupWrites.end(), false);
+        } else {
+            prevStep->hasBarrier = false;
+        }
+        for (NnSize r : reads)
+            groupReads[r] = true;
+        for (NnSize w : writes)
+            groupWrites[w] = true;
+        prevStep = &step;
+    }
+}
 
 void NnFakeNodeSynchronizer::sync(NnSize segmentIndex, NnSize nThreads, NnSize threadIndex) {
     // Nothing
@@ -15,6 +109,7 @@ NnNetExecution::NnNetExecution(NnSize nThreads, NnNetConfig *netConfig) {
     this->nBatches = netConfig->nBatches;
     this->nPipes = netConfig->nPipes;
     this->batchSize = 0; // This value must be overwritten before calling forward
+    this->outputBatchSize = 0;
 
     pipes = new NnByte *[netConfig->nPipes];
     for (NnSize pipeIndex = 0; pipeIndex < netConfig->nPipes; pipeIndex++) {
@@ -34,6 +129,12 @@ NnNetExecution::~NnNetExecution() {
 void NnNetExecution::setBatchSize(NnSize batchSize) {
     assert(batchSize > 0 && batchSize <= nBatches);
     this->batchSize = batchSize;
+    this->outputBatchSize = batchSize;
+}
+
+void NnNetExecution::setOutputBatchSize(NnSize outputBatchSize) {
+    assert(outputBatchSize <= batchSize);
+    this->outputBatchSize = outputBatchSize;
 }
 
 NnExecutor::NnExecutor(NnNetConfig *netConfig, NnNodeConfig *nodeConfig, NnDevice *device, NnNetExecution *netExecution, NnNodeSynchronizer *synchronizer)
@@ -43,7 +144,10 @@ NnExecutor::NnExecutor(NnNetConfig *netConfig, NnNodeConfig *nodeConfig, NnDevic
     if (netExecution->nThreads > maxNThreads)
         throw std::invalid_argument("This CPU supports max " + std::to_string(maxNThreads) + " threads");
     this->netExecution = netExecution;
+    this->netConfig = netConfig;
     this->nodeConfig = nodeConfig;
+    this->traceFile = nullptr;
+    this->nTracedForwards = 0;
 
     bool useSynchronizer = netConfig->nNodes > 1;
     for (NnSize segmentIndex = 0; segmentIndex < nodeConfig->nSegments; segmentIndex++) {
@@ -53,15 +157,16 @@ NnExecutor::NnExecutor(NnNetConfig *netConfig, NnNodeConfig *nodeConfig, NnDevic
             segments[segmentIndex] = std::unique_ptr<NnDeviceSegment>(segment);
     
             for (NnSize opIndex = 0; opIndex < segmentConfig->nOps; opIndex++)
-                steps.push_back(NnExecutorStep{ STEP_EXECUTE_OP, segment, opIndex, &segmentConfig->ops[opIndex] });
+                steps.push_back(NnExecutorStep{ STEP_EXECUTE_OP, segment, opIndex, &segmentConfig->ops[opIndex], segmentIndex, segmentConfig->isOutput, true });
         }
         if (useSynchronizer && segmentConfig->nSyncs > 0)
-            steps.push_back(NnExecutorStep{ STEP_SYNC_NODES, nullptr, segmentIndex, nullptr });
+            steps.push_back(NnExecutorStep{ STEP_SYNC_NODES, nullptr, segmentIndex, nullptr, segmentIndex, segmentConfig->isOutput, true });
         if (segmentConfig->syncPointers)
-            steps.push_back(NnExecutorStep{ STEP_SYNC_POINTERS, nullptr, 0, nullptr });
+            steps.push_back(NnExecutorStep{ STEP_SYNC_POINTERS, nullptr, 0, nullptr, segmentIndex, segmentConfig->isOutput, true });
     }
 
     steps.shrink_to_fit();
+    resolveBarriers(netConfig, nodeConfig, &steps);
 
     context.nThreads = netExecution->nThreads;
     context.synchronizer = synchronizer;
@@ -69,42 +174,84 @@ NnExecutor::NnExecutor(NnNetConfig *netConfig, NnNodeConfig *nodeConfig, NnDevic
     context.nSteps = (NnSize)steps.size();
     context.steps = steps.data();
 
+    context.spinTime = DEFAULT_SPIN_TIME;
+    context.nSleepingThreads.exchange(0);
+    context.isAborted.exchange(false);
+    context.poolForwardIndex = 0;
+    context.nPoolRunningThreads = 0;
+    context.isPoolAlive = true;
+
     threads = new NnExecutorThread[netExecution->nThreads];
     for (NnSize threadIndex = 0; threadIndex < netExecution->nThreads; threadIndex++) {
         NnExecutorThread *thread = &threads[threadIndex];
         thread->threadIndex = threadIndex;
         thread->context = &context;
+        thread->spinTime = 0;
+        thread->sleepTime = 0;
+        thread->traceEvents = nullptr;
+    }
+    device->bindThread(0);
+    for (NnSize threadIndex = 1; threadIndex < netExecution->nThreads; threadIndex++) {
+        int result = pthread_create(&threads[threadIndex].handler, NULL, (PthreadFunc)executorPoolHandler, (void *)&threads[threadIndex]);
+        if (result != 0) {
+            stopPool(threadIndex);
+            throw std::runtime_error("Failed to create thread");
+        }
     }
 }
 
 NnExecutor::~NnExecutor() {
+    stopTrace();
+    stopPool(context.nThreads);
+}
+
+void NnExecutor::stopPool(NnSize nStartedThreads) {
+    {
+        std::lock_guard<std::mutex> lock(context.poolMutex);
+        context.isPoolAlive = false;
+    }
+    context.poolStartCond.notify_all();
+    for (NnSize threadIndex = 1; threadIndex < nStartedThreads; threadIndex++)
+        pthread_join(threads[threadIndex].handler, NULL);
     delete[] threads;
 }
 
-void NnExecutor::loadWeight(const char *name, NnSize index, NnSize nBytes, NnByte *weight) {
+NnDeviceSegment *NnExecutor::findWeightSegment(const char *name, NnSize index, NnSize *opIndex) {
     for (NnSize segmentIndex = 0; segmentIndex < nodeConfig->nSegments; segmentIndex++) {
         NnSegmentConfig *segmentConfig = &nodeConfig->segments[segmentIndex];
-        for (NnSize opIndex = 0; opIndex < segmentConfig->nOps; opIndex++) {
-            NnOpConfig *opConfig = &segmentConfig->ops[opIndex];
+        for (NnSize i = 0; i < segmentConfig->nOps; i++) {
+            NnOpConfig *opConfig = &segmentConfig->ops[i];
             if (opConfig->index == index && std::strcmp(opConfig->name, name) == 0) {
                 NnDeviceSegment *segment = segments[segmentIndex].get();
                 assert(segment != nullptr);
-                segment->loadWeight(opIndex, nBytes, weight);
-                return;
+                *opIndex = i;
+                return segment;
             }
         }
     }
     throw std::invalid_argument("Cannot locate op by name: " + std::string(name));
 }
 
-inline void executeStep(NnExecutorStep *step, NnSize nThreads, NnExecutorThread *thread, NnExecutorContext *context) {
-    #if DEBUG_BENCHMARK
-    assert(nThreads == 1);
-    auto startTime = std::chrono::high_resolution_clock::now();
-    #endif
+void NnExecutor::loadWeight(const char *name, NnSize index, NnSize nBytes, NnByte *weight) {
+    NnSize opIndex;
+    NnDeviceSegment *segment = findWeightSegment(name, index, &opIndex);
+    segment->loadWeight(opIndex, nBytes, weight);
+}
+
+bool NnExecutor::mapWeight(const char *name, NnSize index, NnSize nBytes, NnByte *weight) {
+    NnSize opIndex;
+    NnDeviceSegment *segment = findWeightSegment(name, index, &opIndex);
+    if (segment->mapWeight(opIndex, nBytes, weight))
+        return true;
+    segment->loadWeight(opIndex, nBytes, weight);
+    return false;
+}
 
+inline void executeStep(NnExecutorStep *step, NnSize nThreads, NnExecutorThread *thread, NnExecutorContext *context) {
     if (step->type == STEP_EXECUTE_OP) {
-        step->segment->forward(step->arg0, nThreads, thread->threadIndex, context->batchSize);
+        NnSize batchSize = step->isOutput ? context->outputBatchSize : context->batchSize;
+        if (batchSize > 0)
+            step->segment->forward(step->arg0, nThreads, thread->threadIndex, batchSize);
     } else if (step->type == STEP_SYNC_NODES) {
         context->synchronizer->sync(step->arg0, nThreads, thread->threadIndex);
     } else if (step->type == STEP_SYNC_POINTERS) {
@@ -113,38 +260,121 @@ inline void executeStep(NnExecutorStep *step, NnSize nThreads, NnExecutorThread
     } else {
         throw std::invalid_argument("Unsupported step type");
     }
+}
 
-    #if DEBUG_BENCHMARK
-    auto endTime = std::chrono::high_resolution_clock::now();
-    NnSize duration = (NnSize)std::chrono::duration_cast<std::chrono::microseconds>(endTime - startTime).count();
-    if (step->type == STEP_EXECUTE_OP)
-        printf("🕒 [OP %16s %2d] %u μs\n", opCodeToString(step->opConfig->code), step->opConfig->index, duration);
-    else if (step->type == STEP_SYNC_NODES)
-        printf("🕒 [SYNC %17d] %u μs\n", step->arg0, duration);
-    #endif
+static inline long long traceTime(NnExecutorContext *context) {
+    return (long long)std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - context->traceStartTime).count();
 }
 
-static inline void *executorThreadHandler(void *arg) {
-    NnExecutorThread *thread = (NnExecutorThread *)arg;
+static inline unsigned long elapsedMicroseconds(std::chrono::steady_clock::time_point from, std::chrono::steady_clock::time_point to) {
+    return (unsigned long)std::chrono::duration_cast<std::chrono::microseconds>(to - from).count();
+}
+
+static inline void waitForNextStep(NnExecutorThread *thread, NnExecutorContext *context, const unsigned int stepIndex) {
+    const std::chrono::microseconds spinTime(context->spinTime);
+    const auto startTime = std::chrono::steady_clock::now();
+    unsigned int nSpins = 0;
+
+    while (context->currentStepIndex.load() <= stepIndex && !context->isAborted.load()) {
+        SPIN_PAUSE();
+        if (++nSpins % SPIN_CLOCK_CHECK_INTERVAL != 0)
+            continue;
+        const auto now = std::chrono::steady_clock::now();
+        if (now - startTime < spinTime)
+            continue;
+
+        // The spin budget is exhausted, the current step is slow (probably I/O), so go to sleep
+        {
+            std::unique_lock<std::mutex> lock(context->stepMutex);
+            context->nSleepingThreads.fetch_add(1);
+            context->stepCond.wait(lock, [&] {
+                return context->currentStepIndex.load() > stepIndex || context->isAborted.load();
+            });
+            context->nSleepingThreads.fetch_sub(1);
+        }
+        thread->spinTime += elapsedMicroseconds(startTime, now);
+        thread->sleepTime += elapsedMicroseconds(now, std::chrono::steady_clock::now());
+        return;
+    }
+    thread->spinTime += elapsedMicroseconds(startTime, std::chrono::steady_clock::now());
+}
+
+static void abortForward(NnExecutorContext *context) {
+    {
+        std::lock_guard<std::mutex> lock(context->stepMutex);
+        if (!context->isAborted.load())
+            context->abortException = std::current_exception();
+        context->isAborted.store(true);
+    }
+    context->stepCond.notify_all();
+}
+
+static inline void executorThreadHandler(NnExecutorThread *thread) {
     NnExecutorContext *context = thread->context;
     NnSize nThreads = context->nThreads;
     NnSize doneCount = nThreads - 1;
 
-    while (true) {
-        const unsigned int currentStepIndex = context->currentStepIndex.load();
-        if (currentStepIndex == context->nSteps)
-            break;
-
+    for (unsigned int currentStepIndex = 0; currentStepIndex < context->nSteps; currentStepIndex++) {
+        if (context->isAborted.load())
+            return;
         NnExecutorStep *step = &context->steps[currentStepIndex];
-        executeStep(step, nThreads, thread, context);
+        if (thread->traceEvents != nullptr) {
+            NnExecutorTraceEvent *event = &thread->traceEvents[currentStepIndex];
+            event->startTime = traceTime(context);
+            executeStep(step, nThreads, thread, context);
+            event->endTime = traceTime(context);
+        } else {
+            executeStep(step, nThreads, thread, context);
+        }
+        if (!step->hasBarrier)
+            continue;
 
         NnSize currentCount = context->doneThreadCount.fetch_add(1);
         if (currentCount == doneCount) {
             context->doneThreadCount.store(0);
-            context->currentStepIndex.fetch_add(1);
+            context->currentStepIndex.store(currentStepIndex + 1);
+            if (context->nSleepingThreads.load() > 0) {
+                std::lock_guard<std::mutex> lock(context->stepMutex);
+                context->stepCond.notify_all();
+            }
         } else {
-            while (context->currentStepIndex.load() == currentStepIndex);
+            waitForNextStep(thread, context, currentStepIndex);
+        }
+    }
+}
+
+static void *executorPoolHandler(void *arg) {
+    NnExecutorThread *thread = (NnExecutorThread *)arg;
+    NnExecutorContext *context = thread->context;
+    NnSize forwardIndex = 0;
+    context->device->bindThread(thread->threadIndex);
+
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(context->poolMutex);
+            context->poolStartCond.wait(lock, [&] {
+                return !context->isPoolAlive || context->poolForwardIndex != forwardIndex;
+            });
+            if (!context->isPoolAlive)
+                break;
+            forwardIndex = context->poolForwardIndex;
+        }
+
+        try {
+            executorThreadHandler(thread);
+        } catch (...) {
+            abortForward(context);
         }
+
+        bool isLast;
+        {
+            std::lock_guard<std::mutex> lock(context->poolMutex);
+            context->nPoolRunningThreads--;
+            isLast = context->nPoolRunningThreads == 0;
+        }
+        if (isLast)
+            context->poolDoneCond.notify_all();
     }
     return nullptr;
 }
@@ -156,14 +386,142 @@ void NnExecutor::forward() {
     context.currentStepIndex.exchange(0);
     context.doneThreadCount.exchange(0);
     context.batchSize = netExecution->batchSize;
+    context.outputBatchSize = netExecution->outputBatchSize;
 
-    NnSize threadIndex;
-    for (threadIndex = 1; threadIndex < nThreads; threadIndex++) {
-        int result = pthread_create(&threads[threadIndex].handler, NULL, (PthreadFunc)executorThreadHandler, (void *)&threads[threadIndex]);
-        if (result != 0)
-            throw std::runtime_error("Failed to create thread");
+    if (nThreads > 1) {
+        {
+            std::lock_guard<std::mutex> lock(context.poolMutex);
+            context.nPoolRunningThreads = nThreads - 1;
+            context.poolForwardIndex++;
+        }
+        context.poolStartCond.notify_all();
     }
-    executorThreadHandler((void *)&threads[0]);
-    for (threadIndex = 1; threadIndex < nThreads; threadIndex++)
-        pthread_join(threads[threadIndex].handler, NULL);
+
+    try {
+        executorThreadHandler(&threads[0]);
+    } catch (...) {
+        abortForward(&context);
+    }
+
+    if (nThreads > 1) {
+        // Wait until all threads are parked again, otherwise the next forward could reset the step index too early
+        std::unique_lock<std::mutex> lock(context.poolMutex);
+        context.poolDoneCond.wait(lock, [&] { return context.nPoolRunningThreads == 0; });
+    }
+
+    if (context.isAborted.load()) {
+        // All threads have left the step, so the executor may be reused or destroyed
+        std::exception_ptr exception;
+        {
+            std::lock_guard<std::mutex> lock(context.stepMutex);
+            exception = context.abortException;
+            context.abortException = nullptr;
+            context.isAborted.store(false);
+        }
+        std::rethrow_exception(exception);
+    }
+
+    if (traceFile != nullptr)
+        writeTrace();
+}
+
+void NnExecutor::setSpinTime(NnSize spinTime) {
+    context.spinTime = spinTime;
+}
+
+void NnExecutor::getBarrierStats(unsigned long *spinTime, unsigned long *sleepTime) {
+    *spinTime = 0;
+    *sleepTime = 0;
+    for (NnSize threadIndex = 0; threadIndex < context.nThreads; threadIndex++) {
+        NnExecutorThread *thread = &threads[threadIndex];
+        *spinTime += thread->spinTime;
+        *sleepTime += thread->sleepTime;
+        thread->spinTime = 0;
+        thread->sleepTime = 0;
+    }
+}
+
+static NnFloatType getPointerFloatType(NnNetConfig *netConfig, NnNodeConfig *nodeConfig, NnPointerConfig *pointerConfig) {
+    if (pointerConfig->pointerType == PNTR_PIPE)
+        return netConfig->pipes[pointerConfig->pointerIndex].size.floatType;
+    if (pointerConfig->pointerType == PNTR_BUFFER)
+        return nodeConfig->buffers[pointerConfig->pointerIndex].size.floatType;
+    throw std::invalid_argument("Unsupported pointer type");
+}
+
+void NnExecutor::startTrace(const char *path) {
+    stopTrace();
+    traceFile = fopen(path, "w");
+    if (traceFile == nullptr)
+        throw std::runtime_error("Cannot open trace file: " + std::string(path));
+
+    traceQuantNames.resize(steps.size());
+    for (NnSize stepIndex = 0; stepIndex < steps.size(); stepIndex++) {
+        NnExecutorStep *step = &steps[stepIndex];
+        if (step->type != STEP_EXECUTE_OP) {
+            traceQuantNames[stepIndex] = nullptr;
+            continue;
+        }
+        NnOpConfig *opConfig = step->opConfig;
+        traceQuantNames[stepIndex] = opQuantTypeToString(getOpQuantType(
+            getPointerFloatType(netConfig, nodeConfig, &opConfig->input),
+            opConfig->weightSize.floatType,
+            getPointerFloatType(netConfig, nodeConfig, &opConfig->output)));
+    }
+    for (NnSize threadIndex = 0; threadIndex < context.nThreads; threadIndex++)
+        threads[threadIndex].traceEvents = new NnExecutorTraceEvent[steps.size()];
+
+    NnSize pid = nodeConfig->nodeIndex;
+    fprintf(traceFile, "{\"traceEvents\":[\n");
+    fprintf(traceFile, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%u,\"args\":{\"name\":\"node %u\"}}", pid, pid);
+    for (NnSize threadIndex = 0; threadIndex < context.nThreads; threadIndex++)
+        fprintf(traceFile, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%u,\"tid\":%u,\"args\":{\"name\":\"thread %u\"}}", pid, threadIndex, threadIndex);
+    nTracedForwards = 0;
+    context.traceStartTime = std::chrono::steady_clock::now();
+    printf("🕒 Tracing to %s\n", path);
+}
+
+void NnExecutor::stopTrace() {
+    if (traceFile == nullptr)
+        return;
+    fprintf(traceFile, "\n]}\n");
+    fclose(traceFile);
+    traceFile = nullptr;
+    for (NnSize threadIndex = 0; threadIndex < context.nThreads; threadIndex++) {
+        delete[] threads[threadIndex].traceEvents;
+        threads[threadIndex].traceEvents = nullptr;
+    }
+}
+
+void NnExecutor::writeTrace() {
+    NnSize pid = nodeConfig->nodeIndex;
+    for (NnSize threadIndex = 0; threadIndex < context.nThreads; threadIndex++) {
+        NnExecutorTraceEvent *events = threads[threadIndex].traceEvents;
+        for (NnSize stepIndex = 0; stepIndex < context.nSteps; stepIndex++) {
+            NnExecutorStep *step = &steps[stepIndex];
+            NnExecutorTraceEvent *event = &events[stepIndex];
+            NnSize batchSize = step->isOutput ? context.outputBatchSize : context.batchSize;
+            double ts = event->startTime / 1000.0;
+            double dur = (event->endTime - event->startTime) / 1000.0;
+
+            fprintf(traceFile, ",\n");
+            if (step->type == STEP_EXECUTE_OP) {
+                NnOpConfig *opConfig = step->opConfig;
+                fprintf(traceFile,
+                    "{\"name\":\"%s\",\"cat\":\"op\",\"ph\":\"X\",\"pid\":%u,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f,"
+                    "\"args\":{\"op\":\"%s\",\"layer\":%u,\"quant\":\"%s\",\"segment\":%u,\"forward\":%u,\"batchSize\":%u}}",
+                    opConfig->name, pid, threadIndex, ts, dur,
+                    opCodeToString(opConfig->code), opConfig->index, traceQuantNames[stepIndex], step->segmentIndex,
+                    nTracedForwards, batchSize);
+            } else {
+                const char *name = step->type == STEP_SYNC_NODES ? "sync_nodes" : "sync_pointers";
+                fprintf(traceFile,
+                    "{\"name\":\"%s\",\"cat\":\"sync\",\"ph\":\"X\",\"pid\":%u,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f,"
+                    "\"args\":{\"segment\":%u,\"forward\":%u,\"batchSize\":%u}}",
+                    name, pid, threadIndex, ts, dur,
+                    step->segmentIndex, nTracedForwards, batchSize);
+            }
+        }
+    }
+    nTracedForwards++;
 }
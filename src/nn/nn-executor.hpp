@@ -3,13 +3,22 @@
 
 #include "nn-core.hpp"
 #include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <exception>
+#include <mutex>
 #include <vector>
 #include "pthread.h"
 
+#define DEFAULT_SPIN_TIME 1000 // microseconds
+
 class NnDeviceSegment {
 public:
     virtual ~NnDeviceSegment() {};
     virtual void loadWeight(NnSize opIndex, NnSize nBytes, NnByte *weight) = 0;
+    // Uses the weight in place without copying, the memory must outlive the segment
+    virtual bool mapWeight(NnSize opIndex, NnSize nBytes, NnByte *weight) = 0;
     virtual void forward(NnSize opIndex, NnSize nThreads, NnSize threadIndex, NnSize batchSize) = 0;
 };
 
@@ -18,6 +27,7 @@ public:
     virtual NnSize maxNThreads() = 0;
     virtual NnDeviceSegment *createSegment(NnSize segmentIndex) = 0;
     virtual void syncPointers() = 0;
+    virtual void bindThread(NnSize threadIndex) = 0;
 };
 
 class NnNodeSynchronizer {
@@ -37,6 +47,7 @@ public:
     NnSize nThreads;
     NnByte **pipes;
     NnSize batchSize;
+    NnSize outputBatchSize; // number of leading rows processed by output segments
 private:
     NnSize nBatches;
     NnSize nPipes;
@@ -44,6 +55,7 @@ public:
     NnNetExecution(NnSize nThreads, NnNetConfig *netConfig);
     ~NnNetExecution();
     void setBatchSize(NnSize batchSize);
+    void setOutputBatchSize(NnSize outputBatchSize);
 };
 
 enum NnExecutorStepType {
@@ -57,8 +69,16 @@ typedef struct {
     NnDeviceSegment *segment;
     NnSize arg0;
     NnOpConfig *opConfig;
+    NnSize segmentIndex;
+    bool isOutput;
+    bool hasBarrier; // all threads must finish this step before any thread starts the next one
 } NnExecutorStep;
 
+typedef struct {
+    long long startTime; // nanoseconds since the trace start
+    long long endTime;
+} NnExecutorTraceEvent;
+
 typedef struct {
     NnSize nThreads;
     NnSize nSteps;
@@ -68,17 +88,42 @@ typedef struct {
     std::atomic_uint currentStepIndex;
     std::atomic_uint doneThreadCount;
     NnSize batchSize;
+    NnSize outputBatchSize;
+
+    // step barrier, threads spin up to spinTime microseconds, then sleep
+    NnSize spinTime;
+    std::mutex stepMutex;
+    std::condition_variable stepCond;
+    std::atomic_uint nSleepingThreads;
+
+    // set when a step of any thread throws, the other threads leave the forward at the next barrier
+    std::atomic_bool isAborted;
+    std::exception_ptr abortException; // guarded by stepMutex
+
+    // thread pool, threads [1..nThreads) are parked between forwards
+    std::mutex poolMutex;
+    std::condition_variable poolStartCond;
+    std::condition_variable poolDoneCond;
+    NnSize poolForwardIndex;
+    NnSize nPoolRunningThreads;
+    bool isPoolAlive;
+
+    std::chrono::steady_clock::time_point traceStartTime;
 } NnExecutorContext;
 
 typedef struct {
     NnSize threadIndex;
     NnExecutorContext *context;
     PthreadHandler handler;
+    unsigned long spinTime; // microseconds
+    unsigned long sleepTime; // microseconds
+    NnExecutorTraceEvent *traceEvents; // nullptr if tracing is disabled
 } NnExecutorThread;
 
 class NnExecutor {
 public:
     NnNetExecution *netExecution;
+    NnNetConfig *netConfig;
     NnNodeConfig *nodeConfig;
     std::vector<std::unique_ptr<NnDeviceSegment>> segments;
     std::vector<NnExecutorStep> steps;
@@ -87,7 +132,19 @@ public:
     NnExecutor(NnNetConfig *netConfig, NnNodeConfig *nodeConfig, NnDevice *device, NnNetExecution *netExecution, NnNodeSynchronizer *synchronizer);
     ~NnExecutor();
     void loadWeight(const char *name, NnSize index, NnSize nBytes, NnByte *weight);
+    bool mapWeight(const char *name, NnSize index, NnSize nBytes, NnByte *weight);
     void forward();
+    void setSpinTime(NnSize spinTime);
+    void getBarrierStats(unsigned long *spinTime, unsigned long *sleepTime);
+    void startTrace(const char *path);
+    void stopTrace();
+private:
+    FILE *traceFile;
+    NnSize nTracedForwards;
+    std::vector<const char *> traceQuantNames;
+    void stopPool(NnSize nStartedThreads);
+    void writeTrace();
+    NnDeviceSegment *findWeightSegment(const char *name, NnSize index, NnSize *opIndex);
 };
 
 #endif
\ No newline at end of file
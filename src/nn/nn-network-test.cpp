@@ -0,0 +1,340 @@
+#include "nn-core.hpp"
+#include "nn-config-builder.hpp"
+#include "nn-cpu.hpp"
+#include "nn-network.hpp"
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <csignal>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+#define N_BATCHES 2
+#define N 32
+#define D 48
+#define TEST_MODEL_FINGERPRINT 0x5EED
+
+static void buildConfig(NnSize nNodes, NnSyncType xSyncType, const float *nodeWeights, NnNetConfig *netConfig, NnNodeConfig *nodeConfigs, NnRowMatmulSlice *slices) {
+    std::vector<NnSize> starts(nNodes + 1);
+    splitNodeRanges(D, 1, nNodes, nodeWeights, starts.data());
+
+    NnNetConfigBuilder netBuilder(nNodes, N_BATCHES);
+    NnSize xPipeIndex = netBuilder.addPipe("X", size2D(F_32, N_BATCHES, N));
+    NnSize yPipeIndex = nodeWeights != nullptr
+        ? netBuilder.addSlicedPipe("Y", size2D(F_32, N_BATCHES, D), starts.data())
+        : netBuilder.addPipe("Y", size2D(F_32, N_BATCHES, D));
+
+    for (NnSize nodeIndex = 0; nodeIndex < nNodes; nodeIndex++) {
+        NnRowMatmulSlice *slice = &slices[nodeIndex];
+        *slice = sliceRowMatmul(F_32, N, D, starts[nodeIndex], starts[nodeIndex + 1] - starts[nodeIndex]);
+
+        NnNodeConfigBuilder nodeBuilder(nodeIndex);
+        NnSize yBufferIndex = nodeBuilder.addBuffer("y", size2D(F_32, N_BATCHES, slice->d0));
+
+        NnSegmentConfigBuilder start;
+        start.addSync(xPipeIndex, xSyncType);
+        nodeBuilder.addSegment(start.build());
+
+        NnSegmentConfigBuilder matmul;
+        matmul.addOp(OP_MATMUL, "matmul", 0,
+            pointerConfig(PNTR_PIPE, xPipeIndex),
+            pointerConfig(PNTR_BUFFER, yBufferIndex),
+            size2D(F_32, slice->n, slice->d0),
+            NnMatmulOpConfig{});
+        matmul.addOp(OP_CAST, "cast", 0,
+            pointerConfig(PNTR_BUFFER, yBufferIndex),
+            slicedPointerConfig(PNTR_PIPE, yPipeIndex),
+            size0(),
+            NnCastOpCodeConfig{});
+        matmul.addSync(yPipeIndex, SYNC_NODE_SLICES);
+        nodeBuilder.addSegment(matmul.build());
+
+        nodeConfigs[nodeIndex] = nodeBuilder.build();
+    }
+    *netConfig = netBuilder.build();
+}
+
+// X passes through every node, the last node computes Y and sends it back to the root
+static void buildPipelineConfig(NnSize nNodes, NnNetConfig *netConfig, NnNodeConfig *nodeConfigs, NnRowMatmulSlice *slices) {
+    for (NnSize nodeIndex = 0; nodeIndex < nNodes; nodeIndex++)
+        slices[nodeIndex] = sliceRowMatmul(F_32, N, D, 0, D);
+
+    NnNetConfigBuilder netBuilder(nNodes, N_BATCHES);
+    NnSize xPipeIndex = netBuilder.addPipe("X", size2D(F_32, N_BATCHES, N));
+    NnSize yPipeIndex = netBuilder.addPipe("Y", size2D(F_32, N_BATCHES, D));
+
+    for (NnSize nodeIndex = 0; nodeIndex < nNodes; nodeIndex++) {
+        NnNodeConfigBuilder nodeBuilder(nodeIndex);
+        NnSize yBufferIndex = nodeBuilder.addBuffer("y", size2D(F_32, N_BATCHES, D));
+
+        if (nodeIndex > 0) {
+            NnSegmentConfigBuilder start;
+            start.addSync(xPipeIndex, SYNC_PIPELINE_RECV);
+            nodeBuilder.addSegment(start.build());
+        }
+
+        NnSegmentConfigBuilder stage;
+        if (nodeIndex == nNodes - 1) {
+            stage.addOp(OP_MATMUL, "matmul", 0,
+                pointerConfig(PNTR_PIPE, xPipeIndex),
+                pointerConfig(PNTR_BUFFER, yBufferIndex),
+                size2D(F_32, N, D),
+                NnMatmulOpConfig{});
+            stage.addOp(OP_CAST, "cast", 0,
+                pointerConfig(PNTR_BUFFER, yBufferIndex),
+                pointerConfig(PNTR_PIPE, yPipeIndex),
+                size0(),
+                NnCastOpCodeConfig{});
+        }
+        nodeBuilder.addSegment(stage.build());
+
+        NnSegmentConfigBuilder end;
+        if (nodeIndex == nNodes - 1)
+            end.addSync(yPipeIndex, SYNC_PIPELINE_SEND);
+        else
+            end.addSync(xPipeIndex, SYNC_PIPELINE_SEND);
+        nodeBuilder.addSegment(end.build());
+
+        if (nodeIndex == 0) {
+            NnSegmentConfigBuilder output;
+            output.addSync(yPipeIndex, SYNC_PIPELINE_RECV);
+            nodeBuilder.addSegment(output.build());
+        }
+        nodeConfigs[nodeIndex] = nodeBuilder.build();
+    }
+    *netConfig = netBuilder.build();
+}
+
+static void assertOutput(const char *name, NnSize nodeIndex, float *y, float *expectedY) {
+    for (NnSize i = 0; i < N_BATCHES * D; i++) {
+        if (fabs(y[i] - expectedY[i]) > 0.0001f) {
+            printf("❌ %s failed on node %u: y[%u] = %f != %f\n", name, nodeIndex, i, y[i], expectedY[i]);
+            exit(1);
+        }
+    }
+}
+
+static void runWorker(NnNetwork *network, float *expectedY, const char *name, NnSize nodeIndex, bool hasOutput, const char *shardPrefix) {
+    NnWorkerConfigReader configReader(network);
+    NnNetConfig netConfig = configReader.readNet();
+    NnNodeConfig nodeConfig = configReader.readNode();
+
+    NnNetExecution execution(1, &netConfig);
+    NnNetworkNodeSynchronizer synchronizer(network, &execution, &netConfig, &nodeConfig);
+    NnCpuDevice device(&netConfig, &nodeConfig, &execution);
+    NnExecutor executor(&netConfig, &nodeConfig, &device, &execution, &synchronizer);
+    NnWorkerWeightReader weightReader(&executor, network);
+    std::string shardPath = shardPrefix != nullptr ? std::string(shardPrefix) + "-" + std::to_string(nodeIndex) + ".shard" : "";
+    if (shardPrefix != nullptr)
+        weightReader.setShardPath(shardPath.c_str());
+    weightReader.read();
+
+    execution.setBatchSize(N_BATCHES);
+    executor.forward();
+    if (hasOutput)
+        assertOutput(name, nodeIndex, (float *)execution.pipes[1], expectedY);
+
+    releaseNetConfig(&netConfig);
+    releaseNodeConfig(&nodeConfig);
+}
+
+static void initWeight(float *weight) {
+    for (NnSize i = 0; i < D * N; i++)
+        weight[i] = (float)(i % 13) / 13.0f - 0.25f;
+}
+
+// Runs the root and the workers on threads of this process, every node must end with the full output.
+// Workers with a shard prefix try their shard first, the root then sends only the weights that are missing.
+static void testLoopbackCluster(const char *name, NnSize nNodes, NnSyncType xSyncType, NnLinkShaper shaper, bool isPipeline, const float *nodeWeights,
+    const char *shardPrefix = nullptr) {
+    float x[N_BATCHES * N];
+    float weight[D * N];
+    float expectedY[N_BATCHES * D];
+    for (NnSize i = 0; i < N_BATCHES * N; i++)
+        x[i] = (float)(i % 7) / 7.0f - 0.5f;
+    initWeight(weight);
+    for (NnSize b = 0; b < N_BATCHES; b++) {
+        for (NnSize d = 0; d < D; d++) {
+            float sum = 0.0f;
+            for (NnSize n = 0; n < N; n++)
+                sum += weight[d * N + n] * x[b * N + n];
+            expectedY[b * D + d] = sum;
+        }
+    }
+
+    NnNetConfig netConfig;
+    NnNodeConfig *nodeConfigs = new NnNodeConfig[nNodes];
+    std::vector<NnRowMatmulSlice> slices(nNodes);
+    if (isPipeline)
+        buildPipelineConfig(nNodes, &netConfig, nodeConfigs, slices.data());
+    else
+        buildConfig(nNodes, xSyncType, nodeWeights, &netConfig, nodeConfigs, slices.data());
+
+    std::vector<std::unique_ptr<NnNetwork>> networks = NnNetwork::createLoopback(nNodes);
+    for (NnSize nodeIndex = 0; nodeIndex < nNodes; nodeIndex++)
+        networks[nodeIndex]->setLinkShaper(shaper);
+    std::vector<std::thread> workers;
+    for (NnSize nodeIndex = 1; nodeIndex < nNodes; nodeIndex++)
+        workers.push_back(std::thread(runWorker, networks[nodeIndex].get(), expectedY, name, nodeIndex, !isPipeline || nodeIndex == nNodes - 1, shardPrefix));
+
+    NnNetwork *network = networks[0].get();
+    NnRootConfigWriter configWriter(network);
+    configWriter.writeToWorkers(&netConfig, nodeConfigs);
+
+    NnNetExecution execution(1, &netConfig);
+    NnNetworkNodeSynchronizer synchronizer(network, &execution, &netConfig, &nodeConfigs[0]);
+    NnCpuDevice device(&netConfig, &nodeConfigs[0], &execution);
+    NnExecutor executor(&netConfig, &nodeConfigs[0], &device, &execution, &synchronizer);
+    NnRootWeightLoader weightLoader(&executor, network, nNodes);
+    weightLoader.setModelFingerprint(TEST_MODEL_FINGERPRINT);
+    if (isPipeline)
+        weightLoader.loadNode(nNodes - 1, "matmul", 0, slices[0].size.nBytes, (NnByte *)weight);
+    else
+        weightLoader.loadRowMatmulSlices("matmul", 0, slices.data(), (NnByte *)weight);
+    weightLoader.finish();
+
+    std::memcpy(execution.pipes[0], x, sizeof(x));
+    execution.setBatchSize(N_BATCHES);
+    executor.forward();
+    assertOutput(name, 0, (float *)execution.pipes[1], expectedY);
+
+    for (std::thread &worker : workers)
+        worker.join();
+    for (NnSize nodeIndex = 0; nodeIndex < nNodes; nodeIndex++)
+        releaseNodeConfig(&nodeConfigs[nodeIndex]);
+    delete[] nodeConfigs;
+    releaseNetConfig(&netConfig);
+    printf("✅ %24s passed\n", name);
+}
+
+static void runDisconnectedWorker(NnNetwork *network, bool *hasThrown) {
+    NnWorkerConfigReader configReader(network);
+    NnNetConfig netConfig = configReader.readNet();
+    NnNodeConfig nodeConfig = configReader.readNode();
+    {
+        // More than one thread if possible, so the pool threads must leave the barrier too
+        NnSize nThreads = std::max(1u, std::min(2u, std::thread::hardware_concurrency()));
+        NnNetExecution execution(nThreads, &netConfig);
+        NnNetworkNodeSynchronizer synchronizer(network, &execution, &netConfig, &nodeConfig);
+        NnCpuDevice device(&netConfig, &nodeConfig, &execution);
+        NnExecutor executor(&netConfig, &nodeConfig, &device, &execution, &synchronizer);
+        NnWorkerWeightReader weightReader(&executor, network);
+        weightReader.read();
+
+        execution.setBatchSize(N_BATCHES);
+        try {
+            executor.forward();
+        } catch (const NnReadNetworkException &e) {
+            *hasThrown = true;
+        } catch (const NnWriteNetworkException &e) {
+            *hasThrown = true;
+        }
+    }
+    releaseNetConfig(&netConfig);
+    releaseNodeConfig(&nodeConfig);
+}
+
+// Node 1 has slices of the same size under both layouts but at different offsets, so its shard
+// must be rejected by the config fingerprint, otherwise the output would be computed from wrong rows
+static void testShardOfOtherLayout() {
+    const char *prefix = "nn-network-test";
+    const NnSize nNodes = 3;
+    float shardWeights[] = {2.0f, 1.0f, 1.0f};
+    float rootWeights[] = {1.0f, 1.0f, 2.0f};
+    float weight[D * N];
+    initWeight(weight);
+
+    NnNetConfig netConfig;
+    NnNodeConfig nodeConfigs[nNodes];
+    NnRowMatmulSlice slices[nNodes];
+    buildConfig(nNodes, SYNC_WITH_ROOT, shardWeights, &netConfig, nodeConfigs, slices);
+    {
+        NnRootWeightLoader weightLoader(nullptr, nullptr, nNodes);
+        weightLoader.setModelFingerprint(TEST_MODEL_FINGERPRINT);
+        weightLoader.enableShardOutput(prefix, &netConfig, nodeConfigs);
+        weightLoader.loadRowMatmulSlices("matmul", 0, slices, (NnByte *)weight);
+        weightLoader.finish();
+    }
+    for (NnSize nodeIndex = 0; nodeIndex < nNodes; nodeIndex++)
+        releaseNodeConfig(&nodeConfigs[nodeIndex]);
+    releaseNetConfig(&netConfig);
+
+    NnLinkShaper noShaper = {0, 0};
+    testLoopbackCluster("loopback_shard_of_other_layout", nNodes, SYNC_WITH_ROOT, noShaper, false, rootWeights, prefix);
+    for (NnSize nodeIndex = 1; nodeIndex < nNodes; nodeIndex++)
+        std::remove((std::string(prefix) + "-" + std::to_string(nodeIndex) + ".shard").c_str());
+}
+
+// The root sends the input and disconnects, the worker must leave the forward with an exception and
+// release its executor instead of waiting for its threads forever
+static void testRootDisconnect() {
+    const char *name = "loopback_root_disconnect";
+    const NnSize nNodes = 2;
+    float x[N_BATCHES * N];
+    float weight[D * N];
+    for (NnSize i = 0; i < N_BATCHES * N; i++)
+        x[i] = (float)(i % 7) / 7.0f - 0.5f;
+    initWeight(weight);
+
+    NnNetConfig netConfig;
+    NnNodeConfig nodeConfigs[nNodes];
+    NnRowMatmulSlice slices[nNodes];
+    buildConfig(nNodes, SYNC_WITH_ROOT, nullptr, &netConfig, nodeConfigs, slices);
+
+    std::vector<std::unique_ptr<NnNetwork>> networks = NnNetwork::createLoopback(nNodes);
+    bool hasThrown = false;
+    std::thread worker(runDisconnectedWorker, networks[1].get(), &hasThrown);
+    {
+        NnNetwork *network = networks[0].get();
+        NnRootConfigWriter configWriter(network);
+        configWriter.writeToWorkers(&netConfig, nodeConfigs);
+
+        NnNetExecution execution(1, &netConfig);
+        NnNetworkNodeSynchronizer synchronizer(network, &execution, &netConfig, &nodeConfigs[0]);
+        NnCpuDevice device(&netConfig, &nodeConfigs[0], &execution);
+        NnExecutor executor(&netConfig, &nodeConfigs[0], &device, &execution, &synchronizer);
+        NnRootWeightLoader weightLoader(&executor, network, nNodes);
+        weightLoader.loadRowMatmulSlices("matmul", 0, slices, (NnByte *)weight);
+        weightLoader.finish();
+
+        // The worker receives X and computes its slice of Y, the root is gone before Y is exchanged
+        network->write(0, x, sizeof(x));
+        networks[0].reset();
+    }
+    worker.join();
+
+    for (NnSize nodeIndex = 0; nodeIndex < nNodes; nodeIndex++)
+        releaseNodeConfig(&nodeConfigs[nodeIndex]);
+    releaseNetConfig(&netConfig);
+    if (!hasThrown) {
+        printf("❌ %s failed: the worker did not leave the forward with an exception\n", name);
+        exit(1);
+    }
+    printf("✅ %24s passed\n", name);
+}
+
+int main() {
+    initQuants();
+    initSockets();
+#ifndef _WIN32
+    // The worker of the disconnect test writes to a closed socket
+    signal(SIGPIPE, SIG_IGN);
+#endif
+
+    NnLinkShaper noShaper = {0, 0};
+    NnLinkShaper gigabitShaper = {1000000000ull, 100};
+    float rootLightWeights[] = {1.0f, 3.0f, 2.0f};
+    testLoopbackCluster("loopback_2_nodes", 2, SYNC_WITH_ROOT, noShaper, false, nullptr);
+    testLoopbackCluster("loopback_3_nodes", 3, SYNC_WITH_ROOT, noShaper, false, nullptr);
+    testLoopbackCluster("loopback_4_nodes_tree", 4, SYNC_TREE_FROM_ROOT, noShaper, false, nullptr);
+    testLoopbackCluster("loopback_4_nodes_1gb", 4, SYNC_WITH_ROOT, gigabitShaper, false, nullptr);
+    testLoopbackCluster("loopback_3_pipeline", 3, SYNC_WITH_ROOT, noShaper, true, nullptr);
+    testLoopbackCluster("loopback_3_weighted", 3, SYNC_WITH_ROOT, noShaper, false, rootLightWeights);
+    testShardOfOtherLayout();
+    testRootDisconnect();
+
+    cleanupSockets();
+    return 0;
+}
@@ -6,22 +6,49 @@ typedef SSIZE_T ssize_t;
 #define close closesocket
 #else
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <poll.h>
 #include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <unistd.h>
+#include <sys/mman.h>
+#endif
+#ifdef __linux__
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <climits>
+#include <ctime>
+#define SHM_TRANSPORT
 #endif
 #include "nn-network.hpp"
 #include <cassert>
 #include <cstring>
 #include <stdexcept>
 #include <vector>
+#include <chrono>
 #include <fcntl.h>
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <string>
+#include <thread>
 
 #define SOCKET_LAST_ERRCODE errno
 #define SOCKET_LAST_ERROR strerror(errno)
 
 #define ACK 23571113
 #define ONE_MB 1048576
+#define MAX_IO_VECTORS 64
+#define POLL_TIMEOUT_MS 1000
+
+#ifdef MSG_DONTWAIT
+#define IO_DONTWAIT MSG_DONTWAIT
+#else
+#define IO_DONTWAIT 0
+#endif
 
 static inline bool isEagainError() {
     #ifdef _WIN32
@@ -31,6 +58,14 @@ static inline bool isEagainError() {
     #endif
 }
 
+static inline int pollSockets(struct pollfd *fds, NnSize n, int timeoutMs) {
+#ifdef _WIN32
+    return WSAPoll(fds, n, timeoutMs);
+#else
+    return poll(fds, n, timeoutMs);
+#endif
+}
+
 static inline void setNonBlocking(int socket, bool enabled) {
 #ifdef _WIN32
     u_long mode = enabled ? 1 : 0;
@@ -97,13 +132,20 @@ void writeSocket(int socket, const void *data, size_t size) {
     }
 }
 
-static inline bool tryReadSocket(int socket, void *data, size_t size, unsigned long maxAttempts) {
-    // maxAttempts = 0 means infinite attempts
+static inline bool tryReadSocket(int socket, void *data, size_t size, unsigned long maxAttempts, bool wait) {
+    // maxAttempts = 0 means infinite attempts, if wait is set each attempt waits up to 1 ms for data
     size_t s = size;
     while (s > 0) {
         ssize_t r = recv(socket, (char*)data, s, 0);
         if (r < 0) {
             if (isEagainError()) {
+                if (wait) {
+                    struct pollfd fd;
+                    fd.fd = socket;
+                    fd.events = POLLIN;
+                    fd.revents = 0;
+                    pollSockets(&fd, 1, 1);
+                }
                 if (s == size && maxAttempts > 0) {
                     maxAttempts--;
                     if (maxAttempts == 0) {
@@ -123,7 +165,7 @@ static inline bool tryReadSocket(int socket, void *data, size_t size, unsigned l
 }
 
 void readSocket(int socket, void *data, size_t size) {
-    if (!tryReadSocket(socket, data, size, 0)) {
+    if (!tryReadSocket(socket, data, size, 0, false)) {
         throw std::runtime_error("Error reading from socket");
     }
 }
@@ -251,7 +293,315 @@ NnWriteNetworkException::NnWriteNetworkException(int code, const char *message)
     this->message = message;
 }
 
-std::unique_ptr<NnNetwork> NnNetwork::serve(int port) {
+// Shared-memory transport for peers on the same host. Each link has one single-producer, single-consumer
+// ring per direction, the TCP socket stays open to detect a closed peer.
+
+#define SHM_RING_SIZE 1048576 // must be a power of two
+#define SHM_SPIN_COUNT 4096
+#define SHM_WAIT_US 10000
+#define SHM_MIXED_WAIT_US 100
+
+struct NnShmRing {
+    std::atomic<uint32_t> head; // total bytes written, wraps around
+    std::atomic<uint32_t> isReaderWaiting;
+    char headPadding[56];
+    std::atomic<uint32_t> tail; // total bytes read, wraps around
+    std::atomic<uint32_t> isWriterWaiting;
+    char tailPadding[56];
+    NnByte data[SHM_RING_SIZE];
+};
+
+struct NnShmSegment {
+    uint64_t nonce;
+    NnShmRing rings[2]; // [0] from the connecting node, [1] from the accepting node
+};
+
+struct NnShmLink {
+    NnShmSegment *segment;
+    NnShmRing *tx;
+    NnShmRing *rx;
+};
+
+typedef struct {
+    uint32_t isEnabled;
+    char hostId[64];
+} NnShmHello;
+
+typedef struct {
+    uint32_t isCreated;
+    char name[64];
+    uint64_t nonce;
+} NnShmOffer;
+
+static void futexWait(std::atomic<uint32_t> *address, uint32_t value, long timeoutUs) {
+#ifdef SHM_TRANSPORT
+    struct timespec timeout;
+    timeout.tv_sec = timeoutUs / 1000000;
+    timeout.tv_nsec = (timeoutUs % 1000000) * 1000;
+    syscall(SYS_futex, (uint32_t *)address, FUTEX_WAIT, value, &timeout, nullptr, 0);
+#endif
+}
+
+static void futexWake(std::atomic<uint32_t> *address) {
+#ifdef SHM_TRANSPORT
+    syscall(SYS_futex, (uint32_t *)address, FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+#endif
+}
+
+static size_t writeShmRing(NnShmRing *ring, const NnByte *data, size_t size) {
+    uint32_t head = ring->head.load(std::memory_order_relaxed);
+    uint32_t tail = ring->tail.load(std::memory_order_acquire);
+    size_t n = std::min(size, (size_t)(SHM_RING_SIZE - (uint32_t)(head - tail)));
+    if (n == 0)
+        return 0;
+    size_t offset = head & (SHM_RING_SIZE - 1);
+    size_t first = std::min(n, (size_t)SHM_RING_SIZE - offset);
+    std::memcpy(&ring->data[offset], data, first);
+    std::memcpy(ring->data, &data[first], n - first);
+    ring->head.store(head + (uint32_t)n, std::memory_order_seq_cst);
+    if (ring->isReaderWaiting.load(std::memory_order_seq_cst))
+        futexWake(&ring->head);
+    return n;
+}
+
+static size_t readShmRing(NnShmRing *ring, NnByte *data, size_t size) {
+    uint32_t tail = ring->tail.load(std::memory_order_relaxed);
+    uint32_t head = ring->head.load(std::memory_order_acquire);
+    size_t n = std::min(size, (size_t)(uint32_t)(head - tail));
+    if (n == 0)
+        return 0;
+    size_t offset = tail & (SHM_RING_SIZE - 1);
+    size_t first = std::min(n, (size_t)SHM_RING_SIZE - offset);
+    std::memcpy(data, &ring->data[offset], first);
+    std::memcpy(&data[first], ring->data, n - first);
+    ring->tail.store(tail + (uint32_t)n, std::memory_order_seq_cst);
+    if (ring->isWriterWaiting.load(std::memory_order_seq_cst))
+        futexWake(&ring->tail);
+    return n;
+}
+
+static void waitForShmSpace(NnShmRing *ring, long timeoutUs) {
+    uint32_t head = ring->head.load(std::memory_order_relaxed);
+    ring->isWriterWaiting.store(1, std::memory_order_seq_cst);
+    uint32_t tail = ring->tail.load(std::memory_order_seq_cst);
+    if ((uint32_t)(head - tail) == SHM_RING_SIZE)
+        futexWait(&ring->tail, tail, timeoutUs);
+    ring->isWriterWaiting.store(0, std::memory_order_relaxed);
+}
+
+static void waitForShmData(NnShmRing *ring, long timeoutUs) {
+    uint32_t tail = ring->tail.load(std::memory_order_relaxed);
+    ring->isReaderWaiting.store(1, std::memory_order_seq_cst);
+    uint32_t head = ring->head.load(std::memory_order_seq_cst);
+    if (head == tail)
+        futexWait(&ring->head, head, timeoutUs);
+    ring->isReaderWaiting.store(0, std::memory_order_relaxed);
+}
+
+static void checkShmPeer(int socket, bool isWriting) {
+    // Nothing else is sent over the socket of a shared-memory link, so a readable end of stream means the peer is gone
+#ifdef SHM_TRANSPORT
+    char byte;
+    ssize_t r = recv(socket, &byte, 1, MSG_PEEK | MSG_DONTWAIT);
+    if (r == 0 || (r < 0 && !isEagainError())) {
+        if (isWriting)
+            throw NnWriteNetworkException(0, "Socket closed");
+        throw NnReadNetworkException(0, "Socket closed");
+    }
+#endif
+}
+
+static void writeShm(NnShmLink *link, int socket, const void *data, size_t size) {
+    unsigned int nIdleAttempts = 0;
+    while (size > 0) {
+        size_t s = writeShmRing(link->tx, (const NnByte *)data, size);
+        if (s == 0) {
+            if (++nIdleAttempts < SHM_SPIN_COUNT)
+                continue;
+            waitForShmSpace(link->tx, SHM_WAIT_US);
+            checkShmPeer(socket, true);
+            continue;
+        }
+        nIdleAttempts = 0;
+        size -= s;
+        data = (const NnByte *)data + s;
+    }
+}
+
+static bool tryReadShm(NnShmLink *link, int socket, void *data, size_t size, unsigned long maxAttempts, bool wait) {
+    // Same contract as tryReadSocket, a waiting attempt sleeps on the futex up to 1 ms
+    size_t s = size;
+    unsigned int nIdleAttempts = 0;
+    while (s > 0) {
+        size_t r = readShmRing(link->rx, (NnByte *)data, s);
+        if (r == 0) {
+            if (s == size && maxAttempts > 0) {
+                maxAttempts--;
+                if (maxAttempts == 0)
+                    return false;
+            }
+            if (!wait && ++nIdleAttempts < SHM_SPIN_COUNT)
+                continue;
+            nIdleAttempts = 0;
+            waitForShmData(link->rx, wait ? 1000 : SHM_WAIT_US);
+            checkShmPeer(socket, false);
+            continue;
+        }
+        nIdleAttempts = 0;
+        data = (NnByte *)data + r;
+        s -= r;
+    }
+    return true;
+}
+
+static ssize_t sendShmIo(NnShmLink *link, NnSocketIo *io, size_t offset) {
+    // Behaves like a non-blocking send, EAGAIN when the ring is full
+    size_t total = io->size * io->nRows;
+    size_t n = 0;
+    while (offset + n < total) {
+        size_t position = offset + n;
+        size_t rowOffset = position % io->size;
+        const NnByte *row = (const NnByte *)io->data + (position / io->size) * io->rowStride;
+        size_t s = writeShmRing(link->tx, &row[rowOffset], io->size - rowOffset);
+        n += s;
+        if (s < io->size - rowOffset)
+            break;
+    }
+    if (n == 0) {
+        errno = EAGAIN;
+        return -1;
+    }
+    return (ssize_t)n;
+}
+
+static ssize_t recvShmIo(NnShmLink *link, NnSocketIo *io, size_t offset) {
+    size_t total = io->size * io->nRows;
+    size_t n = 0;
+    while (offset + n < total) {
+        size_t position = offset + n;
+        size_t rowOffset = position % io->size;
+        NnByte *row = (NnByte *)io->data + (position / io->size) * io->rowStride;
+        size_t r = readShmRing(link->rx, &row[rowOffset], io->size - rowOffset);
+        n += r;
+        if (r < io->size - rowOffset)
+            break;
+    }
+    if (n == 0) {
+        errno = EAGAIN;
+        return -1;
+    }
+    return (ssize_t)n;
+}
+
+#ifdef SHM_TRANSPORT
+static void readHostId(char *hostId, size_t size) {
+    // Processes that share a kernel boot may share /dev/shm, the nonce check confirms it
+    std::memset(hostId, 0, size);
+    FILE *file = fopen("/proc/sys/kernel/random/boot_id", "r");
+    if (file == nullptr)
+        return;
+    if (fgets(hostId, size, file) == nullptr)
+        hostId[0] = '\0';
+    fclose(file);
+}
+
+static NnShmSegment *mapShmSegment(int fd) {
+    void *address = mmap(nullptr, sizeof(NnShmSegment), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    return address == MAP_FAILED ? nullptr : (NnShmSegment *)address;
+}
+
+static NnShmSegment *createShmSegment(char *name, size_t nameSize, uint64_t nonce) {
+    static std::atomic_uint counter(0);
+    snprintf(name, nameSize, "/dllama-%d-%u-%llx", (int)getpid(), counter++, (unsigned long long)nonce);
+    int fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0600);
+    if (fd < 0)
+        return nullptr;
+    // The pages are reserved up front: tmpfs allocates them lazily, so a full /dev/shm (64 MB by default in
+    // Docker) would raise SIGBUS on the first write to the ring instead of falling back to TCP here
+    if (posix_fallocate(fd, 0, sizeof(NnShmSegment)) != 0) {
+        close(fd);
+        shm_unlink(name);
+        return nullptr;
+    }
+    NnShmSegment *segment = mapShmSegment(fd);
+    if (segment == nullptr) {
+        shm_unlink(name);
+        return nullptr;
+    }
+    segment->nonce = nonce;
+    return segment;
+}
+#endif
+
+static NnShmLink *connectShmLink(int socket, bool isConnecting, bool isEnabled) {
+    // Both nodes send a hello, if they run on the same host the connecting node creates the segment
+    NnShmHello myHello;
+    NnShmHello peerHello;
+    std::memset(&myHello, 0, sizeof(myHello));
+#ifdef SHM_TRANSPORT
+    myHello.isEnabled = isEnabled ? 1 : 0;
+    if (isEnabled)
+        readHostId(myHello.hostId, sizeof(myHello.hostId));
+#endif
+    writeSocket(socket, &myHello, sizeof(myHello));
+    readSocket(socket, &peerHello, sizeof(peerHello));
+    if (!myHello.isEnabled || !peerHello.isEnabled || myHello.hostId[0] == '\0' ||
+        std::strncmp(myHello.hostId, peerHello.hostId, sizeof(myHello.hostId)) != 0)
+        return nullptr;
+
+#ifdef SHM_TRANSPORT
+    NnShmSegment *segment = nullptr;
+    NnShmOffer offer;
+    uint32_t isAccepted;
+    if (isConnecting) {
+        std::memset(&offer, 0, sizeof(offer));
+        offer.nonce = ((uint64_t)std::chrono::steady_clock::now().time_since_epoch().count() << 16) ^ (uint64_t)getpid();
+        segment = createShmSegment(offer.name, sizeof(offer.name), offer.nonce);
+        offer.isCreated = segment != nullptr ? 1 : 0;
+        writeSocket(socket, &offer, sizeof(offer));
+        readSocket(socket, &isAccepted, sizeof(isAccepted));
+        if (segment != nullptr)
+            shm_unlink(offer.name);
+        if (segment != nullptr && !isAccepted) {
+            munmap(segment, sizeof(NnShmSegment));
+            segment = nullptr;
+        }
+    } else {
+        readSocket(socket, &offer, sizeof(offer));
+        if (offer.isCreated) {
+            offer.name[sizeof(offer.name) - 1] = '\0';
+            int fd = shm_open(offer.name, O_RDWR, 0600);
+            if (fd >= 0)
+                segment = mapShmSegment(fd);
+            if (segment != nullptr && segment->nonce != offer.nonce) {
+                munmap(segment, sizeof(NnShmSegment));
+                segment = nullptr;
+            }
+        }
+        isAccepted = segment != nullptr ? 1 : 0;
+        writeSocket(socket, &isAccepted, sizeof(isAccepted));
+    }
+    if (segment == nullptr)
+        return nullptr;
+    NnShmLink *link = new NnShmLink;
+    link->segment = segment;
+    link->tx = &segment->rings[isConnecting ? 0 : 1];
+    link->rx = &segment->rings[isConnecting ? 1 : 0];
+    return link;
+#else
+    return nullptr;
+#endif
+}
+
+static void releaseShmLink(NnShmLink *link) {
+#ifdef SHM_TRANSPORT
+    munmap(link->segment, sizeof(NnShmSegment));
+#endif
+    delete link;
+}
+
+std::unique_ptr<NnNetwork> NnNetwork::serve(int port, bool useSharedMemory) {
     int serverSocket = createServerSocket(port);
 
     NnSize nSockets;
@@ -297,6 +647,18 @@ std::unique_ptr<NnNetwork> NnNetwork::serve(int port) {
         }
     }
 
+    // Every node negotiates its links in the socket order, so pairs cannot wait for each other in a cycle
+    NnShmLink **links = new NnShmLink*[nSockets];
+    for (NnSize i = 0; i < nNodes; i++) {
+        NnSize socketIndex = i + 1;
+        links[socketIndex] = connectShmLink(sockets[socketIndex], i >= nodeIndex, useSharedMemory);
+        if (links[socketIndex] != nullptr)
+            printf("⭕ Socket[%d]: shared memory\n", socketIndex);
+    }
+    links[0] = connectShmLink(rootSocket, false, useSharedMemory);
+    if (links[0] != nullptr)
+        printf("⭕ Socket[0]: shared memory\n");
+
     for (NnSize i = 0; i < nNodes; i++)
         delete[] hosts[i];
     delete[] hosts;
@@ -305,10 +667,10 @@ std::unique_ptr<NnNetwork> NnNetwork::serve(int port) {
     shutdown(serverSocket, 2);
     close(serverSocket);
     printf("⭕ Network is initialized\n");
-    return std::unique_ptr<NnNetwork>(new NnNetwork(nSockets, sockets));
+    return std::unique_ptr<NnNetwork>(new NnNetwork(nSockets, sockets, links));
 }
 
-std::unique_ptr<NnNetwork> NnNetwork::connect(NnSize nSockets, char **hosts, NnSize *ports) {
+std::unique_ptr<NnNetwork> NnNetwork::connect(NnSize nSockets, char **hosts, NnSize *ports, bool useSharedMemory) {
     assert(nSockets > 0);
 
     int *sockets = new int[nSockets];
@@ -334,23 +696,71 @@ std::unique_ptr<NnNetwork> NnNetwork::connect(NnSize nSockets, char **hosts, NnS
     for (NnSize i = 0; i < nSockets; i++) {
         writeAckPacket(sockets[i]);
     }
+    NnShmLink **links = new NnShmLink*[nSockets];
+    for (NnSize i = 0; i < nSockets; i++) {
+        links[i] = connectShmLink(sockets[i], true, useSharedMemory);
+        if (links[i] != nullptr)
+            printf("⭕ Socket[%d]: shared memory\n", i);
+    }
     printf("⭕ Network is initialized\n");
-    return std::unique_ptr<NnNetwork>(new NnNetwork(nSockets, sockets));
+    return std::unique_ptr<NnNetwork>(new NnNetwork(nSockets, sockets, links));
 }
 
-NnNetwork::NnNetwork(NnSize nSockets, int *sockets) {
+std::vector<std::unique_ptr<NnNetwork>> NnNetwork::createLoopback(NnSize nNodes) {
+    assert(nNodes > 1);
+    NnSize nSockets = nNodes - 1;
+    std::vector<int *> sockets(nNodes);
+    for (NnSize i = 0; i < nNodes; i++)
+        sockets[i] = new int[nSockets];
+    for (NnSize i = 0; i < nNodes; i++) {
+        for (NnSize j = i + 1; j < nNodes; j++) {
+#ifdef _WIN32
+            throw std::runtime_error("Loopback network is not supported on Windows");
+#else
+            int pair[2];
+            if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair) != 0)
+                throw std::runtime_error("Cannot create socket pair: " + std::string(SOCKET_LAST_ERROR));
+            // The same mapping as in serve(), a node skips itself in the list of peers
+            sockets[i][j - 1] = pair[0];
+            sockets[j][i] = pair[1];
+#endif
+        }
+    }
+    std::vector<std::unique_ptr<NnNetwork>> networks;
+    for (NnSize i = 0; i < nNodes; i++) {
+        NnShmLink **links = new NnShmLink*[nSockets];
+        for (NnSize j = 0; j < nSockets; j++)
+            links[j] = nullptr;
+        networks.push_back(std::unique_ptr<NnNetwork>(new NnNetwork(nSockets, sockets[i], links)));
+    }
+    return networks;
+}
+
+NnNetwork::NnNetwork(NnSize nSockets, int *sockets, NnShmLink **links) {
     this->nSockets = nSockets;
     this->sockets = sockets;
+    this->links = links;
+    this->shaper.bitsPerSecond = 0;
+    this->shaper.latencyUs = 0;
+    this->linkFreeTimes.resize(nSockets, 0.0);
     this->sentBytes.exchange(0);
     this->recvBytes.exchange(0);
+    this->waitType = NET_WAIT_SPIN;
+    this->waitTimes = new std::atomic_ulong[nSockets];
+    for (NnSize i = 0; i < nSockets; i++)
+        this->waitTimes[i].exchange(0);
 }
 
 NnNetwork::~NnNetwork() {
     for (NnSize i = 0; i < nSockets; i++) {
+        if (links[i] != nullptr)
+            releaseShmLink(links[i]);
         shutdown(sockets[i], 2);
         close(sockets[i]);
     }
+    delete[] links;
     delete[] sockets;
+    delete[] waitTimes;
     printf("⭕ Network is closed\n");
 }
 
@@ -360,12 +770,60 @@ void NnNetwork::setTurbo(bool enabled) {
     }
 }
 
+void NnNetwork::setWaitType(NnNetworkWaitType waitType) {
+    this->waitType = waitType;
+}
+
+void NnNetwork::setLinkShaper(NnLinkShaper shaper) {
+    this->shaper = shaper;
+}
+
+void NnNetwork::shapeWrites(NnSize n, NnSocketIo *ios) {
+    // Data leaves the node when the emulated link would deliver it: writes to one socket are serialized,
+    // writes to different sockets overlap. The caller waits for the slowest of the given links.
+    if (shaper.bitsPerSecond == 0 && shaper.latencyUs == 0)
+        return;
+    auto clock = std::chrono::steady_clock::now().time_since_epoch();
+    double now = std::chrono::duration_cast<std::chrono::duration<double>>(clock).count();
+    double deliveryTime = now;
+    for (NnSize i = 0; i < n; i++) {
+        NnSocketIo *io = &ios[i];
+        double transferTime = shaper.bitsPerSecond == 0
+            ? 0.0
+            : (double)(io->size * io->nRows * 8) / (double)shaper.bitsPerSecond;
+        double startTime = std::max(now, linkFreeTimes[io->socketIndex]);
+        linkFreeTimes[io->socketIndex] = startTime + transferTime;
+        deliveryTime = std::max(deliveryTime, startTime + transferTime + shaper.latencyUs / 1e6);
+    }
+    while (true) {
+        clock = std::chrono::steady_clock::now().time_since_epoch();
+        double remaining = deliveryTime - std::chrono::duration_cast<std::chrono::duration<double>>(clock).count();
+        if (remaining <= 0.0)
+            break;
+        // Sleeping is too coarse for fast links, so the last part is spun
+        if (remaining > 0.0002)
+            std::this_thread::sleep_for(std::chrono::microseconds((long)((remaining - 0.0001) * 1e6)));
+    }
+}
+
 void NnNetwork::write(NnSize socketIndex, const void *data, size_t size) {
     assert(socketIndex >= 0 && socketIndex < nSockets);
     sentBytes += size;
 
+    NnSocketIo io;
+    io.socketIndex = socketIndex;
+    io.data = data;
+    io.size = size;
+    io.nRows = 1;
+    io.rowStride = size;
+    shapeWrites(1, &io);
+
     char *current = (char*)data;
     int s = sockets[socketIndex];
+    if (links[socketIndex] != nullptr) {
+        writeShm(links[socketIndex], s, data, size);
+        return;
+    }
     for (size_t chunk = 0; chunk < size; chunk += ONE_MB) {
         size_t chunkSize = chunk + ONE_MB < size ? ONE_MB : size - chunk;
         writeSocket(s, current, chunkSize);
@@ -379,6 +837,11 @@ void NnNetwork::read(NnSize socketIndex, void *data, size_t size) {
 
     char *current = (char*)data;
     int s = sockets[socketIndex];
+    if (links[socketIndex] != nullptr) {
+        // Without an attempt limit the read returns once all data is read, a closed peer throws
+        tryReadShm(links[socketIndex], s, data, size, 0, false);
+        return;
+    }
     for (size_t chunk = 0; chunk < size; chunk += ONE_MB) {
         size_t chunkSize = chunk + ONE_MB < size ? ONE_MB : size - chunk;
         readSocket(s, current, chunkSize);
@@ -388,39 +851,103 @@ void NnNetwork::read(NnSize socketIndex, void *data, size_t size) {
 
 void NnNetwork::writeAck(NnSize socketIndex) {
     assert(socketIndex >= 0 && socketIndex < nSockets);
-    writeAckPacket(sockets[socketIndex]);
+    if (links[socketIndex] == nullptr) {
+        writeAckPacket(sockets[socketIndex]);
+        return;
+    }
+    NnSize packet = ACK;
+    writeShm(links[socketIndex], sockets[socketIndex], &packet, sizeof(packet));
 }
 
 void NnNetwork::readAck(NnSize socketIndex) {
     assert(socketIndex >= 0 && socketIndex < nSockets);
-    readAckPacket(sockets[socketIndex]);
+    if (links[socketIndex] == nullptr) {
+        readAckPacket(sockets[socketIndex]);
+        return;
+    }
+    NnSize packet;
+    tryReadShm(links[socketIndex], sockets[socketIndex], &packet, sizeof(packet), 0, false);
+    if (packet != ACK)
+        throw std::runtime_error("Invalid ack packet");
 }
 
 bool NnNetwork::tryReadWithMaxAttempts(NnSize socketIndex, void *data, size_t size, unsigned long maxAttempts) {
     assert(socketIndex >= 0 && socketIndex < nSockets);
-    if (tryReadSocket(sockets[socketIndex], data, size, maxAttempts)) {
+    bool wait = waitType == NET_WAIT_POLL;
+    bool isRead = links[socketIndex] != nullptr
+        ? tryReadShm(links[socketIndex], sockets[socketIndex], data, size, maxAttempts, wait)
+        : tryReadSocket(sockets[socketIndex], data, size, maxAttempts, wait);
+    if (isRead) {
         recvBytes += size;
         return true;
     }
     return false;
 }
 
+#ifndef _WIN32
+static void initIoMessage(struct msghdr *message, struct iovec *vectors, NnSocketIo *io, size_t offset) {
+    NnSize rowIndex = offset / io->size;
+    size_t rowOffset = offset % io->size;
+    int nVectors = 0;
+    for (; rowIndex < io->nRows && nVectors < MAX_IO_VECTORS; rowIndex++, nVectors++) {
+        vectors[nVectors].iov_base = (char *)io->data + rowIndex * io->rowStride + rowOffset;
+        vectors[nVectors].iov_len = io->size - rowOffset;
+        rowOffset = 0;
+    }
+    std::memset(message, 0, sizeof(struct msghdr));
+    message->msg_iov = vectors;
+    message->msg_iovlen = nVectors;
+}
+#endif
+
+static ssize_t sendIo(int socket, NnSocketIo *io, size_t offset, int flags) {
+#ifdef _WIN32
+    const char *row = (const char *)io->data + (offset / io->size) * io->rowStride;
+    size_t rowOffset = offset % io->size;
+    return send(socket, row + rowOffset, io->size - rowOffset, flags);
+#else
+    struct iovec vectors[MAX_IO_VECTORS];
+    struct msghdr message;
+    initIoMessage(&message, vectors, io, offset);
+    return sendmsg(socket, &message, flags);
+#endif
+}
+
+static ssize_t recvIo(int socket, NnSocketIo *io, size_t offset, int flags) {
+#ifdef _WIN32
+    char *row = (char *)io->data + (offset / io->size) * io->rowStride;
+    size_t rowOffset = offset % io->size;
+    return recv(socket, row + rowOffset, io->size - rowOffset, flags);
+#else
+    struct iovec vectors[MAX_IO_VECTORS];
+    struct msghdr message;
+    initIoMessage(&message, vectors, io, offset);
+    return recvmsg(socket, &message, flags);
+#endif
+}
+
 void NnNetwork::writeMany(NnSize n, NnSocketIo *ios) {
     bool isWriting;
     size_t nBytes = 0;
+    std::vector<size_t> sent(n, 0);
     for (NnSize i = 0; i < n; i++) {
         NnSocketIo *io = &ios[i];
         assert(io->socketIndex >= 0 && io->socketIndex < nSockets);
-        nBytes += io->size;
+        nBytes += io->size * io->nRows;
     }
+    shapeWrites(n, ios);
+    unsigned int nIdleLoops = 0;
     do {
         isWriting = false;
+        bool hasProgress = false;
         for (NnSize i = 0; i < n; i++) {
             NnSocketIo *io = &ios[i];
-            if (io->size > 0) {
+            if (sent[i] < io->size * io->nRows) {
                 isWriting = true;
-                int socket = sockets[io->socketIndex];
-                ssize_t s = send(socket, (const char*)io->data, io->size, 0);
+                NnShmLink *link = links[io->socketIndex];
+                ssize_t s = link != nullptr
+                    ? sendShmIo(link, io, sent[i])
+                    : sendIo(sockets[io->socketIndex], io, sent[i], 0);
                 if (s < 0) {
                     if (isEagainError()) {
                         continue;
@@ -429,10 +956,16 @@ void NnNetwork::writeMany(NnSize n, NnSocketIo *ios) {
                 } else if (s == 0) {
                     throw NnWriteNetworkException(0, "Socket closed");
                 }
-                io->size -= s;
-                io->data = (char*)io->data + s;
+                sent[i] += s;
+                hasProgress = true;
             }
         }
+        if (hasProgress)
+            nIdleLoops = 0;
+        else if (isWriting && (waitType == NET_WAIT_POLL || ++nIdleLoops >= SHM_SPIN_COUNT)) {
+            nIdleLoops = 0;
+            waitForIos(n, ios, sent.data(), 0, nullptr, nullptr);
+        }
     } while (isWriting);
     sentBytes += nBytes;
 }
@@ -444,6 +977,8 @@ void NnNetwork::writeAll(void *data, size_t size) {
         io->socketIndex = i;
         io->data = data;
         io->size = size;
+        io->nRows = 1;
+        io->rowStride = size;
     }
     writeMany(nSockets, &ios[0]);
 }
@@ -451,19 +986,24 @@ void NnNetwork::writeAll(void *data, size_t size) {
 void NnNetwork::readMany(NnSize n, NnSocketIo *ios) {
     bool isReading;
     size_t nBytes = 0;
+    std::vector<size_t> received(n, 0);
     for (NnSize i = 0; i < n; i++) {
         NnSocketIo *io = &ios[i];
         assert(io->socketIndex >= 0 && io->socketIndex < nSockets);
-        nBytes += io->size;
+        nBytes += io->size * io->nRows;
     }
+    unsigned int nIdleLoops = 0;
     do {
         isReading = false;
+        bool hasProgress = false;
         for (NnSize i = 0; i < n; i++) {
             NnSocketIo *io = &ios[i];
-            if (io->size > 0) {
+            if (received[i] < io->size * io->nRows) {
                 isReading = true;
-                int socket = sockets[io->socketIndex];
-                ssize_t r = recv(socket, (char*)io->data, io->size, 0);
+                NnShmLink *link = links[io->socketIndex];
+                ssize_t r = link != nullptr
+                    ? recvShmIo(link, io, received[i])
+                    : recvIo(sockets[io->socketIndex], io, received[i], 0);
                 if (r < 0) {
                     if (isEagainError()) {
                         continue;
@@ -472,14 +1012,160 @@ void NnNetwork::readMany(NnSize n, NnSocketIo *ios) {
                 } else if (r == 0) {
                     throw NnReadNetworkException(0, "Socket closed");
                 }
-                io->size -= r;
-                io->data = (char*)io->data + r;
+                received[i] += r;
+                hasProgress = true;
             }
         }
+        if (hasProgress)
+            nIdleLoops = 0;
+        else if (isReading && (waitType == NET_WAIT_POLL || ++nIdleLoops >= SHM_SPIN_COUNT)) {
+            nIdleLoops = 0;
+            waitForIos(0, nullptr, nullptr, n, ios, received.data());
+        }
     } while (isReading);
     recvBytes += nBytes;
 }
 
+void NnNetwork::writeReadMany(NnSize nWrites, NnSocketIo *writeIos, NnSize nReads, NnSocketIo *readIos) {
+    // Writes and reads progress together, so two nodes sending to each other cannot both block on full socket buffers
+    bool isBusy;
+    size_t nSentBytes = 0;
+    size_t nRecvBytes = 0;
+    std::vector<size_t> sent(nWrites, 0);
+    std::vector<size_t> received(nReads, 0);
+    for (NnSize i = 0; i < nWrites; i++) {
+        assert(writeIos[i].socketIndex >= 0 && writeIos[i].socketIndex < nSockets);
+        nSentBytes += writeIos[i].size * writeIos[i].nRows;
+    }
+    for (NnSize i = 0; i < nReads; i++) {
+        assert(readIos[i].socketIndex >= 0 && readIos[i].socketIndex < nSockets);
+        nRecvBytes += readIos[i].size * readIos[i].nRows;
+    }
+    shapeWrites(nWrites, writeIos);
+    unsigned int nIdleLoops = 0;
+    do {
+        isBusy = false;
+        bool hasProgress = false;
+        for (NnSize i = 0; i < nWrites; i++) {
+            NnSocketIo *io = &writeIos[i];
+            if (sent[i] < io->size * io->nRows) {
+                isBusy = true;
+                NnShmLink *link = links[io->socketIndex];
+                ssize_t s = link != nullptr
+                    ? sendShmIo(link, io, sent[i])
+                    : sendIo(sockets[io->socketIndex], io, sent[i], IO_DONTWAIT);
+                if (s < 0) {
+                    if (isEagainError())
+                        continue;
+                    throw NnWriteNetworkException(SOCKET_LAST_ERRCODE, SOCKET_LAST_ERROR);
+                } else if (s == 0) {
+                    throw NnWriteNetworkException(0, "Socket closed");
+                }
+                sent[i] += s;
+                hasProgress = true;
+            }
+        }
+        for (NnSize i = 0; i < nReads; i++) {
+            NnSocketIo *io = &readIos[i];
+            if (received[i] < io->size * io->nRows) {
+                isBusy = true;
+                NnShmLink *link = links[io->socketIndex];
+                ssize_t r = link != nullptr
+                    ? recvShmIo(link, io, received[i])
+                    : recvIo(sockets[io->socketIndex], io, received[i], IO_DONTWAIT);
+                if (r < 0) {
+                    if (isEagainError())
+                        continue;
+                    throw NnReadNetworkException(SOCKET_LAST_ERRCODE, SOCKET_LAST_ERROR);
+                } else if (r == 0) {
+                    throw NnReadNetworkException(0, "Socket closed");
+                }
+                received[i] += r;
+                hasProgress = true;
+            }
+        }
+        if (hasProgress)
+            nIdleLoops = 0;
+        else if (isBusy && (waitType == NET_WAIT_POLL || ++nIdleLoops >= SHM_SPIN_COUNT)) {
+            nIdleLoops = 0;
+            waitForIos(nWrites, writeIos, sent.data(), nReads, readIos, received.data());
+        }
+    } while (isBusy);
+    sentBytes += nSentBytes;
+    recvBytes += nRecvBytes;
+}
+
+void NnNetwork::waitForIos(NnSize nWrites, NnSocketIo *writeIos, size_t *sent, NnSize nReads, NnSocketIo *readIos, size_t *received) {
+    // A pending write is preferred for the futex wait, the peer keeps draining its ring while it waits for our data
+    std::vector<struct pollfd> fds;
+    std::vector<NnSize> socketIndexes;
+    NnShmRing *shmRing = nullptr;
+    NnSize shmSocketIndex = 0;
+    bool isShmWrite = false;
+    for (NnSize i = 0; i < nWrites; i++) {
+        if (sent[i] < writeIos[i].size * writeIos[i].nRows) {
+            NnShmLink *link = links[writeIos[i].socketIndex];
+            if (link != nullptr) {
+                if (shmRing == nullptr) {
+                    shmRing = link->tx;
+                    shmSocketIndex = writeIos[i].socketIndex;
+                    isShmWrite = true;
+                }
+                continue;
+            }
+            struct pollfd fd;
+            fd.fd = sockets[writeIos[i].socketIndex];
+            fd.events = POLLOUT;
+            fd.revents = 0;
+            fds.push_back(fd);
+            socketIndexes.push_back(writeIos[i].socketIndex);
+        }
+    }
+    for (NnSize i = 0; i < nReads; i++) {
+        if (received[i] < readIos[i].size * readIos[i].nRows) {
+            NnShmLink *link = links[readIos[i].socketIndex];
+            if (link != nullptr) {
+                if (shmRing == nullptr) {
+                    shmRing = link->rx;
+                    shmSocketIndex = readIos[i].socketIndex;
+                }
+                continue;
+            }
+            struct pollfd fd;
+            fd.fd = sockets[readIos[i].socketIndex];
+            fd.events = POLLIN;
+            fd.revents = 0;
+            fds.push_back(fd);
+            socketIndexes.push_back(readIos[i].socketIndex);
+        }
+    }
+    if (shmRing == nullptr && (fds.size() == 0 || waitType != NET_WAIT_POLL))
+        return;
+
+    auto startTime = std::chrono::steady_clock::now();
+    // Errors and timeouts are not handled here, the next send/recv reports them
+    if (shmRing == nullptr) {
+        pollSockets(fds.data(), fds.size(), POLL_TIMEOUT_MS);
+    } else if (fds.size() == 0 || pollSockets(fds.data(), fds.size(), 0) == 0) {
+        long timeoutUs = fds.size() == 0 ? SHM_WAIT_US : SHM_MIXED_WAIT_US;
+        if (isShmWrite)
+            waitForShmSpace(shmRing, timeoutUs);
+        else
+            waitForShmData(shmRing, timeoutUs);
+        checkShmPeer(sockets[shmSocketIndex], isShmWrite);
+        socketIndexes.push_back(shmSocketIndex);
+    }
+    unsigned long waitTime = (unsigned long)std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - startTime).count();
+    for (NnSize i = 0; i < socketIndexes.size(); i++)
+        waitTimes[socketIndexes[i]] += waitTime;
+}
+
+void NnNetwork::getWaitStats(unsigned long *waitTimes) {
+    for (NnSize i = 0; i < nSockets; i++)
+        waitTimes[i] = this->waitTimes[i].exchange(0);
+}
+
 void NnNetwork::getStats(size_t *sentBytes, size_t *recvBytes) {
     *sentBytes = this->sentBytes;
     *recvBytes = this->recvBytes;
@@ -503,6 +1189,8 @@ static void syncWithRoot(NnNetwork *network, NnByte nodeIndex, NnByte *buffer, N
             ios[i].socketIndex = threadIndex + i * nThreads;
             ios[i].data = buffer;
             ios[i].size = nBytes;
+            ios[i].nRows = 1;
+            ios[i].rowStride = nBytes;
         }
         network->writeMany(nSocketsPerThread, &ios[0]);
     } else {
@@ -513,29 +1201,42 @@ static void syncWithRoot(NnNetwork *network, NnByte nodeIndex, NnByte *buffer, N
         NnSocketIo ios;
         ios.data = buffer;
         ios.size = nBytes;
+        ios.nRows = 1;
+        ios.rowStride = nBytes;
         ios.socketIndex = 0; // root
         network->readMany(1, &ios);
     }
 }
 
-static void syncNodeSlices(bool onlyFromWorkerToRoot, NnNetwork *network, NnSize nodeIndex, NnSize nNodes, NnByte *buffer, NnSize nBytes, NnSize nThreads, NnSize threadIndex) {
+static void getNodeSliceBytes(NnPipeConfig *pipeConfig, NnSize nNodes, NnSize nodeIndex, NnSize *offset, NnSize *size) {
+    NnFloatType floatType = pipeConfig->size.floatType;
+    NnSize start = getPipeSliceStart(pipeConfig, nNodes, nodeIndex);
+    NnSize end = getPipeSliceStart(pipeConfig, nNodes, nodeIndex + 1);
+    *offset = getBytes(floatType, start);
+    *size = getBytes(floatType, end - start);
+}
+
+static void syncNodeSlices(bool onlyFromWorkerToRoot, NnNetwork *network, NnSize nodeIndex, NnSize nNodes, NnPipeConfig *pipeConfig, NnByte *buffer, NnSize nBytes, NnSize nRows, NnSize nThreads, NnSize threadIndex) {
     bool isWorker = nodeIndex != 0;
     NnSize nSockets = onlyFromWorkerToRoot && isWorker ? 1 : network->nSockets;
     NnSize nSocketsPerThread = nSockets / nThreads + (nSockets % nThreads > threadIndex ? 1 : 0);
     if (nSocketsPerThread == 0) return;
-    NnSize sliceBytes = nBytes / nNodes;
 
     std::unique_ptr<NnSocketIo> iosPtr(new NnSocketIo[nSocketsPerThread]);
     NnSocketIo *ios = iosPtr.get();
 
     if (!onlyFromWorkerToRoot || isWorker) {
-        NnByte *mySliceData = &buffer[sliceBytes * nodeIndex];
+        NnSize myOffset, mySize;
+        getNodeSliceBytes(pipeConfig, nNodes, nodeIndex, &myOffset, &mySize);
+        NnByte *mySliceData = &buffer[myOffset];
 
         for (unsigned int i = 0; i < nSocketsPerThread; i++) {
             unsigned int socketIndex = threadIndex + i * nThreads;
             ios[i].socketIndex = socketIndex;
             ios[i].data = mySliceData;
-            ios[i].size = sliceBytes;
+            ios[i].size = mySize;
+            ios[i].nRows = nRows;
+            ios[i].rowStride = nBytes;
         }
         network->writeMany(nSocketsPerThread, ios);
     }
@@ -544,15 +1245,143 @@ static void syncNodeSlices(bool onlyFromWorkerToRoot, NnNetwork *network, NnSize
         for (unsigned int i = 0; i < nSocketsPerThread; i++) {
             unsigned int socketIndex = threadIndex + i * nThreads;
             int sliceIndex = socketIndex >= nodeIndex ? socketIndex + 1 : socketIndex;
-            NnByte *sliceData = &buffer[sliceBytes * sliceIndex];
+            NnSize sliceOffset, sliceSize;
+            getNodeSliceBytes(pipeConfig, nNodes, sliceIndex, &sliceOffset, &sliceSize);
             ios[i].socketIndex = socketIndex;
-            ios[i].data = sliceData;
-            ios[i].size = sliceBytes;
+            ios[i].data = &buffer[sliceOffset];
+            ios[i].size = sliceSize;
+            ios[i].nRows = nRows;
+            ios[i].rowStride = nBytes;
         }
         network->readMany(nSocketsPerThread, ios);
     }
 }
 
+static inline NnSize getPeerSocketIndex(NnSize nodeIndex, NnSize peerIndex) {
+    return peerIndex < nodeIndex ? peerIndex : peerIndex - 1;
+}
+
+static void syncTreeFromRoot(NnNetwork *network, NnSize nodeIndex, NnSize nNodes, NnByte *buffer, NnSize nBytes) {
+    // Binomial tree: a node receives the buffer from the node that differs in its highest bit and forwards it
+    // to the nodes that differ in any higher bit. The root sends ceil(log2(nNodes)) copies instead of nNodes - 1.
+    NnSize mask = 1;
+    if (nodeIndex != 0) {
+        while (mask <= nodeIndex)
+            mask <<= 1;
+        NnSocketIo io;
+        io.socketIndex = getPeerSocketIndex(nodeIndex, nodeIndex - (mask >> 1));
+        io.data = buffer;
+        io.size = nBytes;
+        io.nRows = 1;
+        io.rowStride = nBytes;
+        network->readMany(1, &io);
+    }
+
+    std::vector<NnSocketIo> ios;
+    for (; nodeIndex + mask < nNodes; mask <<= 1) {
+        NnSocketIo io;
+        io.socketIndex = getPeerSocketIndex(nodeIndex, nodeIndex + mask);
+        io.data = buffer;
+        io.size = nBytes;
+        io.nRows = 1;
+        io.rowStride = nBytes;
+        ios.push_back(io);
+    }
+    if (ios.size() > 0)
+        network->writeMany(ios.size(), ios.data());
+}
+
+static void syncPipeline(NnNetwork *network, NnSize nodeIndex, NnSize nNodes, NnByte *buffer, NnSize nBytes, bool isSending) {
+    // The next stage may still be busy with the previous batch, the socket buffers let this node move on
+    NnSocketIo io;
+    io.socketIndex = getPeerSocketIndex(nodeIndex, isSending ? (nodeIndex + 1) % nNodes : (nodeIndex + nNodes - 1) % nNodes);
+    io.data = buffer;
+    io.size = nBytes;
+    io.nRows = 1;
+    io.rowStride = nBytes;
+    if (isSending)
+        network->writeMany(1, &io);
+    else
+        network->readMany(1, &io);
+}
+
+static void reduceRingChunk(NnFloatType floatType, NnByte *output, NnByte *input, NnSize n, float *temp) {
+    if (floatType == F_32) {
+        float *o = (float *)output;
+        float *i = (float *)input;
+        for (NnSize k = 0; k < n; k++)
+            o[k] += i[k];
+    } else if (floatType == F_Q80) {
+        float *o = temp;
+        float *i = &temp[n];
+        dequantizeQ80toF32((NnBlockQ80 *)output, o, n, 1, 0);
+        dequantizeQ80toF32((NnBlockQ80 *)input, i, n, 1, 0);
+        for (NnSize k = 0; k < n; k++)
+            o[k] += i[k];
+        quantizeF32toQ80(o, (NnBlockQ80 *)output, n, 1, 0);
+    } else {
+        throw std::invalid_argument("Unsupported float type for ring all-reduce");
+    }
+}
+
+static void syncRingAllReduce(NnNetwork *network, NnSize nodeIndex, NnSize nNodes, NnSize2D *pipeSize, NnByte *pipe, NnSize nRows,
+    std::vector<NnByte> *chunkBuffer, std::vector<float> *floatBuffer) {
+    // Each row is split into nNodes chunks. In the reduce-scatter phase every node passes a partial sum of one chunk
+    // to the next node, so after nNodes - 1 steps node r owns the full sum of chunk r + 1. The all-gather phase
+    // circulates the reduced chunks. Each node sends 2 * (nNodes - 1) / nNodes of the pipe regardless of the node count.
+    const NnSize blockSize = getBlockSize(pipeSize->floatType);
+    const NnSize nBlocks = pipeSize->x / blockSize;
+    const NnSize rowBytes = getBytes(pipeSize->floatType, pipeSize->x);
+    const NnSize maxChunkSize = ((nBlocks + nNodes - 1) / nNodes) * blockSize;
+    const NnSize maxChunkBytes = getBytes(pipeSize->floatType, maxChunkSize);
+    if (chunkBuffer->size() < maxChunkBytes * nRows)
+        chunkBuffer->resize(maxChunkBytes * nRows);
+    if (floatBuffer->size() < maxChunkSize * 2)
+        floatBuffer->resize(maxChunkSize * 2);
+
+    const NnSize nextSocketIndex = getPeerSocketIndex(nodeIndex, (nodeIndex + 1) % nNodes);
+    const NnSize prevSocketIndex = getPeerSocketIndex(nodeIndex, (nodeIndex + nNodes - 1) % nNodes);
+
+    auto chunkStart = [&](NnSize chunkIndex) { return (nBlocks * chunkIndex / nNodes) * blockSize; };
+    auto initChunkIo = [&](NnSocketIo *io, NnSize socketIndex, NnSize chunkIndex) {
+        NnSize start = chunkStart(chunkIndex);
+        io->socketIndex = socketIndex;
+        io->data = &pipe[getBytes(pipeSize->floatType, start)];
+        io->size = getBytes(pipeSize->floatType, chunkStart(chunkIndex + 1) - start);
+        io->nRows = nRows;
+        io->rowStride = rowBytes;
+    };
+
+    for (NnSize step = 0; step < nNodes - 1; step++) {
+        NnSize sendChunkIndex = (nodeIndex + nNodes - step) % nNodes;
+        NnSize recvChunkIndex = (nodeIndex + 2 * nNodes - step - 1) % nNodes;
+        NnSocketIo sendIo;
+        NnSocketIo recvIo;
+        initChunkIo(&sendIo, nextSocketIndex, sendChunkIndex);
+        initChunkIo(&recvIo, prevSocketIndex, recvChunkIndex);
+        NnByte *recvChunk = (NnByte *)recvIo.data;
+        recvIo.data = chunkBuffer->data();
+        recvIo.rowStride = recvIo.size;
+        network->writeReadMany(1, &sendIo, 1, &recvIo);
+
+        NnSize chunkSize = chunkStart(recvChunkIndex + 1) - chunkStart(recvChunkIndex);
+        for (NnSize rowIndex = 0; rowIndex < nRows; rowIndex++)
+            reduceRingChunk(
+                pipeSize->floatType,
+                &recvChunk[rowIndex * rowBytes],
+                &chunkBuffer->data()[rowIndex * recvIo.size],
+                chunkSize,
+                floatBuffer->data());
+    }
+    for (NnSize step = 0; step < nNodes - 1; step++) {
+        NnSocketIo sendIo;
+        NnSocketIo recvIo;
+        initChunkIo(&sendIo, nextSocketIndex, (nodeIndex + 1 + nNodes - step) % nNodes);
+        initChunkIo(&recvIo, prevSocketIndex, (nodeIndex + nNodes - step) % nNodes);
+        network->writeReadMany(1, &sendIo, 1, &recvIo);
+    }
+}
+
 NnNetworkNodeSynchronizer::NnNetworkNodeSynchronizer(NnNetwork *network, NnNetExecution *execution, NnNetConfig *netConfig, NnNodeConfig *nodeConfig) {
     this->network = network;
     this->execution = execution;
@@ -560,8 +1389,15 @@ NnNetworkNodeSynchronizer::NnNetworkNodeSynchronizer(NnNetwork *network, NnNetEx
     this->nodeConfig = nodeConfig;
 }
 
+void NnNetworkNodeSynchronizer::setNetwork(NnNetwork *network) {
+    this->network = network;
+}
+
 void NnNetworkNodeSynchronizer::sync(NnSize segmentIndex, NnSize nThreads, NnSize threadIndex) {
     NnSegmentConfig *segmentConfig = &nodeConfig->segments[segmentIndex];
+    NnSize batchSize = segmentConfig->isOutput ? execution->outputBatchSize : execution->batchSize;
+    if (batchSize == 0)
+        return;
 
     for (NnSize syncIndex = 0; syncIndex < segmentConfig->nSyncs; syncIndex++) {
         NnSyncConfig *syncConfig = &segmentConfig->syncs[syncIndex];
@@ -569,18 +1405,24 @@ void NnNetworkNodeSynchronizer::sync(NnSize segmentIndex, NnSize nThreads, NnSiz
         NnPipeConfig *pipeConfig = &netConfig->pipes[syncConfig->pipeIndex];
         NnSize batchBytes = getBytes(pipeConfig->size.floatType, pipeConfig->size.x);
 
-        for (NnSize batchIndex = 0; batchIndex < execution->batchSize; batchIndex++) {
-            NnByte *pipeBatch = &pipe[batchIndex * batchBytes];
-
-            if (syncConfig->syncType == SYNC_WITH_ROOT) {
-                syncWithRoot(network, nodeConfig->nodeIndex, pipeBatch, batchBytes, nThreads, threadIndex);
-            } else if (syncConfig->syncType == SYNC_NODE_SLICES) {
-                syncNodeSlices(false, network, nodeConfig->nodeIndex, netConfig->nNodes, pipeBatch, batchBytes, nThreads, threadIndex);
-            } else if (syncConfig->syncType == SYNC_NODE_SLICES_EXCEPT_ROOT) {
-                syncNodeSlices(true, network, nodeConfig->nodeIndex, netConfig->nNodes, pipeBatch, batchBytes, nThreads, threadIndex);
-            } else {
-                throw std::invalid_argument("Unknown sync type");
-            }
+        // All rows of the batch are sent in one transfer per peer
+        if (syncConfig->syncType == SYNC_WITH_ROOT) {
+            syncWithRoot(network, nodeConfig->nodeIndex, pipe, batchBytes * batchSize, nThreads, threadIndex);
+        } else if (syncConfig->syncType == SYNC_NODE_SLICES) {
+            syncNodeSlices(false, network, nodeConfig->nodeIndex, netConfig->nNodes, pipeConfig, pipe, batchBytes, batchSize, nThreads, threadIndex);
+        } else if (syncConfig->syncType == SYNC_NODE_SLICES_EXCEPT_ROOT) {
+            syncNodeSlices(true, network, nodeConfig->nodeIndex, netConfig->nNodes, pipeConfig, pipe, batchBytes, batchSize, nThreads, threadIndex);
+        } else if (syncConfig->syncType == SYNC_TREE_FROM_ROOT) {
+            if (threadIndex == 0)
+                syncTreeFromRoot(network, nodeConfig->nodeIndex, netConfig->nNodes, pipe, batchBytes * batchSize);
+        } else if (syncConfig->syncType == SYNC_RING_ALL_REDUCE) {
+            if (threadIndex == 0)
+                syncRingAllReduce(network, nodeConfig->nodeIndex, netConfig->nNodes, &pipeConfig->size, pipe, batchSize, &ringChunkBuffer, &ringFloatBuffer);
+        } else if (syncConfig->syncType == SYNC_PIPELINE_SEND || syncConfig->syncType == SYNC_PIPELINE_RECV) {
+            if (threadIndex == 0)
+                syncPipeline(network, nodeConfig->nodeIndex, netConfig->nNodes, pipe, batchBytes * batchSize, syncConfig->syncType == SYNC_PIPELINE_SEND);
+        } else {
+            throw std::invalid_argument("Unknown sync type");
         }
     }
 }
@@ -612,6 +1454,10 @@ void NnRootConfigWriter::writeNet(NnSize socketIndex, NnNetConfig *config) {
         NnPipeConfig *pipeConfig = &config->pipes[pipeIndex];
         network->write(socketIndex, &pipeConfig->size, sizeof(pipeConfig->size));
         writeString(network, socketIndex, pipeConfig->name);
+        NnSize nSliceStarts = pipeConfig->sliceStarts != nullptr ? config->nNodes + 1 : 0;
+        network->write(socketIndex, &nSliceStarts, sizeof(nSliceStarts));
+        if (nSliceStarts > 0)
+            network->write(socketIndex, pipeConfig->sliceStarts, nSliceStarts * sizeof(NnSize));
     }
     network->readAck(socketIndex);
 }
@@ -633,6 +1479,7 @@ void NnRootConfigWriter::writeNode(NnSize socketIndex, NnNodeConfig *config) {
         network->write(socketIndex, &segmentConfig->nSyncs, sizeof(segmentConfig->nSyncs));
         network->write(socketIndex, &segmentConfig->nOps, sizeof(segmentConfig->nOps));
         network->write(socketIndex, &segmentConfig->syncPointers, sizeof(segmentConfig->syncPointers));
+        network->write(socketIndex, &segmentConfig->isOutput, sizeof(segmentConfig->isOutput));
 
         for (NnSize syncIndex = 0; syncIndex < segmentConfig->nSyncs; syncIndex++) {
             NnSyncConfig *syncConfig = &segmentConfig->syncs[syncIndex];
@@ -678,6 +1525,13 @@ NnNetConfig NnWorkerConfigReader::readNet() {
         NnPipeConfig *pipeConfig = &config.pipes[pipeIndex];
         network->read(ROOT_SOCKET_INDEX, &pipeConfig->size, sizeof(pipeConfig->size));
         pipeConfig->name = readString(network, ROOT_SOCKET_INDEX);
+        NnSize nSliceStarts;
+        network->read(ROOT_SOCKET_INDEX, &nSliceStarts, sizeof(nSliceStarts));
+        pipeConfig->sliceStarts = nullptr;
+        if (nSliceStarts > 0) {
+            pipeConfig->sliceStarts = new NnSize[nSliceStarts];
+            network->read(ROOT_SOCKET_INDEX, pipeConfig->sliceStarts, nSliceStarts * sizeof(NnSize));
+        }
     }
     network->writeAck(ROOT_SOCKET_INDEX);
     return config;
@@ -705,6 +1559,7 @@ NnNodeConfig NnWorkerConfigReader::readNode() {
         network->read(ROOT_SOCKET_INDEX, &segmentConfig->nSyncs, sizeof(segmentConfig->nSyncs));
         network->read(ROOT_SOCKET_INDEX, &segmentConfig->nOps, sizeof(segmentConfig->nOps));
         network->read(ROOT_SOCKET_INDEX, &segmentConfig->syncPointers, sizeof(segmentConfig->syncPointers));
+        network->read(ROOT_SOCKET_INDEX, &segmentConfig->isOutput, sizeof(segmentConfig->isOutput));
 
         if (segmentConfig->nSyncs > 0) {
             segmentConfig->syncs = new NnSyncConfig[segmentConfig->nSyncs];
@@ -739,11 +1594,243 @@ NnNodeConfig NnWorkerConfigReader::readNode() {
     return config;
 }
 
+static void writeWeightToSocket(NnNetwork *network, NnSize socketIndex, const char *opName, NnSize opIndex, NnSize nBytes, NnByte *weight) {
+    NnSize nameSize = std::strlen(opName) + 1;
+    network->write(socketIndex, &nameSize, sizeof(nameSize));
+    network->write(socketIndex, opName, nameSize);
+    network->write(socketIndex, &opIndex, sizeof(opIndex));
+    network->write(socketIndex, &nBytes, sizeof(nBytes));
+    network->write(socketIndex, weight, nBytes);
+}
+
+enum NnWeightSendType {
+    SEND_WHOLE,
+    SEND_ROW_SLICE,
+    SEND_COL_SLICE,
+};
+
+typedef struct {
+    NnWeightSendType type;
+    std::string opName;
+    NnSize opIndex;
+    NnSize nBytes;
+    NnByte *weight;
+    NnRowMatmulSlice rowSlice;
+    NnColMatmulSlice colSlice;
+} NnWeightSendJob;
+
+// Splits and sends the weights of one worker on its own thread, so all links are busy at the same time
+// and the root can read the next tensor meanwhile. With a file the weights are written to a shard instead.
+class NnWeightSender {
+private:
+    NnNetwork *network;
+    FILE *file;
+    NnSize nodeIndex;
+    NnSize nNodes;
+    std::uint64_t fingerprint;
+    std::uint64_t configFingerprint;
+    size_t fileOffset;
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::deque<NnWeightSendJob> jobs;
+    bool isClosed;
+    bool isAborted;
+    std::exception_ptr error;
+    std::vector<NnByte> temp;
+    std::thread thread;
+public:
+    NnWeightSender(NnNetwork *network, FILE *file, NnSize nodeIndex, NnSize nNodes, std::uint64_t fingerprint, std::uint64_t configFingerprint)
+        : network(network), file(file), nodeIndex(nodeIndex), nNodes(nNodes), fingerprint(fingerprint),
+          configFingerprint(configFingerprint), fileOffset(0), isClosed(false), isAborted(false) {
+        thread = std::thread(&NnWeightSender::run, this);
+    }
+
+    ~NnWeightSender() {
+        if (thread.joinable()) {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                isClosed = true;
+                isAborted = true;
+            }
+            cv.notify_one();
+            thread.join();
+        }
+        if (file != nullptr)
+            fclose(file);
+    }
+
+    void push(NnWeightSendJob job) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            jobs.push_back(job);
+        }
+        cv.notify_one();
+    }
+
+    // Sends the end marker after the queued weights, waits for the acknowledgement of the worker
+    void finish() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            isClosed = true;
+        }
+        cv.notify_one();
+        thread.join();
+        if (file != nullptr) {
+            if (fclose(file) != 0 && !error)
+                error = std::make_exception_ptr(std::runtime_error("Cannot write shard file"));
+            file = nullptr;
+        }
+        if (error)
+            std::rethrow_exception(error);
+    }
+
+private:
+    void writeFile(const void *data, size_t size) {
+        if (size > 0 && fwrite(data, 1, size, file) != size)
+            throw std::runtime_error("Cannot write shard file");
+        fileOffset += size;
+    }
+
+    void writeShardWeight(const char *opName, NnSize opIndex, NnSize nBytes, NnByte *weight) {
+        static const NnByte zeros[SHARD_ALIGNMENT] = {0};
+        NnShardWeightHeader header;
+        header.nameSize = (NnSize)std::strlen(opName) + 1;
+        header.opIndex = opIndex;
+        header.nBytes = nBytes;
+        size_t dataOffset = fileOffset + sizeof(header) + header.nameSize;
+        header.padding = (NnSize)((SHARD_ALIGNMENT - dataOffset % SHARD_ALIGNMENT) % SHARD_ALIGNMENT);
+        writeFile(&header, sizeof(header));
+        writeFile(opName, header.nameSize);
+        writeFile(zeros, header.padding);
+        writeFile(weight, nBytes);
+    }
+
+    void run() {
+        NnSize socketIndex = nodeIndex - 1;
+        try {
+            bool hasWeights = false;
+            if (file != nullptr) {
+                NnShardHeader header;
+                header.magic = SHARD_MAGIC;
+                header.version = SHARD_VERSION;
+                header.nodeIndex = nodeIndex;
+                header.nNodes = nNodes;
+                header.fingerprint = fingerprint;
+                header.configFingerprint = configFingerprint;
+                writeFile(&header, sizeof(header));
+            } else {
+                // The worker answers if it already has the weights, from a local shard or from the previous connection
+                NnSize answer;
+                network->write(socketIndex, &fingerprint, sizeof(fingerprint));
+                network->read(socketIndex, &answer, sizeof(answer));
+                hasWeights = answer == 1;
+            }
+
+            while (true) {
+                NnWeightSendJob job;
+                {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    cv.wait(lock, [this]{ return isClosed || !jobs.empty(); });
+                    if (isAborted)
+                        return;
+                    if (jobs.empty())
+                        break;
+                    job = jobs.front();
+                    jobs.pop_front();
+                }
+                if (hasWeights)
+                    continue;
+                NnByte *weight = job.weight;
+                if (job.type != SEND_WHOLE) {
+                    if (temp.size() < job.nBytes)
+                        temp.resize(job.nBytes);
+                    if (job.type == SEND_ROW_SLICE)
+                        splitRowMatmulWeight(&job.rowSlice, job.weight, temp.data());
+                    else
+                        splitColMatmulWeight(&job.colSlice, job.weight, temp.data());
+                    weight = temp.data();
+                }
+                if (file != nullptr)
+                    writeShardWeight(job.opName.c_str(), job.opIndex, job.nBytes, weight);
+                else
+                    writeWeightToSocket(network, socketIndex, job.opName.c_str(), job.opIndex, job.nBytes, weight);
+            }
+
+            if (file != nullptr) {
+                NnShardWeightHeader end;
+                std::memset(&end, 0, sizeof(end));
+                writeFile(&end, sizeof(end));
+            } else if (!hasWeights) {
+                NnSize zeroSize = 0;
+                network->write(socketIndex, &zeroSize, sizeof(zeroSize));
+                network->readAck(socketIndex);
+            }
+        } catch (...) {
+            error = std::current_exception();
+        }
+    }
+};
+
 NnRootWeightLoader::NnRootWeightLoader(NnExecutor *executor, NnNetwork *network, NnSize nNodes) {
     this->executor = executor;
     this->network = network;
     this->nNodes = nNodes;
     this->tempSize = 0;
+    this->isMappingEnabled = false;
+    this->mappedBytes = 0;
+    this->fingerprint = 0;
+    this->shardPrefix = nullptr;
+}
+
+void NnRootWeightLoader::setModelFingerprint(std::uint64_t fingerprint) {
+    assert(senders.size() == 0);
+    this->fingerprint = fingerprint;
+}
+
+void NnRootWeightLoader::enableShardOutput(const char *prefix, NnNetConfig *netConfig, NnNodeConfig *nodeConfigs) {
+    assert(senders.size() == 0);
+    assert(netConfig->nNodes == nNodes);
+    shardPrefix = prefix;
+    configFingerprints.resize(nNodes);
+    for (NnSize nodeIndex = 0; nodeIndex < nNodes; nodeIndex++)
+        configFingerprints[nodeIndex] = getConfigFingerprint(netConfig, &nodeConfigs[nodeIndex]);
+}
+
+void NnRootWeightLoader::startSenders() {
+    if (senders.size() > 0)
+        return;
+    for (NnSize nodeIndex = 1; nodeIndex < nNodes; nodeIndex++) {
+        FILE *file = nullptr;
+        std::uint64_t configFingerprint = 0;
+        if (shardPrefix != nullptr) {
+            configFingerprint = configFingerprints[nodeIndex];
+            std::string path = std::string(shardPrefix) + "-" + std::to_string(nodeIndex) + ".shard";
+            file = fopen(path.c_str(), "wb");
+            if (file == nullptr)
+                throw std::runtime_error("Cannot create shard file: " + path);
+            printf("💿 Writing %s\n", path.c_str());
+        }
+        senders.push_back(std::unique_ptr<NnWeightSender>(new NnWeightSender(network, file, nodeIndex, nNodes, fingerprint, configFingerprint)));
+    }
+}
+
+void NnRootWeightLoader::enableMapping() {
+    isMappingEnabled = true;
+}
+
+NnSize NnRootWeightLoader::getMappedBytes() {
+    return mappedBytes;
+}
+
+void NnRootWeightLoader::loadRootWeight(const char *opName, NnSize opIndex, NnSize nBytes, NnByte *weight) {
+    if (executor == nullptr)
+        return;
+    if (isMappingEnabled) {
+        if (executor->mapWeight(opName, opIndex, nBytes, weight))
+            mappedBytes += nBytes;
+    } else {
+        executor->loadWeight(opName, opIndex, nBytes, weight);
+    }
 }
 
 NnRootWeightLoader::~NnRootWeightLoader() {
@@ -752,11 +1839,9 @@ NnRootWeightLoader::~NnRootWeightLoader() {
 }
 
 void NnRootWeightLoader::finish() {
-    NnSize zeroSize = 0;
-    for (NnSize socketIndex = 0; socketIndex < nNodes - 1; socketIndex++) {
-        network->write(socketIndex, &zeroSize, sizeof(zeroSize));
-        network->readAck(socketIndex);
-    }
+    startSenders();
+    for (NnSize i = 0; i < senders.size(); i++)
+        senders[i]->finish();
     if (tempSize > 0) {
         delete[] temp;
         tempSize = 0;
@@ -773,63 +1858,248 @@ void NnRootWeightLoader::allocate(NnSize size) {
 }
 
 void NnRootWeightLoader::writeWeight(NnSize nodeIndex, const char *opName, NnSize opIndex, NnSize nBytes, NnByte *weight) {
-    NnSize nameSize = std::strlen(opName) + 1;
-    NnSize socketIndex = nodeIndex - 1;
-    network->write(socketIndex, &nameSize, sizeof(nameSize));
-    network->write(socketIndex, opName, nameSize);
-    network->write(socketIndex, &opIndex, sizeof(opIndex));
-    network->write(socketIndex, &nBytes, sizeof(nBytes));
-    network->write(socketIndex, weight, nBytes);
+    NnWeightSendJob job;
+    job.type = SEND_WHOLE;
+    job.opName = opName;
+    job.opIndex = opIndex;
+    job.nBytes = nBytes;
+    job.weight = weight;
+    startSenders();
+    senders[nodeIndex - 1]->push(job);
 }
 
 NnSize NnRootWeightLoader::loadRoot(const char *opName, NnSize opIndex, NnSize nBytes, NnByte *weight) {
-    executor->loadWeight(opName, opIndex, nBytes, weight);
+    loadRootWeight(opName, opIndex, nBytes, weight);
+    return nBytes;
+}
+
+NnSize NnRootWeightLoader::loadNode(NnSize nodeIndex, const char *opName, NnSize opIndex, NnSize nBytes, NnByte *weight) {
+    if (nodeIndex == 0)
+        loadRootWeight(opName, opIndex, nBytes, weight);
+    else
+        writeWeight(nodeIndex, opName, opIndex, nBytes, weight);
     return nBytes;
 }
 
 NnSize NnRootWeightLoader::loadAll(const char *opName, NnSize opIndex, NnSize nBytes, NnByte *weight) {
     for (NnSize nodeIndex = 0; nodeIndex < nNodes; nodeIndex++) {
         if (nodeIndex == 0)
-            executor->loadWeight(opName, opIndex, nBytes, weight);
+            loadRootWeight(opName, opIndex, nBytes, weight);
         else
             writeWeight(nodeIndex, opName, opIndex, nBytes, weight);
     }
     return nBytes;
 }
 
-NnSize NnRootWeightLoader::loadRowMatmulSlices(const char *opName, NnSize opIndex, NnRowMatmulSlice *slice, NnByte *weight) {
-    allocate(slice->sliceSize.nBytes);
-    for (NnSize nodeIndex = 0; nodeIndex < nNodes; nodeIndex++) {
-        splitRowMatmulWeight(slice, nodeIndex, weight, temp);
-        if (nodeIndex == 0)
-            executor->loadWeight(opName, opIndex, slice->sliceSize.nBytes, temp);
-        else
-            writeWeight(nodeIndex, opName, opIndex, slice->sliceSize.nBytes, temp);
+NnSize NnRootWeightLoader::loadRowMatmulSlices(const char *opName, NnSize opIndex, NnRowMatmulSlice *slices, NnByte *weight) {
+    NnRowMatmulSlice *rootSlice = &slices[0];
+    if (nNodes == 1) {
+        // A single slice has the same layout as the whole matrix
+        loadRootWeight(opName, opIndex, rootSlice->size.nBytes, weight);
+        return rootSlice->size.nBytes;
+    }
+    startSenders();
+    for (NnSize nodeIndex = 1; nodeIndex < nNodes; nodeIndex++) {
+        NnWeightSendJob job;
+        job.type = SEND_ROW_SLICE;
+        job.opName = opName;
+        job.opIndex = opIndex;
+        job.nBytes = slices[nodeIndex].sliceSize.nBytes;
+        job.weight = weight;
+        job.rowSlice = slices[nodeIndex];
+        senders[nodeIndex - 1]->push(job);
     }
-    return slice->size.nBytes;
+
+    if (executor != nullptr) {
+        allocate(rootSlice->sliceSize.nBytes);
+        splitRowMatmulWeight(rootSlice, weight, temp);
+        executor->loadWeight(opName, opIndex, rootSlice->sliceSize.nBytes, temp);
+    }
+    return rootSlice->size.nBytes;
 }
 
-NnSize NnRootWeightLoader::loadColMatmulSlices(const char *opName, NnSize opIndex, NnColMatmulSlice *slice, NnByte *weight) {
-    allocate(slice->sliceSize.nBytes);
-    for (NnSize nodeIndex = 0; nodeIndex < nNodes; nodeIndex++) {
-        splitColMatmulWeight(slice, nodeIndex, weight, temp);
-        if (nodeIndex == 0)
-            executor->loadWeight(opName, opIndex, slice->sliceSize.nBytes, temp);
-        else
-            writeWeight(nodeIndex, opName, opIndex, slice->sliceSize.nBytes, temp);
+NnSize NnRootWeightLoader::loadColMatmulSlices(const char *opName, NnSize opIndex, NnColMatmulSlice *slices, NnByte *weight) {
+    NnColMatmulSlice *rootSlice = &slices[0];
+    if (nNodes == 1) {
+        loadRootWeight(opName, opIndex, rootSlice->size.nBytes, weight);
+        return rootSlice->size.nBytes;
     }
-    return slice->size.nBytes;
+    startSenders();
+    for (NnSize nodeIndex = 1; nodeIndex < nNodes; nodeIndex++) {
+        NnWeightSendJob job;
+        job.type = SEND_COL_SLICE;
+        job.opName = opName;
+        job.opIndex = opIndex;
+        job.nBytes = slices[nodeIndex].sliceSize.nBytes;
+        job.weight = weight;
+        job.colSlice = slices[nodeIndex];
+        senders[nodeIndex - 1]->push(job);
+    }
+
+    if (executor != nullptr) {
+        allocate(rootSlice->sliceSize.nBytes);
+        splitColMatmulWeight(rootSlice, weight, temp);
+        executor->loadWeight(opName, opIndex, rootSlice->sliceSize.nBytes, temp);
+    }
+    return rootSlice->size.nBytes;
 }
 
 NnWorkerWeightReader::NnWorkerWeightReader(NnExecutor *executor, NnNetwork *network) {
     this->executor = executor;
     this->network = network;
     this->tempSize = 0;
+    this->shardPath = nullptr;
+    this->shardData = nullptr;
+    this->shardSize = 0;
 }
 
 NnWorkerWeightReader::~NnWorkerWeightReader() {
     if (tempSize > 0)
         delete[] temp;
+    releaseShard();
+}
+
+void NnWorkerWeightReader::setShardPath(const char *path) {
+    shardPath = path;
+}
+
+void NnWorkerWeightReader::releaseShard() {
+    if (shardData == nullptr)
+        return;
+#ifdef _WIN32
+    delete[] shardData;
+#else
+    munmap(shardData, shardSize);
+#endif
+    shardData = nullptr;
+    shardSize = 0;
+}
+
+static NnOpConfig *findWeightOp(NnNodeConfig *nodeConfig, const char *name, NnSize index, NnSize *flatIndex) {
+    NnSize i = 0;
+    for (NnSize segmentIndex = 0; segmentIndex < nodeConfig->nSegments; segmentIndex++) {
+        NnSegmentConfig *segment = &nodeConfig->segments[segmentIndex];
+        for (NnSize opIndex = 0; opIndex < segment->nOps; opIndex++, i++) {
+            NnOpConfig *op = &segment->ops[opIndex];
+            if (op->index == index && std::strcmp(op->name, name) == 0) {
+                *flatIndex = i;
+                return op;
+            }
+        }
+    }
+    return nullptr;
+}
+
+bool NnWorkerWeightReader::loadShard(std::uint64_t fingerprint) {
+    if (shardPath == nullptr || fingerprint == 0)
+        return false;
+    FILE *file = fopen(shardPath, "rb");
+    if (file == nullptr) {
+        printf("⚠️ Cannot open shard %s\n", shardPath);
+        return false;
+    }
+    fseek(file, 0, SEEK_END);
+    long fileSize = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    if (fileSize < (long)sizeof(NnShardHeader)) {
+        fclose(file);
+        printf("⚠️ Shard %s is too small\n", shardPath);
+        return false;
+    }
+    shardSize = (size_t)fileSize;
+#ifdef _WIN32
+    shardData = new NnByte[shardSize];
+    if (fread(shardData, 1, shardSize, file) != shardSize)
+        releaseShard();
+    fclose(file);
+#else
+    void *data = mmap(nullptr, shardSize, PROT_READ, MAP_PRIVATE, fileno(file), 0);
+    fclose(file);
+    shardData = data == MAP_FAILED ? nullptr : (NnByte *)data;
+#endif
+    if (shardData == nullptr) {
+        printf("⚠️ Cannot read shard %s\n", shardPath);
+        return false;
+    }
+
+    // The whole manifest is checked before any weight is used, a mapped weight cannot be replaced later
+    NnNodeConfig *nodeConfig = executor->nodeConfig;
+    NnShardHeader *header = (NnShardHeader *)shardData;
+    const char *reason = nullptr;
+    if (header->magic != SHARD_MAGIC || header->version != SHARD_VERSION)
+        reason = "unsupported format";
+    else if (header->nodeIndex != nodeConfig->nodeIndex || header->nNodes != executor->netConfig->nNodes)
+        reason = "it was written for another node";
+    else if (header->fingerprint != fingerprint)
+        reason = "it was written for another model";
+    else if (header->configFingerprint != getConfigFingerprint(executor->netConfig, nodeConfig))
+        reason = "it was written for another node layout";
+
+    NnSize nWeightOps = 0;
+    NnSize nOps = 0;
+    for (NnSize segmentIndex = 0; segmentIndex < nodeConfig->nSegments; segmentIndex++) {
+        NnSegmentConfig *segment = &nodeConfig->segments[segmentIndex];
+        for (NnSize opIndex = 0; opIndex < segment->nOps; opIndex++) {
+            if (segment->ops[opIndex].weightSize.nBytes > 0)
+                nWeightOps++;
+        }
+        nOps += segment->nOps;
+    }
+    std::vector<bool> isLoaded(nOps, false);
+    NnSize nLoadedOps = 0;
+    size_t offset = sizeof(NnShardHeader);
+    while (reason == nullptr) {
+        if (offset + sizeof(NnShardWeightHeader) > shardSize) {
+            reason = "it is truncated";
+            break;
+        }
+        NnShardWeightHeader *weightHeader = (NnShardWeightHeader *)&shardData[offset];
+        if (weightHeader->nameSize == 0)
+            break;
+        size_t dataOffset = offset + sizeof(NnShardWeightHeader) + weightHeader->nameSize + weightHeader->padding;
+        const char *name = (const char *)&shardData[offset + sizeof(NnShardWeightHeader)];
+        if (dataOffset + weightHeader->nBytes > shardSize || name[weightHeader->nameSize - 1] != '\0') {
+            reason = "it is truncated";
+            break;
+        }
+        NnSize flatIndex;
+        NnOpConfig *op = findWeightOp(nodeConfig, name, weightHeader->opIndex, &flatIndex);
+        if (op == nullptr || op->weightSize.nBytes != weightHeader->nBytes || isLoaded[flatIndex]) {
+            reason = "its weights do not match the node config";
+            break;
+        }
+        isLoaded[flatIndex] = true;
+        nLoadedOps++;
+        offset = dataOffset + weightHeader->nBytes;
+    }
+    if (reason == nullptr && nLoadedOps != nWeightOps)
+        reason = "its weights do not match the node config";
+    if (reason != nullptr) {
+        printf("⚠️ Shard %s is not used, %s\n", shardPath, reason);
+        releaseShard();
+        return false;
+    }
+
+    NnSize mappedBytes = 0;
+    offset = sizeof(NnShardHeader);
+    while (true) {
+        NnShardWeightHeader *weightHeader = (NnShardWeightHeader *)&shardData[offset];
+        if (weightHeader->nameSize == 0)
+            break;
+        const char *name = (const char *)&shardData[offset + sizeof(NnShardWeightHeader)];
+        NnByte *data = &shardData[offset + sizeof(NnShardWeightHeader) + weightHeader->nameSize + weightHeader->padding];
+#ifdef _WIN32
+        executor->loadWeight(name, weightHeader->opIndex, weightHeader->nBytes, data);
+#else
+        if (executor->mapWeight(name, weightHeader->opIndex, weightHeader->nBytes, data))
+            mappedBytes += weightHeader->nBytes;
+#endif
+        offset = (size_t)(data - shardData) + weightHeader->nBytes;
+    }
+    printf("💿 Weights loaded from shard %s (mapped: %u kB)\n", shardPath, mappedBytes / 1024);
+    if (mappedBytes == 0)
+        releaseShard(); // every weight was copied
+    return true;
 }
 
 void NnWorkerWeightReader::allocate(NnSize size) {
@@ -841,10 +2111,31 @@ void NnWorkerWeightReader::allocate(NnSize size) {
     }
 }
 
+std::uint64_t NnWorkerWeightReader::readFingerprint(NnNetwork *network) {
+    std::uint64_t fingerprint;
+    network->read(ROOT_SOCKET_INDEX, &fingerprint, sizeof(fingerprint));
+    return fingerprint;
+}
+
+void NnWorkerWeightReader::keepWeights(NnNetwork *network) {
+    NnSize hasWeights = 1;
+    network->write(ROOT_SOCKET_INDEX, &hasWeights, sizeof(hasWeights));
+}
+
 void NnWorkerWeightReader::read() {
+    read(readFingerprint(network));
+}
+
+void NnWorkerWeightReader::read(std::uint64_t fingerprint) {
     NnSize nameSize;
     NnSize opIndex;
     NnSize nBytes;
+    if (loadShard(fingerprint)) {
+        keepWeights(network);
+        return;
+    }
+    NnSize hasWeights = 0;
+    network->write(ROOT_SOCKET_INDEX, &hasWeights, sizeof(hasWeights));
     while (true) {
         network->read(0, &nameSize, sizeof(nameSize));
         if (nameSize == 0) {
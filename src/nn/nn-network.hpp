@@ -28,28 +28,53 @@ public:
     NnWriteNetworkException(int code, const char *message);
 };
 
+enum NnNetworkWaitType {
+    NET_WAIT_SPIN, // non-blocking sockets retry immediately on EAGAIN
+    NET_WAIT_POLL, // non-blocking sockets wait for readiness with poll()
+};
+
 struct NnSocketIo {
     NnSize socketIndex;
-    const void *data;
-    size_t size;
+    const void *data; // first row
+    size_t size; // bytes per row
+    NnSize nRows; // rows are transferred together in a single scatter/gather call
+    size_t rowStride; // bytes between the starts of two rows
 };
 
+struct NnShmLink;
+
+typedef struct {
+    unsigned long long bitsPerSecond; // 0 = unlimited
+    NnSize latencyUs; // one-way
+} NnLinkShaper;
+
 class NnNetwork {
 private:
     int *sockets;
+    NnShmLink **links; // shared-memory link per socket, nullptr if the peer is reached over TCP
     std::atomic_uint sentBytes;
     std::atomic_uint recvBytes;
+    NnNetworkWaitType waitType;
+    std::atomic_ulong *waitTimes; // microseconds per socket
+    NnLinkShaper shaper;
+    std::vector<double> linkFreeTimes; // seconds, when each emulated link finishes its queued writes
 
 public:
-    static std::unique_ptr<NnNetwork> serve(int port);
-    static std::unique_ptr<NnNetwork> connect(NnSize nSockets, char **hosts, NnSize *ports);
+    // Peers on the same host exchange data through shared memory if both sides enable it, other peers use TCP
+    static std::unique_ptr<NnNetwork> serve(int port, bool useSharedMemory);
+    static std::unique_ptr<NnNetwork> connect(NnSize nSockets, char **hosts, NnSize *ports, bool useSharedMemory);
+    // Connects nNodes nodes of one process with socket pairs, the result is indexed by the node index
+    static std::vector<std::unique_ptr<NnNetwork>> createLoopback(NnSize nNodes);
 
     NnSize nSockets;
 
-    NnNetwork(NnSize nSockets, int *sockets);
+    NnNetwork(NnSize nSockets, int *sockets, NnShmLink **links);
     ~NnNetwork();
 
     void setTurbo(bool enabled);
+    void setWaitType(NnNetworkWaitType waitType);
+    // Delays writes as if every socket was a link with the given latency and bandwidth
+    void setLinkShaper(NnLinkShaper shaper);
     void write(NnSize socketIndex, const void *data, size_t size);
     void read(NnSize socketIndex, void *data, size_t size);
     void writeAck(NnSize socketIndex);
@@ -58,8 +83,14 @@ public:
     void writeMany(NnSize n, NnSocketIo *ios);
     void writeAll(void *data, size_t size);
     void readMany(NnSize n, NnSocketIo *ios);
+    void writeReadMany(NnSize nWrites, NnSocketIo *writeIos, NnSize nReads, NnSocketIo *readIos);
     void getStats(size_t *sentBytes, size_t *recvBytes);
     void resetStats();
+    // Time spent waiting for each socket to become ready since the last call, only measured in the poll mode
+    void getWaitStats(unsigned long *waitTimes);
+private:
+    void shapeWrites(NnSize n, NnSocketIo *ios);
+    void waitForIos(NnSize nWrites, NnSocketIo *writeIos, size_t *sent, NnSize nReads, NnSocketIo *readIos, size_t *received);
 };
 
 class NnNetworkNodeSynchronizer : public NnNodeSynchronizer {
@@ -68,9 +99,13 @@ private:
     NnNetExecution *execution;
     NnNetConfig *netConfig;
     NnNodeConfig *nodeConfig;
+    std::vector<NnByte> ringChunkBuffer;
+    std::vector<float> ringFloatBuffer;
 public:
     NnNetworkNodeSynchronizer(NnNetwork *network, NnNetExecution *execution, NnNetConfig *netConfig, NnNodeConfig *nodeConfig);
     ~NnNetworkNodeSynchronizer() override {};
+    // A worker keeps its node between root connections, only the network is replaced
+    void setNetwork(NnNetwork *network);
     void sync(NnSize segmentIndex, NnSize nThreads, NnSize threadIndex) override;
 };
 
@@ -93,6 +128,30 @@ public:
     NnNodeConfig readNode();
 };
 
+#define SHARD_MAGIC 0x0D11A5D5
+#define SHARD_VERSION 2
+#define SHARD_ALIGNMENT 64
+
+// A shard file holds the weights of one worker: the header, then the weights in the order of the weight
+// stream (NnShardWeightHeader, name, padding, data aligned to SHARD_ALIGNMENT), then a header with nameSize = 0
+typedef struct {
+    NnSize magic;
+    NnSize version;
+    NnSize nodeIndex;
+    NnSize nNodes;
+    std::uint64_t fingerprint; // identifies the model, see NnRootWeightLoader::setModelFingerprint
+    std::uint64_t configFingerprint; // identifies the slices of the node, see getConfigFingerprint
+} NnShardHeader;
+
+typedef struct {
+    NnSize nameSize; // with the terminating zero
+    NnSize opIndex;
+    NnSize nBytes;
+    NnSize padding; // bytes between the name and the data
+} NnShardWeightHeader;
+
+class NnWeightSender;
+
 class NnRootWeightLoader {
 private:
     NnExecutor *executor;
@@ -100,17 +159,39 @@ private:
     NnSize nNodes;
     NnByte *temp;
     NnSize tempSize;
+    bool isMappingEnabled;
+    NnSize mappedBytes;
+    std::vector<std::unique_ptr<NnWeightSender>> senders; // one per worker
+    std::uint64_t fingerprint;
+    const char *shardPrefix;
+    std::vector<std::uint64_t> configFingerprints; // per node, only for shard output
 public:
+    // Without an executor the root weights are skipped, that is used to write shards
     NnRootWeightLoader(NnExecutor *executor, NnNetwork *network, NnSize nNodes);
     ~NnRootWeightLoader();
+    // The root node uses weights in place when it can, the source memory must outlive the executor
+    void enableMapping();
+    NnSize getMappedBytes();
+    // Must be called before the first weight, workers with a matching shard do not receive their weights
+    void setModelFingerprint(std::uint64_t fingerprint);
+    // Writes the weights of each worker to <prefix>-<nodeIndex>.shard instead of sending them,
+    // the node configs are fingerprinted so a shard is never used with slices of another layout
+    void enableShardOutput(const char *prefix, NnNetConfig *netConfig, NnNodeConfig *nodeConfigs);
+    // Workers receive their weights in the background, the source memory must stay valid until finish()
     void writeWeight(NnSize nodeIndex, const char *opName, NnSize opIndex, NnSize nBytes, NnByte *weight);
     NnSize loadRoot(const char *opName, NnSize opIndex, NnSize nBytes, NnByte *weight);
+    // The whole weight to a single node
+    NnSize loadNode(NnSize nodeIndex, const char *opName, NnSize opIndex, NnSize nBytes, NnByte *weight);
     NnSize loadAll(const char *opName, NnSize opIndex, NnSize nBytes, NnByte *weight);
-    NnSize loadRowMatmulSlices(const char *opName, NnSize opIndex, NnRowMatmulSlice *slice, NnByte *weight);
-    NnSize loadColMatmulSlices(const char *opName, NnSize opIndex, NnColMatmulSlice *slice, NnByte *weight);
+    // The slices array holds one slice per node
+    NnSize loadRowMatmulSlices(const char *opName, NnSize opIndex, NnRowMatmulSlice *slices, NnByte *weight);
+    NnSize loadColMatmulSlices(const char *opName, NnSize opIndex, NnColMatmulSlice *slices, NnByte *weight);
     void finish();
 private:
-    void allocate(NnSize size);};
+    void startSenders();
+    void allocate(NnSize size);
+    void loadRootWeight(const char *opName, NnSize opIndex, NnSize nBytes, NnByte *weight);
+};
 
 class NnWorkerWeightReader {
 private:
@@ -118,12 +199,25 @@ private:
     NnNetwork *network;
     NnByte *temp;
     NnSize tempSize;
+    const char *shardPath;
+    NnByte *shardData;
+    size_t shardSize;
 public:
     NnWorkerWeightReader(NnExecutor *executor, NnNetwork *network);
+    // Weights may point into the mapped shard, so the reader must outlive the executor's forward passes
     ~NnWorkerWeightReader();
+    // The shard is used only if it was written for this node and the model of the root
+    void setShardPath(const char *path);
+    // The root starts the weights with the fingerprint of its model, 0 if it is unknown
+    static std::uint64_t readFingerprint(NnNetwork *network);
+    // Tells the root that the weights of the fingerprint are already loaded, so it sends nothing
+    static void keepWeights(NnNetwork *network);
     void read();
+    void read(std::uint64_t fingerprint);
 private:
     void allocate(NnSize size);
+    bool loadShard(std::uint64_t fingerprint);
+    void releaseShard();
 };
 
 #endif
@@ -4,6 +4,9 @@
 #include <cmath>
 #include <stdexcept>
 #include <cstdio>
+#if defined(__AVX2__)
+    #include <immintrin.h>
+#endif
 
 #if defined(CONVERT_F16_TO_F32_LOOKUP)
 float f16ToF32Lookup[65536];
@@ -64,6 +67,19 @@ NnFp16 convertF32ToF16Impl(const float x) {
     return s | (e << 10) | (m >> 13);
 }
 
+void quantizeF32toF16(const float *input, NnFp16 *output, const NnSize n, const NnSize nThreads, const NnSize threadIndex) {
+    SPLIT_THREADS(start, end, n, nThreads, threadIndex);
+    NnSize i = start;
+#if defined(__AVX2__) && defined(__F16C__)
+    for (; i + 8 <= end; i += 8) {
+        const __m256 x = _mm256_loadu_ps(&input[i]);
+        _mm_storeu_si128((__m128i *)&output[i], _mm256_cvtps_ph(x, _MM_FROUND_TO_NEAREST_INT));
+    }
+#endif
+    for (; i < end; i++)
+        output[i] = CONVERT_F32_TO_F16(input[i]);
+}
+
 void quantizeF32toQ80(const float *input, NnBlockQ80 *output, const NnSize n, const NnSize nThreads, const NnSize threadIndex) {
     assert(n % Q80_BLOCK_SIZE == 0);
     const NnSize nBlocks = n / Q80_BLOCK_SIZE;
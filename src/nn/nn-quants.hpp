@@ -67,6 +67,7 @@ typedef struct {
 } NnBlockQ80;
 
 void initQuants();
+void quantizeF32toF16(const float *input, NnFp16 *output, const NnSize n, const NnSize nThreads, const NnSize threadIndex);
 void quantizeF32toQ80(const float *input, NnBlockQ80 *output, const NnSize k, const NnSize nThreads, const NnSize threadIndex);
 void dequantizeQ80toF32(const NnBlockQ80 *input, float* output, const NnSize k, const NnSize nThreads, const NnSize threadIndex);
 void quantizeF32toQ40(const float *x, NnBlockQ40 *output, const NnSize n, const NnSize nThreads, const NnSize threadIndex);